@@ -0,0 +1,344 @@
+// Benchmark of the framebuffer diffing strategies in diff.cpp. Runs each strategy over a set of synthetic frame sequences, and over
+// any frame traces given on the command line (see trace.h), at the resolutions of the supported displays. For each combination, it
+// reports the time spent diffing per frame, and the number of spans, pixels and SPI bus bytes per frame that the main loop would send,
+// including the set cursor commands, in the bus framing of the display that fbcp-ili9341 was configured for.
+// Usage: fbcp-diff-benchmark [--json] [--frames N] [trace files...]. The results are written to stdout as CSV, or as JSON with --json.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // atoi
+#include <string.h> // memcpy, memset, strcmp, strrchr
+#include <time.h> // clock_gettime
+
+#include "../config.h"
+#include "../display.h"
+#include "../diff.h"
+#include "../display_commands.h"
+#include "../mem_alloc.h"
+#include "../trace.h"
+#include "../util.h"
+
+// The diffing functions operate on the size of the frame source, normally set up in gpu.cpp
+int gpuFrameWidth = 0, gpuFrameHeight = 0, gpuFramebufferScanlineStrideBytes = 0;
+int displayXOffset = 0, displayYOffset = 0;
+
+#ifdef USE_DMA_TRANSFERS
+int dmaIsFasterThanPolledSpi = DMA_IS_FASTER_THAN_POLLED_SPI;
+#endif
+
+struct Resolution
+{
+  const char *display;
+  int width, height;
+};
+
+// Landscape resolutions of the display controllers that fbcp-ili9341 supports
+static const Resolution resolutions[] = {
+  { "SSD1351", 128, 96 },
+  { "ST7735S", 130, 129 },
+  { "ST7735R", 160, 128 },
+  { "ST7789", 240, 240 },
+  { "ILI9341", 320, 240 },
+  { "ILI9486", 480, 320 },
+};
+#define NUM_RESOLUTIONS (sizeof(resolutions)/sizeof(resolutions[0]))
+
+enum Strategy
+{
+  STRATEGY_EXACT,
+  STRATEGY_FAST_AND_COARSE_4_WIDE,
+  STRATEGY_SINGLE_CHANGED_RECTANGLE,
+  STRATEGY_NO_DIFF,
+  NUM_STRATEGIES
+};
+
+static const char * const strategyNames[NUM_STRATEGIES] = { "Exact", "FastAndCoarse4Wide", "SingleChangedRectangle", "NoDiff" };
+
+// Synthetic frame sequences. Each generator updates the given frame in place from its previous contents to produce frame number i.
+typedef void (*GenerateFrameFunc)(uint16_t *frame, int width, int height, int i);
+
+static uint32_t rngState = 1;
+
+static uint32_t Random()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static uint16_t Background(int x, int y, int width, int height)
+{
+  return (uint16_t)(((x * 31 / width) << 11) | ((y * 63 / height) << 5) | 8);
+}
+
+static void FillBackground(uint16_t *frame, int width, int height)
+{
+  for(int y = 0; y < height; ++y)
+    for(int x = 0; x < width; ++x)
+      frame[y*width + x] = Background(x, y, width, height);
+}
+
+// A frame that does not change, e.g. an idle desktop
+static void GenerateStatic(uint16_t *frame, int width, int height, int i)
+{
+  if (i == 0) FillBackground(frame, width, height);
+}
+
+#define SPRITE_SIZE 16
+
+// A small sprite, e.g. a mouse cursor, moving over a static background
+static void GenerateSprite(uint16_t *frame, int width, int height, int i)
+{
+  if (i == 0) FillBackground(frame, width, height);
+  const int rangeX = width - SPRITE_SIZE, rangeY = height - SPRITE_SIZE;
+  for(int step = i - 1; step <= i; ++step)
+  {
+    if (step < 0) continue;
+    // Bounce back and forth within the frame
+    int x = (step * 3) % (2 * rangeX), y = (step * 2) % (2 * rangeY);
+    if (x >= rangeX) x = 2 * rangeX - x;
+    if (y >= rangeY) y = 2 * rangeY - y;
+    for(int sy = y; sy < y + SPRITE_SIZE; ++sy)
+      for(int sx = x; sx < x + SPRITE_SIZE; ++sx)
+        frame[sy*width + sx] = (step == i) ? 0xFFFF : Background(sx, sy, width, height);
+  }
+}
+
+#define GLYPH_SIZE 8
+
+// Text being typed into a terminal, a couple of glyphs per frame
+static void GenerateTerminal(uint16_t *frame, int width, int height, int i)
+{
+  const int columns = width / GLYPH_SIZE, rows = height / GLYPH_SIZE;
+  if (i == 0) memset(frame, 0, width*height*sizeof(uint16_t));
+  for(int glyph = i*2; glyph < i*2 + 2; ++glyph)
+  {
+    int cell = glyph % (columns * rows);
+    if (cell == 0) memset(frame, 0, width*height*sizeof(uint16_t)); // Clear screen when the terminal fills up
+    int x0 = (cell % columns) * GLYPH_SIZE, y0 = (cell / columns) * GLYPH_SIZE;
+    uint32_t bits = Random();
+    for(int y = 1; y < GLYPH_SIZE - 1; ++y)
+      for(int x = 1; x < GLYPH_SIZE - 1; ++x)
+        frame[(y0 + y)*width + x0 + x] = (bits & (1u << ((y * 6 + x) & 31))) ? 0xC618 : 0;
+  }
+}
+
+#define SCROLL_SPEED 2
+
+// Contents scrolling up a couple of scanlines per frame, e.g. a web page or a list
+static void GenerateScroll(uint16_t *frame, int width, int height, int i)
+{
+  if (i == 0)
+  {
+    for(int y = 0; y < height; ++y)
+      for(int x = 0; x < width; ++x)
+        frame[y*width + x] = ((x / GLYPH_SIZE + y / GLYPH_SIZE) & 1) ? 0xFFFF : Background(x, y, width, height);
+    return;
+  }
+  memmove(frame, frame + SCROLL_SPEED*width, (height - SCROLL_SPEED)*width*sizeof(uint16_t));
+  for(int y = height - SCROLL_SPEED; y < height; ++y)
+  {
+    int contentY = y + i * SCROLL_SPEED;
+    for(int x = 0; x < width; ++x)
+      frame[y*width + x] = ((x / GLYPH_SIZE + contentY / GLYPH_SIZE) & 1) ? 0xFFFF : Background(x, contentY % height, width, height);
+  }
+}
+
+// Video playing in a window that covers most of the frame, changing every pixel in it each frame
+static void GenerateVideo(uint16_t *frame, int width, int height, int i)
+{
+  if (i == 0) FillBackground(frame, width, height);
+  const int x0 = width / 8, y0 = height / 8, x1 = width - width / 8, y1 = height - height / 8;
+  for(int y = y0; y < y1; ++y)
+    for(int x = x0; x < x1; ++x)
+      frame[y*width + x] = (uint16_t)(((x + i) * 31 / width) << 11 | ((y + 2*i) & 63) << 5 | (Random() & 31));
+}
+
+// Sparse single pixel changes scattered around the frame, e.g. blinking indicators or dithering noise
+static void GenerateSparse(uint16_t *frame, int width, int height, int i)
+{
+  if (i == 0) FillBackground(frame, width, height);
+  const int numPixels = width * height / 200;
+  for(int p = 0; p < numPixels; ++p)
+    frame[Random() % (width*height)] ^= 0x0841;
+}
+
+struct Sequence
+{
+  const char *name;
+  GenerateFrameFunc generate; // Null for recorded traces
+  const char *traceFilename;
+};
+
+// Copies the current frame of a trace to the middle of the benchmark frame, cropping it if it is larger
+static void CopyTraceFrame(const FrameTraceReader &reader, uint16_t *frame, int width, int height)
+{
+  const int traceWidth = (int)reader.header.width, traceHeight = (int)reader.header.height;
+  const int copyWidth = MIN(width, traceWidth), copyHeight = MIN(height, traceHeight);
+  const int dstX = (width - copyWidth) / 2, dstY = (height - copyHeight) / 2;
+  const int srcX = (traceWidth - copyWidth) / 2, srcY = (traceHeight - copyHeight) / 2;
+  for(int y = 0; y < copyHeight; ++y)
+    memcpy(frame + (dstY + y)*width + dstX, reader.frame + (srcY + y)*traceWidth + srcX, copyWidth*sizeof(uint16_t));
+}
+
+// SPI bus bytes of the display commands that the main loop sends, see PlanDisplayCommands() in display_commands.cpp
+#define MOVE_CURSOR_BYTES (SPI_COMMAND_BYTES + SPI_COORDINATE_BYTES)
+#define SET_WRITE_WINDOW_BYTES (SPI_COMMAND_BYTES + 2*SPI_COORDINATE_BYTES)
+
+// Returns the number of bytes that submitting the given spans would send on the SPI bus, following the plan of the main loop
+static uint64_t EstimateSpiBytes(Span *head, DisplayWindowState &window)
+{
+  uint64_t bytes = 0;
+  DisplayCommand *end = PlanDisplayCommands(head, window, 0);
+  for(DisplayCommand *c = displayCommands; c < end; ++c)
+    switch(c->type)
+    {
+    case SET_CURSOR_X: case SET_CURSOR_Y: bytes += MOVE_CURSOR_BYTES; break;
+    case SET_WINDOW_X: case SET_WINDOW_Y: bytes += SET_WRITE_WINDOW_BYTES; break;
+    default: bytes += SPI_COMMAND_BYTES + (uint64_t)c->span->size * SPI_BYTESPERPIXEL; break;
+    }
+  return bytes;
+}
+
+// Copies the pixels of the spans to the previous framebuffer, like the main loop does when it sends them
+static void ApplySpans(Span *head, const uint16_t *frame, uint16_t *prevFrame)
+{
+  for(Span *i = head; i; i = i->next)
+    for(int y = i->y; y < i->endY; ++y)
+    {
+      int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+      memcpy(prevFrame + y*gpuFrameWidth + i->x, frame + y*gpuFrameWidth + i->x, (endX - i->x)*sizeof(uint16_t));
+    }
+}
+
+static uint64_t NowNsecs()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+struct Result
+{
+  int frames;
+  uint64_t diffNsecs, spans, pixels, spiBytes;
+};
+
+// Runs one strategy over one sequence at the current resolution. Returns false if the combination is not supported.
+static bool RunBenchmark(Strategy strategy, const Sequence &sequence, int maxFrames, uint16_t *frame, uint16_t *prevFrame, Result &result)
+{
+  // The 4-wide diff reads four pixels at a time, see the main loop for the same check
+  if (strategy == STRATEGY_FAST_AND_COARSE_4_WIDE && (gpuFrameWidth % 4 != 0 || gpuFramebufferScanlineStrideBytes % 8 != 0)) return false;
+
+  FrameTraceReader reader;
+  if (!sequence.generate && !OpenFrameTraceReader(reader, sequence.traceFilename)) return false;
+
+  memset(&result, 0, sizeof(result));
+  memset(frame, 0, gpuFramebufferScanlineStrideBytes*gpuFrameHeight);
+  memset(prevFrame, 0, gpuFramebufferScanlineStrideBytes*gpuFrameHeight); // The display starts out cleared to black
+  DisplayWindowState window = UnknownDisplayWindowState();
+  rngState = 1;
+
+  for(int i = 0; i < maxFrames; ++i)
+  {
+    if (sequence.generate) sequence.generate(frame, gpuFrameWidth, gpuFrameHeight, i);
+    else if (ReadNextTraceFrame(reader)) CopyTraceFrame(reader, frame, gpuFrameWidth, gpuFrameHeight);
+    else break;
+
+    Span *head = 0;
+    uint64_t t0 = NowNsecs();
+    switch(strategy)
+    {
+    case STRATEGY_EXACT: DiffFramebuffersToScanlineSpansExact(frame, prevFrame, false, 0, head); MergeScanlineSpanList(head); break;
+    case STRATEGY_FAST_AND_COARSE_4_WIDE: DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(frame, prevFrame, false, 0, head); MergeScanlineSpanList(head); break;
+    case STRATEGY_SINGLE_CHANGED_RECTANGLE: DiffFramebuffersToSingleChangedRectangle(frame, prevFrame, head); break;
+    case STRATEGY_NO_DIFF: NoDiffChangedRectangle(head); break;
+    default: break;
+    }
+    result.diffNsecs += NowNsecs() - t0;
+
+    for(Span *s = head; s; s = s->next)
+    {
+      ++result.spans;
+      result.pixels += s->size;
+    }
+    result.spiBytes += EstimateSpiBytes(head, window);
+    ApplySpans(head, frame, prevFrame);
+    ++result.frames;
+  }
+
+  if (!sequence.generate) CloseFrameTraceReader(reader);
+  return result.frames > 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool json = false;
+  int maxFrames = 240;
+  Sequence sequences[64] = {
+    { "static", GenerateStatic, 0 },
+    { "sprite", GenerateSprite, 0 },
+    { "terminal", GenerateTerminal, 0 },
+    { "scroll", GenerateScroll, 0 },
+    { "video", GenerateVideo, 0 },
+    { "sparse", GenerateSparse, 0 },
+  };
+  int numSequences = 6;
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--json")) json = true;
+    else if (!strcmp(argv[i], "--frames") && i+1 < argc) maxFrames = atoi(argv[++i]);
+    else if (numSequences < (int)(sizeof(sequences)/sizeof(sequences[0])))
+    {
+      const char *name = strrchr(argv[i], '/');
+      sequences[numSequences].name = name ? name+1 : argv[i];
+      sequences[numSequences].generate = 0;
+      sequences[numSequences].traceFilename = argv[i];
+      ++numSequences;
+    }
+  }
+  if (maxFrames <= 0)
+  {
+    printf("Usage: fbcp-diff-benchmark [--json] [--frames N] [trace files...]\n");
+    return 1;
+  }
+
+  int maxPixels = 0;
+  for(size_t r = 0; r < NUM_RESOLUTIONS; ++r)
+    maxPixels = MAX(maxPixels, resolutions[r].width * resolutions[r].height);
+  uint16_t *frame = (uint16_t*)Malloc(maxPixels*sizeof(uint16_t), "diff_benchmark.cpp frame");
+  uint16_t *prevFrame = (uint16_t*)Malloc(maxPixels*sizeof(uint16_t), "diff_benchmark.cpp previous frame");
+  spans = (Span*)Malloc((maxPixels/2 + 1024) * sizeof(Span), "diff_benchmark.cpp spans");
+  displayCommands = (DisplayCommand*)Malloc(3 * (maxPixels/2 + 1024) * sizeof(DisplayCommand), "diff_benchmark.cpp display commands");
+  InitDiffThreads();
+
+  if (json) printf("[\n");
+  else printf("display,width,height,sequence,strategy,frames,diffNsPerFrame,spansPerFrame,pixelsPerFrame,spiBytesPerFrame\n");
+  bool first = true;
+  for(size_t r = 0; r < NUM_RESOLUTIONS; ++r)
+  {
+    gpuFrameWidth = resolutions[r].width;
+    gpuFrameHeight = resolutions[r].height;
+    gpuFramebufferScanlineStrideBytes = gpuFrameWidth * sizeof(uint16_t);
+    for(int s = 0; s < numSequences; ++s)
+      for(int strategy = 0; strategy < NUM_STRATEGIES; ++strategy)
+      {
+        Result result;
+        if (!RunBenchmark((Strategy)strategy, sequences[s], maxFrames, frame, prevFrame, result)) continue;
+        double frames = (double)result.frames;
+        if (json)
+          printf("%s  {\"display\": \"%s\", \"width\": %d, \"height\": %d, \"sequence\": \"%s\", \"strategy\": \"%s\", \"frames\": %d, \"diffNsPerFrame\": %.0f, \"spansPerFrame\": %.2f, \"pixelsPerFrame\": %.1f, \"spiBytesPerFrame\": %.1f}",
+            first ? "" : ",\n", resolutions[r].display, gpuFrameWidth, gpuFrameHeight, sequences[s].name, strategyNames[strategy], result.frames,
+            result.diffNsecs / frames, result.spans / frames, result.pixels / frames, result.spiBytes / frames);
+        else
+          printf("%s,%d,%d,%s,%s,%d,%.0f,%.2f,%.1f,%.1f\n", resolutions[r].display, gpuFrameWidth, gpuFrameHeight, sequences[s].name, strategyNames[strategy], result.frames,
+            result.diffNsecs / frames, result.spans / frames, result.pixels / frames, result.spiBytes / frames);
+        first = false;
+      }
+  }
+  if (json) printf("\n]\n");
+
+  DeinitDiffThreads();
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "config.h"
+#include "calibration.h"
+#include "spi.h"
+#include "dma.h"
+#include "diff.h"
+#include "display.h"
+#include "util.h"
+
+#ifdef CALIBRATE_SPI_BUS_AT_STARTUP
+
+#include <stdio.h> // printf, fopen
+#include <string.h> // memcpy, memset, strcmp
+#include <syslog.h> // syslog
+#include <limits.h> // INT_MAX
+
+#define CALIBRATION_NUM_TASKS 256
+
+// Runs the given task synchronously the given number of times, and returns the average time in microseconds that each took to send
+static double TimeSPITasks(uint8_t cmd, const uint8_t *data, int size, int count)
+{
+  uint64_t start = tick();
+  for(int i = 0; i < count; ++i)
+  {
+    SPITask *t = AllocTask(size);
+    t->cmd = cmd;
+    memcpy(t->data, data, size);
+    CommitTask(t);
+    RunSPITask(t);
+    DoneTask(t);
+  }
+  WaitForPolledSPITransferToFinish();
+#ifdef USE_DMA_TRANSFERS
+  WaitForDMAFinished();
+#endif
+  return (double)(tick() - start) / count;
+}
+
+// Fits a line time = fixed + size*perByte through timings of tasks of two sizes
+static void FitTaskTimings(int size0, double time0, int size1, double time1, double &fixed, double &perByte)
+{
+  perByte = (time1 - time0) / (size1 - size0);
+  fixed = time0 - size0 * perByte;
+}
+
+static void ComputeCalibration(int &mergeThreshold, int &startCost, int &dmaCutoff)
+{
+  // Setting the X cursor is what it takes to start a new span on the same scanline
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  const uint8_t setCursorX[] = { 0, 0, 0, 0, 0, (DISPLAY_WIDTH-1) >> 8, 0, (DISPLAY_WIDTH-1) & 0xFF };
+#elif defined(DISPLAY_SET_CURSOR_IS_8_BIT)
+  const uint8_t setCursorX[] = { 0, DISPLAY_WIDTH-1 };
+#elif defined(MUST_SEND_FULL_CURSOR_WINDOW)
+  const uint8_t setCursorX[] = { 0, 0, (DISPLAY_WIDTH-1) >> 8, (DISPLAY_WIDTH-1) & 0xFF };
+#else
+  const uint8_t setCursorX[] = { 0, 0 };
+#endif
+  // The display was just cleared, so write black pixels to keep it that way
+  const int smallTaskSize = 16, mediumTaskSize = 128, largeTaskSize = 2048;
+  uint8_t pixels[largeTaskSize];
+  memset(pixels, 0, sizeof(pixels));
+
+  dmaIsFasterThanPolledSpi = INT_MAX; // Send all tasks with polled SPI
+  double cursorTime = TimeSPITasks(DISPLAY_SET_CURSOR_X, setCursorX, sizeof(setCursorX), CALIBRATION_NUM_TASKS);
+  double smallPolledTime = TimeSPITasks(DISPLAY_WRITE_PIXELS, pixels, smallTaskSize, CALIBRATION_NUM_TASKS);
+  double largePolledTime = TimeSPITasks(DISPLAY_WRITE_PIXELS, pixels, largeTaskSize, CALIBRATION_NUM_TASKS/8);
+  double polledFixed, polledPerByte;
+  FitTaskTimings(smallTaskSize, smallPolledTime, largeTaskSize, largePolledTime, polledFixed, polledPerByte);
+  printf("SPI bus calibration: set cursor X: %.3f usecs, polled SPI task: %.3f usecs + %.4f usecs/byte\n", cursorTime, polledFixed, polledPerByte);
+  if (polledPerByte <= 0)
+  {
+    printf("SPI bus calibration failed, using default values\n");
+    mergeThreshold = SPAN_MERGE_THRESHOLD;
+    startCost = SPAN_START_COST;
+    dmaCutoff = DMA_IS_FASTER_THAN_POLLED_SPI;
+    return;
+  }
+
+  // Starting a new span costs a set cursor X task and the fixed overhead of another pixel task, measured here in the number of bytes that could
+  // have been streamed in the same time.
+  double spanStartBytes = (cursorTime + polledFixed) / polledPerByte;
+  mergeThreshold = MAX(1, (int)(spanStartBytes / SPI_BYTESPERPIXEL + 0.5));
+  startCost = MAX(1, (int)(spanStartBytes * SPI_POLLED_BYTE_COST + 0.5));
+
+#ifdef USE_DMA_TRANSFERS
+  dmaIsFasterThanPolledSpi = 0; // Send all tasks with DMA
+  double mediumDMATime = TimeSPITasks(DISPLAY_WRITE_PIXELS, pixels, mediumTaskSize, CALIBRATION_NUM_TASKS/2);
+  double largeDMATime = TimeSPITasks(DISPLAY_WRITE_PIXELS, pixels, largeTaskSize, CALIBRATION_NUM_TASKS/8);
+  double dmaFixed, dmaPerByte;
+  FitTaskTimings(mediumTaskSize, mediumDMATime, largeTaskSize, largeDMATime, dmaFixed, dmaPerByte);
+  printf("SPI bus calibration: DMA task: %.3f usecs + %.4f usecs/byte\n", dmaFixed, dmaPerByte);
+
+  // DMA pays off for tasks larger than the size where its higher fixed cost has been made up for by the faster streaming
+  if (dmaPerByte < polledPerByte)
+    dmaCutoff = (int)MIN(MAX_SPI_TASK_SIZE, MAX(0.0, (dmaFixed - polledFixed) / (polledPerByte - dmaPerByte)));
+  else
+    dmaCutoff = MAX_SPI_TASK_SIZE;
+#else
+  dmaCutoff = DMA_IS_FASTER_THAN_POLLED_SPI;
+#endif
+}
+
+void CalibrateSPIBus(uint32_t coreFrequency)
+{
+  // Any change to the bus speed or to the build (e.g. a different display or settings) invalidates the cached calibration
+  char key[256];
+  snprintf(key, sizeof(key), "core_freq=%u SPI_BUS_CLOCK_DIVISOR=%d build=%s %s\n", coreFrequency, SPI_BUS_CLOCK_DIVISOR, __DATE__, __TIME__);
+
+  int mergeThreshold, startCost, dmaCutoff;
+  bool cached = false;
+  FILE *handle = fopen(SPI_BUS_CALIBRATION_FILE, "r");
+  if (handle)
+  {
+    char cachedKey[256];
+    cached = fgets(cachedKey, sizeof(cachedKey), handle) && !strcmp(key, cachedKey)
+      && fscanf(handle, "%d %d %d", &mergeThreshold, &startCost, &dmaCutoff) == 3;
+    fclose(handle);
+  }
+
+  if (!cached)
+  {
+    printf("Calibrating SPI bus timings\n");
+    ComputeCalibration(mergeThreshold, startCost, dmaCutoff);
+    handle = fopen(SPI_BUS_CALIBRATION_FILE, "w");
+    if (handle)
+    {
+      fprintf(handle, "%s%d %d %d\n", key, mergeThreshold, startCost, dmaCutoff);
+      fclose(handle);
+    }
+    else
+      printf("Unable to write SPI bus calibration results to " SPI_BUS_CALIBRATION_FILE ", calibrating again on next startup\n");
+  }
+
+  spanMergeThreshold = mergeThreshold;
+  spanStartCost = startCost;
+  dmaIsFasterThanPolledSpi = dmaCutoff;
+  printf("%s SPI bus calibration: span merge threshold: %d pixels, span start cost: %d, DMA is faster than polled SPI after %d bytes\n",
+    cached ? "Loaded" : "Measured", spanMergeThreshold, spanStartCost, dmaIsFasterThanPolledSpi);
+  syslog(LOG_INFO, "SPI bus calibration: span merge threshold: %d pixels, span start cost: %d, DMA is faster than polled SPI after %d bytes",
+    spanMergeThreshold, spanStartCost, dmaIsFasterThanPolledSpi);
+}
+
+#else
+
+void CalibrateSPIBus(uint32_t coreFrequency)
+{
+}
+
+#endif
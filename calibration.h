@@ -0,0 +1,9 @@
+#pragma once
+
+#include <inttypes.h>
+
+// If CALIBRATE_SPI_BUS_AT_STARTUP is defined, measures how long command, polled SPI and DMA tasks take on the SPI bus, and derives
+// spanMergeThreshold, spanStartCost and dmaIsFasterThanPolledSpi from them. The results are cached to SPI_BUS_CALIBRATION_FILE,
+// so the measurement is only redone if the core clock speed, SPI bus clock divisor or the build changes. Must be called from InitSPI()
+// after the display has been initialized and cleared, but before the SPI thread is started. No-op if calibration is disabled.
+void CalibrateSPIBus(uint32_t coreFrequency);
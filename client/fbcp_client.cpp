@@ -0,0 +1,172 @@
+#include "fbcp_client.h"
+
+#include <errno.h> // errno, EINTR
+#include <fcntl.h> // fcntl, F_ADD_SEALS, F_SEAL_*
+#include <stdio.h> // fprintf
+#include <stdlib.h> // malloc, free
+#include <string.h> // memset, strncpy
+#include <sys/mman.h> // memfd_create, mmap, munmap
+#include <sys/socket.h> // socket, connect, sendmsg, recv
+#include <sys/un.h> // sockaddr_un
+#include <unistd.h> // close, ftruncate
+
+struct FbcpClient
+{
+  int socketFd;
+  int memFd;
+  uint8_t *memory;
+  size_t bufferSizeBytes, memorySizeBytes;
+  int width, height, strideBytes, numBuffers;
+  bool bufferBusy[FBCP_MAX_BUFFERS]; // True if the buffer has been presented and not yet released by fbcp-ili9341
+  int acquiredBuffer;
+  bool acquiredBufferPresented;
+  uint32_t frameNumber;
+};
+
+// Handles a message from fbcp-ili9341. If wait is true, blocks until one arrives. Returns false if the connection was lost, or if
+// not waiting and no message was pending.
+static bool ReceiveMessage(FbcpClient *client, bool wait)
+{
+  FbcpReleaseMessage msg;
+  ssize_t len;
+  do len = recv(client->socketFd, &msg, sizeof(msg), wait ? 0 : MSG_DONTWAIT);
+  while(len < 0 && errno == EINTR);
+  if (len != (ssize_t)sizeof(msg)) return false;
+  if (msg.type == FBCP_MESSAGE_RELEASE && msg.buffer < (uint32_t)client->numBuffers)
+    client->bufferBusy[msg.buffer] = false;
+  return true;
+}
+
+FbcpClient *FbcpConnect(const char *socketPath, int width, int height, int numBuffers)
+{
+  if (width <= 0 || height <= 0 || width > 65535 || height > 65535 || numBuffers < 1 || numBuffers > FBCP_MAX_BUFFERS) return 0;
+
+  FbcpClient *client = (FbcpClient*)malloc(sizeof(FbcpClient));
+  memset(client, 0, sizeof(FbcpClient));
+  client->socketFd = client->memFd = -1;
+  client->memory = (uint8_t*)MAP_FAILED;
+  client->width = width;
+  client->height = height;
+  client->strideBytes = (width * 2 + 3) & ~3;
+  client->numBuffers = numBuffers;
+  client->acquiredBuffer = -1;
+  client->acquiredBufferPresented = true;
+  client->bufferSizeBytes = (size_t)client->strideBytes * height;
+  client->memorySizeBytes = client->bufferSizeBytes * numBuffers;
+
+  client->socketFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+  if (client->socketFd < 0 || connect(client->socketFd, (sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    fprintf(stderr, "Failed to connect to fbcp-ili9341 at %s: %s\n", socketPath, strerror(errno));
+    FbcpDisconnect(client);
+    return 0;
+  }
+
+  // Seal the size of the memfd, so that fbcp-ili9341 can rely on its mapping staying valid
+  client->memFd = memfd_create("fbcp-ili9341 framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (client->memFd < 0 || ftruncate(client->memFd, client->memorySizeBytes) < 0
+    || fcntl(client->memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+  {
+    fprintf(stderr, "Failed to create shared framebuffer memory: %s\n", strerror(errno));
+    FbcpDisconnect(client);
+    return 0;
+  }
+  client->memory = (uint8_t*)mmap(0, client->memorySizeBytes, PROT_READ | PROT_WRITE, MAP_SHARED, client->memFd, 0);
+  if (client->memory == MAP_FAILED)
+  {
+    fprintf(stderr, "Failed to map shared framebuffer memory: %s\n", strerror(errno));
+    FbcpDisconnect(client);
+    return 0;
+  }
+  memset(client->memory, 0, client->memorySizeBytes);
+
+  FbcpHelloMessage hello;
+  hello.type = FBCP_MESSAGE_HELLO;
+  hello.magic = FBCP_PROTOCOL_MAGIC;
+  hello.version = FBCP_PROTOCOL_VERSION;
+  hello.width = width;
+  hello.height = height;
+  hello.strideBytes = client->strideBytes;
+  hello.numBuffers = numBuffers;
+
+  iovec iov = { &hello, sizeof(hello) };
+  union { cmsghdr header; char data[CMSG_SPACE(sizeof(int))]; } control;
+  memset(&control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = sizeof(control.data);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client->memFd, sizeof(int));
+  if (sendmsg(client->socketFd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello))
+  {
+    fprintf(stderr, "Failed to send the shared framebuffer to fbcp-ili9341: %s\n", strerror(errno));
+    FbcpDisconnect(client);
+    return 0;
+  }
+  return client;
+}
+
+int FbcpStrideBytes(FbcpClient *client)
+{
+  return client->strideBytes;
+}
+
+uint16_t *FbcpAcquireBuffer(FbcpClient *client)
+{
+  // The buffers are cycled strictly in order, so that an acquired buffer always holds the frame from numBuffers presents ago.
+  // If the previously acquired buffer was not presented, it is still the one to draw to.
+  if (client->acquiredBufferPresented)
+  {
+    client->acquiredBuffer = (client->acquiredBuffer + 1) % client->numBuffers;
+    client->acquiredBufferPresented = false;
+  }
+  while(ReceiveMessage(client, false))
+    ; // Pick up the buffers that have been released meanwhile
+  while(client->bufferBusy[client->acquiredBuffer])
+    if (!ReceiveMessage(client, true))
+      return 0;
+  return (uint16_t*)(client->memory + client->acquiredBuffer * client->bufferSizeBytes);
+}
+
+bool FbcpPresent(FbcpClient *client, const FbcpRect *rects, int numRects)
+{
+  if (client->acquiredBufferPresented) return false; // No buffer acquired
+
+  FbcpFrameMessage msg;
+  msg.type = FBCP_MESSAGE_FRAME;
+  msg.frameNumber = client->frameNumber++;
+  msg.buffer = client->acquiredBuffer;
+  msg.numRects = 0;
+  if (rects && numRects <= FBCP_MAX_DAMAGE_RECTS) // (If there are more rectangles than fit, send the whole frame as changed)
+  {
+    for(int i = 0; i < numRects; ++i)
+      if (rects[i].width > 0 && rects[i].height > 0)
+        msg.rects[msg.numRects++] = rects[i];
+    if (msg.numRects == 0) return true; // Nothing changed, so the buffer stays with the client
+  }
+
+  size_t size = sizeof(msg) - sizeof(msg.rects) + msg.numRects * sizeof(FbcpRect);
+  if (send(client->socketFd, &msg, size, MSG_NOSIGNAL) != (ssize_t)size) return false;
+  client->bufferBusy[client->acquiredBuffer] = true;
+  client->acquiredBufferPresented = true;
+  return true;
+}
+
+void FbcpDisconnect(FbcpClient *client)
+{
+  if (!client) return;
+  if (client->memory != MAP_FAILED) munmap(client->memory, client->memorySizeBytes);
+  if (client->memFd >= 0) close(client->memFd);
+  if (client->socketFd >= 0) close(client->socketFd);
+  free(client);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "fbcp_protocol.h"
+
+// Client library for pushing frames to fbcp-ili9341 built with -DUSE_MEMFD_FRAME_SOURCE=ON, without going through HDMI. A typical
+// render loop looks like:
+//
+//   FbcpClient *client = FbcpConnect(FBCP_DEFAULT_SOCKET_PATH, 320, 240, 2);
+//   for(;;)
+//   {
+//     uint16_t *pixels = FbcpAcquireBuffer(client);
+//     ... draw R5G6B5 pixels, FbcpStrideBytes(client) bytes per scanline, and collect the changed rectangles ...
+//     FbcpPresent(client, rects, numRects);
+//   }
+//
+// N.B. the changed rectangles are relative to the previous presented frame, but with more than one buffer, the acquired buffer holds
+// the frame from numBuffers presents ago. The application needs to bring the buffer up to date with all changes since then.
+
+struct FbcpClient;
+
+// Connects to fbcp-ili9341 listening on the given socket, and shares with it a memfd of numBuffers framebuffers of width x height
+// R5G6B5 pixels. Returns null on failure.
+FbcpClient *FbcpConnect(const char *socketPath, int width, int height, int numBuffers);
+
+// Returns the number of bytes from one scanline to the next in the buffers.
+int FbcpStrideBytes(FbcpClient *client);
+
+// Returns the buffer to draw the next frame into, waiting for fbcp-ili9341 to release it if it is still in use. The buffers are used
+// in turn, unless the previous one was not presented, in which case it is returned again. Returns null if the connection was lost.
+uint16_t *FbcpAcquireBuffer(FbcpClient *client);
+
+// Hands the buffer returned by the last FbcpAcquireBuffer() call to fbcp-ili9341 to display. rects lists the areas that changed since
+// the previous presented frame, or pass null to mark the whole frame as changed. Returns false if the connection was lost.
+bool FbcpPresent(FbcpClient *client, const FbcpRect *rects, int numRects);
+
+void FbcpDisconnect(FbcpClient *client);
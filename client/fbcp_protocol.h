@@ -0,0 +1,62 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Protocol between fbcp-ili9341 and a local client application that renders its own frames, used when fbcp-ili9341 is built with
+// -DUSE_MEMFD_FRAME_SOURCE=ON. Messages are exchanged over a SOCK_SEQPACKET Unix domain socket, one message per packet:
+// 1. The client creates a memfd that holds numBuffers framebuffers of height scanlines of strideBytes bytes each, in R5G6B5 format,
+//    seals it against shrinking, and sends FbcpHelloMessage with the memfd attached as SCM_RIGHTS ancillary data.
+// 2. Each time the client has finished drawing a frame into one of the buffers, it sends FbcpFrameMessage, listing the rectangles
+//    that changed since the previous frame it sent. From then on the buffer belongs to fbcp-ili9341, and must not be drawn to.
+// 3. Once fbcp-ili9341 has read the frame out of the buffer, or skipped it because a newer frame arrived, it hands the buffer back
+//    to the client with FbcpReleaseMessage.
+// If fbcp-ili9341 rejects the client, e.g. because the framebuffer size differs from that of the first client, it closes the connection.
+
+// The socket that fbcp-ili9341 listens on by default. (MEMFD_FRAME_SOURCE_SOCKET in config.h)
+#define FBCP_DEFAULT_SOCKET_PATH "/tmp/fbcp-ili9341.sock"
+
+#define FBCP_PROTOCOL_MAGIC 0x50434246u // 'FBCP'
+#define FBCP_PROTOCOL_VERSION 1
+
+#define FBCP_MAX_BUFFERS 4
+#define FBCP_MAX_DAMAGE_RECTS 64
+
+enum FbcpMessageType
+{
+  FBCP_MESSAGE_HELLO = 1,
+  FBCP_MESSAGE_FRAME = 2,
+  FBCP_MESSAGE_RELEASE = 3
+};
+
+// Client -> fbcp-ili9341, carries the memfd.
+struct FbcpHelloMessage
+{
+  uint32_t type; // FBCP_MESSAGE_HELLO
+  uint32_t magic; // FBCP_PROTOCOL_MAGIC
+  uint32_t version; // FBCP_PROTOCOL_VERSION
+  uint32_t width, height; // Size of the framebuffer in pixels
+  uint32_t strideBytes; // Bytes from one scanline to the next, at least width*2 and a multiple of 4
+  uint32_t numBuffers; // Buffer i starts at byte offset i*strideBytes*height of the memfd. 1 to FBCP_MAX_BUFFERS
+};
+
+struct FbcpRect
+{
+  uint16_t x, y, width, height;
+};
+
+// Client -> fbcp-ili9341. Only the first numRects rectangles are sent.
+struct FbcpFrameMessage
+{
+  uint32_t type; // FBCP_MESSAGE_FRAME
+  uint32_t frameNumber; // Increasing frame counter, for diagnostics
+  uint32_t buffer; // Index of the buffer that holds the frame
+  uint32_t numRects; // Number of changed rectangles that follow. 0 means that the whole frame may have changed.
+  FbcpRect rects[FBCP_MAX_DAMAGE_RECTS];
+};
+
+// fbcp-ili9341 -> client
+struct FbcpReleaseMessage
+{
+  uint32_t type; // FBCP_MESSAGE_RELEASE
+  uint32_t buffer; // Index of the buffer that the client may draw to again
+};
@@ -0,0 +1,98 @@
+// Test client for the memfd frame source: draws a square bouncing around on a gradient background, and presents only the areas
+// that the square moved over. Usage: fbcp-test-client [width height [socket path]]. The size needs to match that of the first
+// client that connected after fbcp-ili9341 was started.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // atoi
+#include <time.h> // nanosleep
+
+#include "fbcp_client.h"
+
+#define SQUARE_SIZE 40
+
+static int width = 320, height = 240;
+
+static uint16_t Background(int x, int y)
+{
+  return (uint16_t)(((x * 31 / width) << 11) | ((y * 63 / height) << 5) | 8);
+}
+
+// Draws the given rectangle of the frame with the square at (squareX, squareY)
+static void Draw(uint16_t *pixels, int stride, const FbcpRect &r, int squareX, int squareY)
+{
+  for(int y = r.y; y < r.y + r.height; ++y)
+    for(int x = r.x; x < r.x + r.width; ++x)
+    {
+      bool inSquare = x >= squareX && x < squareX + SQUARE_SIZE && y >= squareY && y < squareY + SQUARE_SIZE;
+      pixels[y*stride + x] = inSquare ? 0xFFFF : Background(x, y);
+    }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3)
+  {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+  }
+  const char *socketPath = (argc >= 4) ? argv[3] : FBCP_DEFAULT_SOCKET_PATH;
+  if (width < SQUARE_SIZE || height < SQUARE_SIZE)
+  {
+    printf("The framebuffer needs to be at least %dx%d pixels\n", SQUARE_SIZE, SQUARE_SIZE);
+    return 1;
+  }
+
+  const int numBuffers = 2;
+  FbcpClient *client = FbcpConnect(socketPath, width, height, numBuffers);
+  if (!client) return 1;
+  const int stride = FbcpStrideBytes(client) / 2;
+  printf("Connected to %s, presenting %dx%d frames\n", socketPath, width, height);
+
+  // Position of the square in each of the past numBuffers frames, to know what each buffer needs redrawn when it comes back
+  int squareX[numBuffers+1], squareY[numBuffers+1];
+  for(int i = 0; i <= numBuffers; ++i) squareX[i] = squareY[i] = 0;
+  int dx = 3, dy = 2;
+
+  for(unsigned frame = 0; ; ++frame)
+  {
+    uint16_t *pixels = FbcpAcquireBuffer(client);
+    if (!pixels) break;
+
+    for(int i = numBuffers; i > 0; --i)
+    {
+      squareX[i] = squareX[i-1];
+      squareY[i] = squareY[i-1];
+    }
+    squareX[0] += dx;
+    squareY[0] += dy;
+    if (squareX[0] < 0 || squareX[0] + SQUARE_SIZE > width) { dx = -dx; squareX[0] += 2*dx; }
+    if (squareY[0] < 0 || squareY[0] + SQUARE_SIZE > height) { dy = -dy; squareY[0] += 2*dy; }
+
+    if (frame < (unsigned)numBuffers)
+    {
+      // The buffer has not been drawn before
+      FbcpRect whole = { 0, 0, (uint16_t)width, (uint16_t)height };
+      Draw(pixels, stride, whole, squareX[0], squareY[0]);
+      if (!FbcpPresent(client, 0, 0)) break;
+    }
+    else
+    {
+      // The buffer still shows the square where it was numBuffers frames ago, so redraw that and the new location. Compared to the
+      // previous frame, only the old and new squares changed.
+      FbcpRect oldInBuffer = { (uint16_t)squareX[numBuffers], (uint16_t)squareY[numBuffers], SQUARE_SIZE, SQUARE_SIZE };
+      FbcpRect rects[2] = {
+        { (uint16_t)squareX[1], (uint16_t)squareY[1], SQUARE_SIZE, SQUARE_SIZE },
+        { (uint16_t)squareX[0], (uint16_t)squareY[0], SQUARE_SIZE, SQUARE_SIZE }
+      };
+      Draw(pixels, stride, oldInBuffer, squareX[0], squareY[0]);
+      Draw(pixels, stride, rects[1], squareX[0], squareY[0]);
+      if (!FbcpPresent(client, rects, 2)) break;
+    }
+
+    timespec frameInterval = { 0, 1000000000 / 60 };
+    nanosleep(&frameInterval, 0);
+  }
+  printf("Lost connection to fbcp-ili9341\n");
+  FbcpDisconnect(client);
+  return 0;
+}
@@ -54,6 +54,106 @@
 
 #endif
 
+// If defined, frames are read from a memory mapped Linux framebuffer device instead of being snapshot from the VideoCore GPU
+// with DispmanX, which is not available on KMS based OS images. The framebuffer device needs to be in 16-bit R5G6B5 mode, and
+// is not scaled, only cropped to the SPI display. Unless the frame needs to be copied to draw the statistics overlay or the low
+// battery icon on it, the framebuffer device memory is diffed in place. This is passed from CMake with -DUSE_FBDEV_FRAME_SOURCE=ON.
+// #define USE_FBDEV_FRAME_SOURCE
+
+// The framebuffer device that USE_FBDEV_FRAME_SOURCE reads frames from
+#define FBDEV_FRAME_SOURCE_DEVICE "/dev/fb0"
+
+// If defined, frames are captured from the root window of an X server through the MIT-SHM extension, and only when the XDamage
+// extension reports that the screen has changed. The damaged areas are passed on to the diff so that only they get scanned. The X
+// screen is not scaled, only cropped to the SPI display. This is passed from CMake with -DUSE_X11_FRAME_SOURCE=ON.
+// #define USE_X11_FRAME_SOURCE
+
+// The X display that USE_X11_FRAME_SOURCE connects to if the DISPLAY environment variable is not set
+#define X11_FRAME_SOURCE_DISPLAY ":0"
+
+// If defined, frames are received from a local client application over the Unix domain socket MEMFD_FRAME_SOURCE_SOCKET, instead of
+// scraping them back from HDMI. The client shares its R5G6B5 framebuffer as a memfd once, and then sends a message each time a new
+// frame is ready, listing the rectangles that changed. Only those rectangles are read out of the shared memory and diffed. The client
+// framebuffer is cropped rather than scaled to the SPI display. See client/fbcp_client.h for the client library. This is passed from
+// CMake with -DUSE_MEMFD_FRAME_SOURCE=ON.
+// #define USE_MEMFD_FRAME_SOURCE
+
+// The socket that USE_MEMFD_FRAME_SOURCE listens on for a client
+#define MEMFD_FRAME_SOURCE_SOCKET "/tmp/fbcp-ili9341.sock"
+
+// If defined, frames are replayed from the frame trace TRACE_FRAME_SOURCE_FILE with their recorded timing, instead of being captured
+// from a display. Traces are recorded with RECORD_FRAME_TRACE. The program quits after the last frame of the trace. This is passed
+// from CMake with -DUSE_TRACE_FRAME_SOURCE=ON.
+// #define USE_TRACE_FRAME_SOURCE
+#define TRACE_FRAME_SOURCE_FILE "fbcp-ili9341.trace"
+
+// If defined, USE_TRACE_FRAME_SOURCE ignores the recorded timing, and hands each frame to the main loop as soon as it has taken the
+// previous one, to measure how fast a trace gets processed. This is passed from CMake with -DREPLAY_FRAME_TRACE_AS_FAST_AS_POSSIBLE=ON.
+// #define REPLAY_FRAME_TRACE_AS_FAST_AS_POSSIBLE
+
+// If defined, each new frame captured from the frame source is recorded with its arrival time to RECORD_FRAME_TRACE_FILE, to be
+// replayed later with USE_TRACE_FRAME_SOURCE. See trace.h for the file format. This is passed from CMake with -DRECORD_FRAME_TRACE=ON.
+// #define RECORD_FRAME_TRACE
+#define RECORD_FRAME_TRACE_FILE "/tmp/fbcp-ili9341-recording.trace"
+
+// If defined, fbcp-ili9341 is built to run headless on a host without Raspberry Pi hardware, such as an x86 workstation or a CI
+// machine. The BCM2835 SPI0, GPIO and system timer peripherals and the VideoCore mailbox are emulated in software, and at exit the
+// emulated SPI bus reports the frame rate and the number of bytes per frame that it saw. See emulated_hardware.h. DMA is not
+// emulated, so SPI runs in polled mode. Unless another frame source is chosen, frames are replayed with USE_TRACE_FRAME_SOURCE.
+// This is passed from CMake with -DUSE_EMULATED_HARDWARE=ON.
+// #define USE_EMULATED_HARDWARE
+
+// The BCM core clock speed in Hz that USE_EMULATED_HARDWARE runs at. Like on real hardware, the emulated SPI bus then clocks out
+// a byte every 8*SPI_BUS_CLOCK_DIVISOR core clock cycles.
+#define EMULATED_BCM_CORE_SPEED 400000000
+
+// If defined together with USE_EMULATED_HARDWARE, the bytes clocked out on the emulated SPI bus are decoded by a model of the display
+// controller, and after each frame the image that the panel would show is compared pixel by pixel against the frame that was sent.
+// This makes the main loop wait for the SPI thread after each frame, so it slows down the frame rate. See virtual_panel.h. This is
+// passed from CMake with -DVERIFY_WITH_VIRTUAL_PANEL=ON.
+// #define VERIFY_WITH_VIRTUAL_PANEL
+
+// If defined, VERIFY_WITH_VIRTUAL_PANEL writes a CSV line per frame to this file with the number of bytes, commands and pixels that
+// the frame took on the bus, and how many of its pixels differ from the frame that was sent and from the frame source.
+// #define VIRTUAL_PANEL_REPORT_FILE "/tmp/fbcp-ili9341-virtual-panel.csv"
+
+#ifdef USE_EMULATED_HARDWARE
+#ifdef KERNEL_MODULE_CLIENT
+#error USE_EMULATED_HARDWARE cannot be used together with KERNEL_MODULE_CLIENT!
+#endif
+#undef USE_DMA_TRANSFERS
+#if !defined(USE_FBDEV_FRAME_SOURCE) && !defined(USE_X11_FRAME_SOURCE) && !defined(USE_MEMFD_FRAME_SOURCE)
+// DispmanX is only available on a Pi.
+#define USE_TRACE_FRAME_SOURCE
+#endif
+#elif defined(VERIFY_WITH_VIRTUAL_PANEL)
+#error VERIFY_WITH_VIRTUAL_PANEL requires USE_EMULATED_HARDWARE!
+#endif
+
+// Only one frame source can be used at a time.
+#if defined(USE_TRACE_FRAME_SOURCE)
+#undef USE_MEMFD_FRAME_SOURCE
+#undef USE_X11_FRAME_SOURCE
+#undef USE_FBDEV_FRAME_SOURCE
+#elif defined(USE_MEMFD_FRAME_SOURCE)
+#undef USE_X11_FRAME_SOURCE
+#undef USE_FBDEV_FRAME_SOURCE
+#elif defined(USE_X11_FRAME_SOURCE)
+#undef USE_FBDEV_FRAME_SOURCE
+#elif !defined(USE_FBDEV_FRAME_SOURCE)
+#define USE_DISPMANX_FRAME_SOURCE
+#endif
+
+#if defined(USE_X11_FRAME_SOURCE) || defined(USE_MEMFD_FRAME_SOURCE)
+// XDamage or the client tells which areas of the screen have changed, so frames are delivered only when something changes.
+#define FRAME_SOURCE_REPORTS_DAMAGE
+#endif
+
+#if defined(USE_GPU_VSYNC) && !defined(USE_DISPMANX_FRAME_SOURCE)
+// The vsync signal is delivered by DispmanX.
+#undef USE_GPU_VSYNC
+#endif
+
 // If enabled, the source video frame is not scaled to fit to the screen, but instead if the source frame
 // is bigger than the SPI display, then content is cropped away, i.e. the source is displayed "centered"
 // on the SPI screen:
@@ -77,6 +177,11 @@
 // If defined, all frames are always rendered as interlaced, and never use progressive rendering.
 // #define ALWAYS_INTERLACING
 
+// If defined, interlacing is replaced by a scheduler that sends the changed spans of each frame in priority order, for as long
+// as they fit in the frame's SPI bus time budget. The rest are deferred to the next update, and get a higher priority the longer
+// they have waited. This avoids the combing artifacts of interlacing when the bus cannot keep up.
+// #define SCHEDULE_UPDATES_BY_DEADLINE
+
 // By default, if the SPI bus is idle after rendering an interlaced frame, but the GPU has not yet produced
 // a new application frame to be displayed, the same frame will be rendered again for its other field.
 // Define this option to disable this behavior, in which case when an interlaced frame is rendered, the 
@@ -93,6 +198,29 @@
 // DMA usage is tailored towards maximum performance.
 // #define ALL_TASKS_SHOULD_DMA
 
+// If defined, the SPI tasks that write pixels do not carry a copy of the pixels in the SPI task queue, but reference the span in the
+// captured frame that the main thread diffed. The pixels are byteswapped straight from the frame to the SPI FIFO or to DMA memory
+// when the task is sent, which saves copying each sent pixel through the task queue. Captured frames are then kept unchanged until
+// the tasks that reference them have been sent. Requires that captured frames are diffed in place, i.e. building with -DSTATISTICS=0
+// and without a low battery pin, and is not available for 3-wire displays, or displays that take 18-bit pixels. This is passed
+// from CMake with -DZERO_COPY_SPI_TASKS=ON.
+// #define ZERO_COPY_SPI_TASKS
+
+// If defined, frames in the SPI task queue are marked with their frame boundaries, and when a new frame arrives while the previous frame
+// is still queued waiting for the frame before it to finish sending, the waiting frame is dropped. Its changes are folded into the new
+// frame, which is then shown a full frame sooner. This lowers the latency of displays that cannot keep up with the content, e.g. 480x320
+// displays in fast games, at the expense of showing fewer frames. Requires the dedicated SPI thread, so is not available on single core
+// Pis or with the kernel module. This is passed from CMake with -DLATEST_FRAME_WINS=ON.
+// #define LATEST_FRAME_WINS
+
+// If defined, 3-wire SPI displays are driven in the LoSSI mode of the BCM2835 SPI0 peripheral, which sends each byte as a 9-bit word
+// and generates the data/command bit in hardware, both in Polled SPI mode and in DMA transfers. Otherwise each SPI task is expanded to
+// 9-bit framing on the CPU when it is queued, which takes 12.5% more task memory and is not compatible with ALL_TASKS_SHOULD_DMA. Has no
+// effect on 4-wire displays, or on the 32-bit framing of KeDei displays. N.B. the DMA transfers in LoSSI mode have not yet been tested on
+// a real display, so ALL_TASKS_SHOULD_DMA is not enabled automatically for it on single core boards. This is passed from CMake with
+// -DSPI_3WIRE_LOSSI_MODE=ON.
+// #define SPI_3WIRE_LOSSI_MODE
+
 // If defined, screen updates are performed in strictly one update rectangle per frame.
 // This reduces CPU consumption at the expense of sending more pixels. You can try enabling this
 // if your SPI display runs at a good high SPI bus MHz speed with respect to the screen resolution.
@@ -110,7 +238,7 @@
 // requires that ALL_TASKS_SHOULD_DMA is also enabled.
 // #define UPDATE_FRAMES_WITHOUT_DIFFING
 
-#if defined(SINGLE_CORE_BOARD) && defined(USE_DMA_TRANSFERS) && !defined(SPI_3WIRE_PROTOCOL) // TODO: 3-wire SPI displays are not yet compatible with ALL_TASKS_SHOULD_DMA option.
+#if defined(SINGLE_CORE_BOARD) && defined(USE_DMA_TRANSFERS) && !defined(SPI_3WIRE_PROTOCOL) // 3-wire SPI displays are only compatible with ALL_TASKS_SHOULD_DMA option in LoSSI mode, where it is left to be enabled manually until tested on hardware.
 // These are prerequisites for good performance on Pi Zero
 #ifndef ALL_TASKS_SHOULD_DMA
 #define ALL_TASKS_SHOULD_DMA
@@ -135,6 +263,105 @@
 #define FAST_BUT_COARSE_PIXEL_DIFF
 #endif
 
+// If defined, the exact per-pixel diffing method is performed with ARM NEON SIMD instructions, comparing 16 pixels at a time.
+// This is passed from CMake when targeting ARMv7-A or ARMv8-A Pis (pass -DNEON_PIXEL_DIFF=OFF to use the scalar version)
+// #define USE_NEON_PIXEL_DIFF
+
+// If defined, per-pixel diffing first hashes the new frame in 16x16 pixel tiles, and compares the hashes against the previous
+// contents of each tile. Pixels are then compared only inside tiles whose hash changed, and the same pass counts the changed pixels
+// for the interlacing decision. This roughly halves the diffing cost of mostly static content, such as menus. When enabled, this
+// replaces the FAST_BUT_COARSE_PIXEL_DIFF method.
+// #define USE_TILE_DIRTY_MAP
+
+// If defined, per-pixel diffing first checksums each scanline of the new frame, and compares the checksums against the previous
+// contents of each scanline. Scanlines with matching checksums are skipped without reading the previous framebuffer, so on mostly
+// static content diffing costs little more than one read through the new frame. Like USE_TILE_DIRTY_MAP, but coarser grained
+// and with less bookkeeping. When enabled, this replaces the FAST_BUT_COARSE_PIXEL_DIFF method.
+// #define USE_SCANLINE_CHECKSUMS
+
+// If defined to a value greater than one, per-pixel diffing is split to this many horizontal bands of the screen that are diffed
+// in parallel, by the main thread and DIFF_THREADS-1 worker threads. Useful on Pis with four cores. This is passed from CMake
+// with -DDIFF_THREADS=<num>.
+// #define DIFF_THREADS 3
+
+// If defined, the diff worker threads are pinned to consecutive CPU cores starting from this core index. This is passed from
+// CMake with -DDIFF_THREAD_FIRST_CORE=<num>.
+// #define DIFF_THREAD_FIRST_CORE 2
+
+// If defined, frames where the screen contents have moved vertically (e.g. a scrolling terminal or a list) are detected, and
+// the display controller is commanded to scroll its contents, so that only the newly exposed scanlines need to be sent over
+// SPI. Only works on displays that support vertical scrolling, when the framebuffer scanlines run along the native rows
+// of the display, i.e. not with a hardware orientation flip, or with DISPLAY_ROTATE_180_DEGREES.
+// #define USE_HARDWARE_VERTICAL_SCROLL
+
+// If defined, pixels are diffed perceptually: a pixel counts as changed only if one of its color channels changed by at least this
+// many steps (measured in 5-bit units, the 6-bit green channel is scaled accordingly). This lets small changes, such as noise in
+// video gradients, go unsent, which keeps bus bound displays out of interlaced updates more often. The previous framebuffer keeps
+// what the display actually shows, so the differences cannot accumulate, and a few scanlines are diffed exactly each frame to sweep
+// away the remaining small differences. This is passed from CMake with -DPERCEPTUAL_DIFF_THRESHOLD=<num>.
+// #define PERCEPTUAL_DIFF_THRESHOLD 2
+
+// When diffing perceptually, this many scanlines of each new frame are diffed exactly, sweeping down the screen frame by frame. After the
+// last new frame, the sweep keeps going once per frame interval until it has covered the whole screen.
+#define PERCEPTUAL_DIFF_REFRESH_SCANLINES 8
+
+#if defined(USE_TILE_DIRTY_MAP) && defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING))
+// The tile dirty map is only used by the per-pixel diffing method.
+#undef USE_TILE_DIRTY_MAP
+#endif
+
+#if defined(USE_SCANLINE_CHECKSUMS) && (defined(USE_TILE_DIRTY_MAP) || (defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING))))
+// Scanline checksums are only used by the per-pixel diffing method, and the tile dirty map already skips the unchanged areas at a finer grain.
+#undef USE_SCANLINE_CHECKSUMS
+#endif
+
+#if defined(USE_HARDWARE_VERTICAL_SCROLL) && defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING))
+// Hardware scrolling is only used with the per-pixel diffing method.
+#undef USE_HARDWARE_VERTICAL_SCROLL
+#endif
+
+#if defined(PERCEPTUAL_DIFF_THRESHOLD) && defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING))
+// Perceptual diffing is only used with the per-pixel diffing method.
+#undef PERCEPTUAL_DIFF_THRESHOLD
+#endif
+
+#if defined(PERCEPTUAL_DIFF_THRESHOLD) && defined(USE_TILE_DIRTY_MAP)
+// The tile hashes only detect exact changes, and cannot tell which changes would be perceptible.
+#undef USE_TILE_DIRTY_MAP
+#endif
+
+#if defined(PERCEPTUAL_DIFF_THRESHOLD) && defined(USE_SCANLINE_CHECKSUMS)
+// Likewise for the scanline checksums.
+#undef USE_SCANLINE_CHECKSUMS
+#endif
+
+#if defined(FRAME_SOURCE_REPORTS_DAMAGE) && !defined(USE_TILE_DIRTY_MAP) && !defined(USE_SCANLINE_CHECKSUMS) && !defined(PERCEPTUAL_DIFF_THRESHOLD) && !(defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING)))
+// The exact per-pixel diff scans only the areas that the frame source has reported as damaged. The other diffing methods scan the whole frame.
+#define DIFF_ONLY_DAMAGED_AREAS
+#endif
+
+// If defined, the SPI bus is benchmarked at startup to find out how many unchanged pixels it pays off to send to avoid starting a new
+// span, and from which task size DMA is faster than polled SPI, for the core_freq and SPI_BUS_CLOCK_DIVISOR in use. These replace the
+// SPAN_MERGE_THRESHOLD and DMA_IS_FASTER_THAN_POLLED_SPI defaults. The results are cached in SPI_BUS_CALIBRATION_FILE, and measured again
+// only if core_freq, SPI_BUS_CLOCK_DIVISOR or the build changes. (delete the file to force a new measurement)
+// #define CALIBRATE_SPI_BUS_AT_STARTUP
+#define SPI_BUS_CALIBRATION_FILE "/var/cache/fbcp-ili9341-calibration.txt"
+
+#if defined(SCHEDULE_UPDATES_BY_DEADLINE) && (defined(NO_INTERLACING) || defined(ALWAYS_INTERLACING) || (defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(UPDATE_FRAMES_WITHOUT_DIFFING))))
+// The scheduler stands in for interlacing, and needs the per-pixel diffing method to produce spans to schedule.
+#undef SCHEDULE_UPDATES_BY_DEADLINE
+#endif
+
+#if defined(LATEST_FRAME_WINS) && !defined(USE_SPI_THREAD)
+// Queued frames are dropped by having the SPI thread skip over their tasks, so without it there is never a frame waiting to drop.
+#undef LATEST_FRAME_WINS
+#endif
+
+#if defined(CALIBRATE_SPI_BUS_AT_STARTUP) && defined(ALL_TASKS_SHOULD_DMA)
+// When all tasks go through DMA, SPAN_MERGE_THRESHOLD aims to minimize CPU overhead rather than bus time, so there is nothing to measure.
+#undef CALIBRATE_SPI_BUS_AT_STARTUP
+#endif
+
 #if defined(ALL_TASKS_SHOULD_DMA)
 // This makes all submitted tasks go through DMA, and not use a hybrid Polled SPI + DMA approach.
 #define ALIGN_TASKS_FOR_DMA_TRANSFERS
@@ -148,10 +375,17 @@
 // frames will be polled first at 10fps, and ultimately at only 2fps.
 #define SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
 
-// Builds a histogram of observed frame intervals and uses that to sync to a known update rate. This aims
+// Phase-locks onto the observed frame arrival times to predict when the next frame will arrive. This aims
 // to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
 #define SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
 
+#if defined(USE_TRACE_FRAME_SOURCE) && defined(REPLAY_FRAME_TRACE_AS_FAST_AS_POSSIBLE)
+// The next frame is available as soon as the main loop is ready for it, so there is nothing to wait for.
+#undef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+#undef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
+#undef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
+#endif
+
 // If defined, rotates the display 180 degrees. This might not rotate the panel scan order though,
 // so adding this can cause up to one vsync worth of extra display latency. It is best to avoid this and
 // install the display in its natural rotation order, if possible.
@@ -186,7 +420,9 @@
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE disabled: diagonal tearing
 // DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE enabled: traditional no-vsync tearing (tear line runs in portrait
 // i.e. narrow direction)
-#if !defined(SINGLE_CORE_BOARD)
+// When reading frames from a framebuffer device, the flip is left to the display controller by default, so that the framebuffer
+// device memory can be diffed in place.
+#if !defined(SINGLE_CORE_BOARD) && !defined(USE_FBDEV_FRAME_SOURCE)
 #define DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
 #endif
 
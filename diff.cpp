@@ -4,9 +4,39 @@
 #include "display.h"
 #include "gpu.h"
 #include "spi.h"
+#include "mem_alloc.h"
+
+#include <memory.h>
+
+#if defined(DIFF_THREADS) && DIFF_THREADS > 1
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <pthread.h> // pthread_create, pthread_setaffinity_np
+#include <sched.h> // CPU_SET
+#include <sys/syscall.h> // SYS_futex
+#include <unistd.h> // syscall, sysconf
+#include <limits.h> // INT_MAX
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog, LOG_ERR
+#endif
+
+#ifdef USE_NEON_PIXEL_DIFF
+#include <arm_neon.h>
+#endif
+
+#if defined(USE_SCANLINE_CHECKSUMS) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h> // __crc32w, __crc32h
+#endif
+
+#ifdef SCHEDULE_UPDATES_BY_DEADLINE
+#include <stdlib.h> // qsort
+#endif
 
 Span *spans = 0;
 
+int spanMergeThreshold = SPAN_MERGE_THRESHOLD;
+int spanStartCost = SPAN_START_COST;
+
 #ifdef UPDATE_FRAMES_WITHOUT_DIFFING
 // Naive non-diffing functionality: just submit the whole display contents
 void NoDiffChangedRectangle(Span *&head)
@@ -22,6 +52,7 @@ void NoDiffChangedRectangle(Span *&head)
 #endif
 
 #ifdef UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
+#ifdef __arm__
 // Coarse diffing of two framebuffers with tight stride, 16 pixels at a time
 // Finds the first changed pixel, coarse result aligned down to 8 pixels boundary
 static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
@@ -117,6 +148,28 @@ static int coarse_backwards_linear_diff(uint16_t *framebuffer, uint16_t *prevFra
   );
   return endPtr - framebuffer;
 }
+#else
+// Portable versions of the above for builds that do not target ARM (USE_EMULATED_HARDWARE, fbcp-diff-benchmark), with the same 8 pixel granularity
+static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
+{
+  uint64_t *s = (uint64_t *)framebuffer, *prevS = (uint64_t *)prevFramebuffer, *end = (uint64_t *)framebufferEnd;
+  for(; s < end; s += 2, prevS += 2)
+    if (s[0] != prevS[0] || s[1] != prevS[1]) break;
+  return (uint16_t *)s - framebuffer;
+}
+
+static int coarse_backwards_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
+{
+  uint64_t *begin = (uint64_t *)framebuffer, *s = (uint64_t *)framebufferEnd, *prevS = (uint64_t *)(prevFramebuffer + (framebufferEnd - framebuffer));
+  while(s > begin)
+  {
+    s -= 2;
+    prevS -= 2;
+    if (s[0] != prevS[0] || s[1] != prevS[1]) return (uint16_t *)(s + 2) - framebuffer;
+  }
+  return 0;
+}
+#endif
 
 void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, Span *&head)
 {
@@ -129,7 +182,7 @@ void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *p
   uint16_t *scanline = framebuffer;
   uint16_t *prevScanline = prevFramebuffer;
 
-  static const bool framebufferSizeCompatibleWithCoarseDiff = gpuFramebufferScanlineStrideBytes == gpuFrameWidth*2 && gpuFramebufferScanlineStrideBytes*gpuFrameHeight % 32 == 0;
+  const bool framebufferSizeCompatibleWithCoarseDiff = gpuFramebufferScanlineStrideBytes == gpuFrameWidth*2 && gpuFramebufferScanlineStrideBytes*gpuFrameHeight % 32 == 0;
   if (framebufferSizeCompatibleWithCoarseDiff)
   {
     int numPixels = gpuFrameWidth*gpuFrameHeight;
@@ -280,20 +333,18 @@ found_right:
 }
 #endif
 
-void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+static int DiffFramebuffersToScanlineSpansFastAndCoarse4WideBand(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans)
 {
   int numSpans = 0;
-  int y = interlacedDiff ? interlacedFieldParity : 0;
-  int yInc = interlacedDiff ? 2 : 1;
+  Span *span = bandSpans;
   // If doing an interlaced update, skip over every second scanline.
-  int scanlineInc = interlacedDiff ? (gpuFramebufferScanlineStrideBytes>>2) : (gpuFramebufferScanlineStrideBytes>>3);
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>3);
   uint64_t *scanline = (uint64_t *)(framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1));
   uint64_t *prevScanline = (uint64_t *)(prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1)); // (same scanline from previous frame, not preceding scanline)
 
   const int W = gpuFrameWidth>>2;
 
-  Span *span = spans;
-  while(y < gpuFrameHeight)
+  while(y < endY)
   {
     uint16_t *scanlineStart = (uint16_t *)scanline;
 
@@ -350,29 +401,313 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
   }
 
   if (numSpans > 0)
+    span[-1].next = 0;
+  return numSpans;
+}
+
+#if defined(USE_TILE_DIRTY_MAP) || defined(USE_HARDWARE_VERTICAL_SCROLL) || defined(USE_SCANLINE_CHECKSUMS)
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// FNV-1a over 32-bit words. Only the new framebuffer needs to be read to hash it, so this is about twice as fast as comparing
+// against the previous framebuffer.
+static inline uint32_t HashPixels(uint32_t hash, const uint32_t *pixels, int numPixelPairs)
+{
+  for(int i = 0; i < numPixelPairs; ++i)
+    hash = (hash ^ pixels[i]) * FNV_PRIME;
+  return hash;
+}
+
+#endif
+
+#ifdef USE_SCANLINE_CHECKSUMS
+
+static uint32_t *scanlineChecksums = 0; // For each scanline, checksum of the scanline contents in prevFramebuffer, or 0 if not known.
+static uint8_t *dirtyScanlines = 0; // For each scanline, nonzero if the scanline has changed pixels in it.
+
+// Computes the checksum of a scanline. When the CRC32 extension is enabled (CMakeLists.txt builds this file with -march=armv8-a+crc on
+// 32-bit ARMv8 Pis, and on AArch64 if the compiler enables it by default), this uses the hardware CRC32 instructions, which process a
+// pixel pair per instruction. Otherwise falls back to FNV-1a. Zero is reserved to denote an unknown checksum.
+static inline uint32_t ChecksumScanline(const uint16_t *scanline)
+{
+  const int numPixelPairs = gpuFrameWidth >> 1;
+#ifdef __ARM_FEATURE_CRC32
+  uint32_t checksum = 0xFFFFFFFFu;
+  for(int i = 0; i < numPixelPairs; ++i)
+    checksum = __crc32w(checksum, ((const uint32_t *)scanline)[i]);
+  if ((gpuFrameWidth & 1)) checksum = __crc32h(checksum, scanline[gpuFrameWidth-1]);
+#else
+  uint32_t checksum = HashPixels(FNV_OFFSET_BASIS, (const uint32_t *)scanline, numPixelPairs);
+  if ((gpuFrameWidth & 1)) checksum = (checksum ^ scanline[gpuFrameWidth-1]) * FNV_PRIME;
+#endif
+  return checksum ? checksum : 1;
+}
+
+int ChecksumScanlinesAndCountChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  if (!scanlineChecksums)
   {
-    head = &spans[0];
-    spans[numSpans-1].next = 0;
+    scanlineChecksums = (uint32_t*)Malloc(gpuFrameHeight * sizeof(uint32_t), "ChecksumScanlinesAndCountChangedPixels() scanline checksums");
+    memset(scanlineChecksums, 0, gpuFrameHeight * sizeof(uint32_t));
+    dirtyScanlines = (uint8_t*)Malloc(gpuFrameHeight, "ChecksumScanlinesAndCountChangedPixels() dirty scanlines");
   }
-  else
-    head = 0;
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  int changedPixels = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y, framebuffer += stride, prevFramebuffer += stride)
+  {
+    uint32_t checksum = ChecksumScanline(framebuffer);
+    dirtyScanlines[y] = 0;
+    if (scanlineChecksums[y] == checksum) continue;
+
+    // Checksum differs, so compare the scanline pixel by pixel while it is still warm in the cache
+    int changed = 0;
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (framebuffer[x] != prevFramebuffer[x])
+        ++changed;
+    if (changed)
+    {
+      // The contents of the previous framebuffer on this scanline will change when the changed pixels are submitted, (or not at
+      // all, if this scanline is skipped in an interlaced update) so forget the checksum, and compare again when it is next seen.
+      scanlineChecksums[y] = 0;
+      dirtyScanlines[y] = 1;
+      changedPixels += changed;
+    }
+    else
+      scanlineChecksums[y] = checksum;
+  }
+  return changedPixels;
 }
 
-void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+#endif
+
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+
+// For each scanline, the range [damageX[y], damageEndX[y][ of pixels that the frame source has reported as damaged since the display
+// was last brought up to date. Pixels outside this range are the same in the framebuffer and prevFramebuffer, so the diff skips them.
+// An empty range is denoted by damageX[y] == gpuFrameWidth and damageEndX[y] == 0.
+static uint16_t *damageX = 0, *damageEndX = 0;
+
+void ClearDamage()
+{
+  if (!damageX)
+  {
+    damageX = (uint16_t*)Malloc(gpuFrameHeight * sizeof(uint16_t), "ClearDamage() damage start");
+    damageEndX = (uint16_t*)Malloc(gpuFrameHeight * sizeof(uint16_t), "ClearDamage() damage end");
+  }
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    damageX[y] = gpuFrameWidth;
+    damageEndX[y] = 0;
+  }
+}
+
+void AddDamageRect(int x, int y, int endX, int endY)
+{
+  if (!damageX) ClearDamage();
+  x = MAX(0, x) & ~1; // Keep the scalar diff reading aligned pixel pairs
+  y = MAX(0, y);
+  endX = MIN(gpuFrameWidth, endX);
+  endY = MIN(gpuFrameHeight, endY);
+  if (x >= endX) return;
+  for(; y < endY; ++y)
+  {
+    damageX[y] = MIN(damageX[y], x);
+    damageEndX[y] = MAX(damageEndX[y], endX);
+  }
+}
+
+int CountNumChangedPixelsInDamage(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  if (!damageX) AddDamageRect(0, 0, gpuFrameWidth, gpuFrameHeight); // Nothing reported yet, so anything may have changed
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  int changedPixels = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y, framebuffer += stride, prevFramebuffer += stride)
+    for(int x = damageX[y]; x < damageEndX[y]; ++x)
+      if (framebuffer[x] != prevFramebuffer[x])
+        ++changedPixels;
+  return changedPixels;
+}
+
+#endif
+
+#ifdef USE_NEON_PIXEL_DIFF
+
+// Returns the index of the first pixel in [x, endX[ that differs between the two scanlines, or endX if all pixels are the same.
+// Compares 16 pixels per iteration, and locates the first differing pixel from the narrowed 8-bit per lane comparison mask.
+static inline int FirstChangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 16 <= endX; x += 16)
+  {
+    uint8x16_t eq = vcombine_u8(vmovn_u16(vceqq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x))),
+                                vmovn_u16(vceqq_u16(vld1q_u16(scanline+x+8), vld1q_u16(prevScanline+x+8))));
+    uint64_t lo = ~vgetq_lane_u64(vreinterpretq_u64_u8(eq), 0);
+    if (lo) return x + (__builtin_ctzll(lo) >> 3);
+    uint64_t hi = ~vgetq_lane_u64(vreinterpretq_u64_u8(eq), 1);
+    if (hi) return x + 8 + (__builtin_ctzll(hi) >> 3);
+  }
+  if (x + 8 <= endX)
+  {
+    uint64_t ne = ~vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vceqq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x)))), 0);
+    if (ne) return x + (__builtin_ctzll(ne) >> 3);
+    x += 8;
+  }
+  while(x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+// Returns the index of the first pixel in [x, endX[ that is the same in both scanlines, or endX if all pixels differ.
+static inline int FirstUnchangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 16 <= endX; x += 16)
+  {
+    uint8x16_t eq = vcombine_u8(vmovn_u16(vceqq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x))),
+                                vmovn_u16(vceqq_u16(vld1q_u16(scanline+x+8), vld1q_u16(prevScanline+x+8))));
+    uint64_t lo = vgetq_lane_u64(vreinterpretq_u64_u8(eq), 0);
+    if (lo) return x + (__builtin_ctzll(lo) >> 3);
+    uint64_t hi = vgetq_lane_u64(vreinterpretq_u64_u8(eq), 1);
+    if (hi) return x + 8 + (__builtin_ctzll(hi) >> 3);
+  }
+  if (x + 8 <= endX)
+  {
+    uint64_t eq = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vceqq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x)))), 0);
+    if (eq) return x + (__builtin_ctzll(eq) >> 3);
+    x += 8;
+  }
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+#elif defined(USE_TILE_DIRTY_MAP)
+
+// Returns the index of the first pixel in [x, endX[ that differs between the two scanlines, or endX if all pixels are the same.
+static inline int FirstChangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 1 < endX; x += 2)
+  {
+    uint32_t diff = *(uint32_t *)(scanline+x) ^ *(uint32_t *)(prevScanline+x);
+    if (diff) return (diff & 0xFFFF) ? x : x+1;
+  }
+  if (x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+// Returns the index of the first pixel in [x, endX[ that is the same in both scanlines, or endX if all pixels differ.
+static inline int FirstUnchangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+#endif
+
+#ifdef USE_NEON_PIXEL_DIFF
+
+// NEON version of the exact diff. This produces the identical Span list as the scalar version below: the scalar version scans
+// pixels in pairs starting from where the previous span search ended, and a span always starts at the first pixel of the first
+// differing pair, so here the span start is rounded down to that same pair boundary. Spans are then extended through runs of at
+// most SPAN_MERGE_THRESHOLD unchanged pixels.
+static int DiffFramebuffersToScanlineSpansExactBand(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans)
 {
   int numSpans = 0;
-  int y = interlacedDiff ? interlacedFieldParity : 0;
-  int yInc = interlacedDiff ? 2 : 1;
+  const int mergeThreshold = spanMergeThreshold;
   // If doing an interlaced update, skip over every second scanline.
-  int scanlineInc = interlacedDiff ? gpuFramebufferScanlineStrideBytes : (gpuFramebufferScanlineStrideBytes>>1);
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+
+  while(y < endY)
+  {
+#ifdef USE_SCANLINE_CHECKSUMS
+    if (!dirtyScanlines[y]) // Checksum matched the previous contents of this scanline, so it can be skipped without reading it
+    {
+      y += yInc;
+      scanline += scanlineInc;
+      prevScanline += scanlineInc;
+      continue;
+    }
+#endif
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+    // Only scan the part of the scanline that the frame source reported as damaged
+    int x = damageX[y];
+    const int W = damageEndX[y];
+#else
+    int x = 0;
+    const int W = gpuFrameWidth;
+#endif
+    while(x < W)
+    {
+      int firstChanged = FirstChangedPixel(scanline, prevScanline, x, W);
+      if (firstChanged >= W) break;
+
+      int spanStart = x + ((firstChanged - x) & ~1);
+      int spanEnd = FirstUnchangedPixel(scanline, prevScanline, firstChanged+1, W);
+
+      // We've found a start of a span of different pixels on this scanline, now find where this span ends
+      for(;;)
+      {
+        int searchEnd = MIN(W, spanEnd + mergeThreshold + 1);
+        int nextChanged = FirstChangedPixel(scanline, prevScanline, spanEnd, searchEnd);
+        if (nextChanged >= searchEnd)
+        {
+          x = searchEnd;
+          break;
+        }
+        spanEnd = FirstUnchangedPixel(scanline, prevScanline, nextChanged+1, W);
+      }
+
+      // Submit the span update task
+      Span *span = bandSpans + numSpans;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      if (numSpans > 0) span[-1].next = span;
+      span->next = 0;
+      ++numSpans;
+    }
+    y += yInc;
+    scanline += scanlineInc;
+    prevScanline += scanlineInc;
+  }
+  return numSpans;
+}
+
+#else
+
+static int DiffFramebuffersToScanlineSpansExactBand(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans)
+{
+  int numSpans = 0;
+  const int mergeThreshold = spanMergeThreshold;
+  // If doing an interlaced update, skip over every second scanline.
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>1);
   int scanlineEndInc = scanlineInc - gpuFrameWidth;
   uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
   uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
 
-  while(y < gpuFrameHeight)
+  while(y < endY)
   {
+#ifdef USE_SCANLINE_CHECKSUMS
+    if (!dirtyScanlines[y]) // Checksum matched the previous contents of this scanline, so it can be skipped without reading it
+    {
+      y += yInc;
+      scanline += scanlineInc;
+      prevScanline += scanlineInc;
+      continue;
+    }
+#endif
     uint16_t *scanlineStart = scanline;
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+    // Only scan the part of the scanline that the frame source reported as damaged
+    uint16_t *scanlineEnd = scanline + damageEndX[y];
+    scanline += damageX[y];
+    prevScanline += damageX[y];
+#else
     uint16_t *scanlineEnd = scanline + gpuFrameWidth;
+#endif
     while(scanline < scanlineEnd)
     {
       uint16_t *spanStart;
@@ -417,7 +752,7 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
           }
           else
           {
-            if (++numConsecutiveUnchangedPixels > SPAN_MERGE_THRESHOLD)
+            if (++numConsecutiveUnchangedPixels > mergeThreshold)
               break;
           }
         }
@@ -432,25 +767,629 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
       }
 
       // Submit the span update task
-      Span *span = spans + numSpans;
+      Span *span = bandSpans + numSpans;
       span->x = spanStart - scanlineStart;
       span->endX = span->lastScanEndX = spanEnd - scanlineStart;
       span->y = y;
       span->endY = y+1;
       span->size = spanEnd - spanStart;
       if (numSpans > 0) span[-1].next = span;
-      else head = span;
       span->next = 0;
       ++numSpans;
     }
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+    // Advance past the undamaged pixels at the end of the scanline
+    int numSkippedPixels = scanlineStart + gpuFrameWidth - scanline;
+    scanline += numSkippedPixels;
+    prevScanline += numSkippedPixels;
+#endif
     y += yInc;
     scanline += scanlineEndInc;
     prevScanline += scanlineEndInc;
   }
+  return numSpans;
+}
+
+#endif
+
+#ifdef PERCEPTUAL_DIFF_THRESHOLD
+
+int perceptualDiffRefreshY = 0;
+
+// Returns true if any of the R5G6B5 color channels of the two pixels differ by at least the given threshold (in 5-bit units)
+static inline bool PixelChangedPerceptibly(uint16_t pixel, uint16_t prevPixel, int threshold)
+{
+  int r = (pixel >> 11) - (prevPixel >> 11);
+  int g = ((pixel >> 5) & 0x3F) - ((prevPixel >> 5) & 0x3F);
+  int b = (pixel & 0x1F) - (prevPixel & 0x1F);
+  return r >= threshold || r <= -threshold || g >= 2*threshold-1 || g <= 1-2*threshold || b >= threshold || b <= -threshold;
+}
+
+// Scanlines in the refresh window are diffed exactly
+static inline int PerceptualDiffThreshold(int y)
+{
+  return ((unsigned)(y - perceptualDiffRefreshY) < PERCEPTUAL_DIFF_REFRESH_SCANLINES) ? 1 : PERCEPTUAL_DIFF_THRESHOLD;
+}
+
+// Returns the index of the first pixel in [x, endX[ that has perceptibly changed, or endX if none have.
+static inline int FirstPerceptiblyChangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX, int threshold)
+{
+  while(x < endX && (scanline[x] == prevScanline[x] || !PixelChangedPerceptibly(scanline[x], prevScanline[x], threshold))) ++x;
+  return x;
+}
+
+// Returns the index of the first pixel in [x, endX[ that has not perceptibly changed, or endX if all have.
+static inline int FirstPerceptiblyUnchangedPixel(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX, int threshold)
+{
+  while(x < endX && scanline[x] != prevScanline[x] && PixelChangedPerceptibly(scanline[x], prevScanline[x], threshold)) ++x;
+  return x;
+}
+
+int CountNumPerceptiblyChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  int changedPixels = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    const int threshold = PerceptualDiffThreshold(y);
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (framebuffer[x] != prevFramebuffer[x] && PixelChangedPerceptibly(framebuffer[x], prevFramebuffer[x], threshold))
+        ++changedPixels;
+
+    framebuffer += gpuFramebufferScanlineStrideBytes >> 1;
+    prevFramebuffer += gpuFramebufferScanlineStrideBytes >> 1;
+  }
+  return changedPixels;
+}
+
+// Same as DiffFramebuffersToScanlineSpansExactBand(), but skips over changes that are below the perceptual threshold. Spans are
+// still extended through runs of at most SPAN_MERGE_THRESHOLD unchanged pixels, which sends those pixels exactly as well.
+static int DiffFramebuffersToScanlineSpansPerceptualBand(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans)
+{
+  int numSpans = 0;
+  const int mergeThreshold = spanMergeThreshold;
+  // If doing an interlaced update, skip over every second scanline.
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+  const int W = gpuFrameWidth;
+
+  while(y < endY)
+  {
+    const int threshold = PerceptualDiffThreshold(y);
+    int x = 0;
+    while(x < W)
+    {
+      int spanStart = FirstPerceptiblyChangedPixel(scanline, prevScanline, x, W, threshold);
+      if (spanStart >= W) break;
+
+      int spanEnd = FirstPerceptiblyUnchangedPixel(scanline, prevScanline, spanStart+1, W, threshold);
+
+      // We've found a start of a span of different pixels on this scanline, now find where this span ends
+      for(;;)
+      {
+        int searchEnd = MIN(W, spanEnd + mergeThreshold + 1);
+        int nextChanged = FirstPerceptiblyChangedPixel(scanline, prevScanline, spanEnd, searchEnd, threshold);
+        if (nextChanged >= searchEnd)
+        {
+          x = searchEnd;
+          break;
+        }
+        spanEnd = FirstPerceptiblyUnchangedPixel(scanline, prevScanline, nextChanged+1, W, threshold);
+      }
+
+      // Submit the span update task
+      Span *span = bandSpans + numSpans;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      if (numSpans > 0) span[-1].next = span;
+      span->next = 0;
+      ++numSpans;
+    }
+    y += yInc;
+    scanline += scanlineInc;
+    prevScanline += scanlineInc;
+  }
+  return numSpans;
+}
+
+#endif
+
+#ifdef USE_TILE_DIRTY_MAP
+
+static int numTilesX = 0, numTilesY = 0, dirtyTileWordsPerRow = 0;
+static uint32_t *tileHashes = 0; // For each tile, hash of the tile contents in prevFramebuffer, or 0 if not known.
+static uint32_t *tileRowHashes = 0; // Hashes of the tiles of the tile row currently being processed in the new framebuffer
+static uint32_t *dirtyTiles = 0; // Bitmask of tiles that have changed pixels in them, dirtyTileWordsPerRow uint32s per tile row.
+
+static int CountChangedPixelsInTile(uint16_t *framebuffer, uint16_t *prevFramebuffer, int x, int y, int endX, int endY)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  int changedPixels = 0;
+  for(framebuffer += y*stride + x, prevFramebuffer += y*stride + x; y < endY; ++y, framebuffer += stride, prevFramebuffer += stride)
+    for(int i = 0; i < endX - x; ++i)
+      if (framebuffer[i] != prevFramebuffer[i])
+        ++changedPixels;
+  return changedPixels;
+}
+
+int DiffFramebuffersToTileDirtyMap(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  if (!tileHashes)
+  {
+    numTilesX = (gpuFrameWidth + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SIZE_SHIFT;
+    numTilesY = (gpuFrameHeight + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SIZE_SHIFT;
+    dirtyTileWordsPerRow = (numTilesX + 31) >> 5;
+    tileHashes = (uint32_t*)Malloc(numTilesX * numTilesY * sizeof(uint32_t), "DiffFramebuffersToTileDirtyMap() tile hashes");
+    memset(tileHashes, 0, numTilesX * numTilesY * sizeof(uint32_t));
+    tileRowHashes = (uint32_t*)Malloc(numTilesX * sizeof(uint32_t), "DiffFramebuffersToTileDirtyMap() tile row hashes");
+    dirtyTiles = (uint32_t*)Malloc(dirtyTileWordsPerRow * numTilesY * sizeof(uint32_t), "DiffFramebuffersToTileDirtyMap() dirty tiles");
+  }
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  const int widthAlignedToTiles = gpuFrameWidth & ~(DIRTY_TILE_SIZE-1);
+  int changedPixels = 0;
+  for(int ty = 0; ty < numTilesY; ++ty)
+  {
+    // Stream through the scanlines of this tile row in the new framebuffer, hashing each tile
+    const int y = ty << DIRTY_TILE_SIZE_SHIFT;
+    const int endY = MIN(y + DIRTY_TILE_SIZE, gpuFrameHeight);
+    for(int tx = 0; tx < numTilesX; ++tx) tileRowHashes[tx] = FNV_OFFSET_BASIS;
+    uint16_t *scanline = framebuffer + y*stride;
+    for(int sy = y; sy < endY; ++sy, scanline += stride)
+    {
+      uint32_t *hash = tileRowHashes;
+      int x = 0;
+      for(; x < widthAlignedToTiles; x += DIRTY_TILE_SIZE, ++hash)
+        *hash = HashPixels(*hash, (const uint32_t *)(scanline + x), DIRTY_TILE_SIZE/2);
+      for(; x < gpuFrameWidth; ++x) // Partial tile at the right edge of the screen
+        *hash = (*hash ^ scanline[x]) * FNV_PRIME;
+    }
+
+    // Tiles whose hash matches the previous contents are clean, others are compared pixel by pixel while the tile is still warm in the cache
+    uint32_t *tileHash = tileHashes + ty*numTilesX;
+    uint32_t *dirtyRow = dirtyTiles + ty*dirtyTileWordsPerRow;
+    memset(dirtyRow, 0, dirtyTileWordsPerRow * sizeof(uint32_t));
+    for(int tx = 0; tx < numTilesX; ++tx)
+    {
+      uint32_t hash = tileRowHashes[tx] ? tileRowHashes[tx] : 1; // Zero is reserved to denote a tile with unknown hash
+      if (tileHash[tx] == hash) continue;
+      const int x = tx << DIRTY_TILE_SIZE_SHIFT;
+      int changed = CountChangedPixelsInTile(framebuffer, prevFramebuffer, x, y, MIN(x + DIRTY_TILE_SIZE, gpuFrameWidth), endY);
+      if (changed)
+      {
+        // The contents of the previous framebuffer in this tile will change when the dirty pixels are submitted, (or
+        // only half of them, if doing an interlaced update) so forget the hash, and rehash the tile when it is next seen.
+        tileHash[tx] = 0;
+        dirtyRow[tx>>5] |= 1u << (tx&31);
+        changedPixels += changed;
+      }
+      else
+        tileHash[tx] = hash;
+    }
+  }
+  return changedPixels;
+}
+
+// Same as FirstChangedPixel(), but skips over tiles that are marked clean in the dirty map without reading them
+static inline int FirstChangedPixelInDirtyTiles(const uint16_t *scanline, const uint16_t *prevScanline, const uint32_t *dirtyRow, int x, int endX)
+{
+  while(x < endX)
+  {
+    int tile = x >> DIRTY_TILE_SIZE_SHIFT;
+    uint32_t dirty = dirtyRow[tile>>5] >> (tile&31);
+    if (!dirty)
+    {
+      x = ((tile|31)+1) << DIRTY_TILE_SIZE_SHIFT; // No dirty tiles in the rest of this mask word
+      continue;
+    }
+    int dirtyTile = tile + __builtin_ctz(dirty);
+    if (dirtyTile != tile) x = dirtyTile << DIRTY_TILE_SIZE_SHIFT;
+    int tileEnd = MIN((dirtyTile+1) << DIRTY_TILE_SIZE_SHIFT, endX);
+    x = FirstChangedPixel(scanline, prevScanline, x, tileEnd);
+    if (x < tileEnd) return x;
+  }
+  return endX;
+}
+
+static int DiffFramebuffersToScanlineSpansInDirtyTilesBand(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans)
+{
+  int numSpans = 0;
+  const int mergeThreshold = spanMergeThreshold;
+  // If doing an interlaced update, skip over every second scanline.
+  int scanlineInc = yInc * (gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
+  uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+  const int W = gpuFrameWidth;
+
+  while(y < endY)
+  {
+    const uint32_t *dirtyRow = dirtyTiles + (y >> DIRTY_TILE_SIZE_SHIFT)*dirtyTileWordsPerRow;
+    int x = 0;
+    while(x < W)
+    {
+      int spanStart = FirstChangedPixelInDirtyTiles(scanline, prevScanline, dirtyRow, x, W);
+      if (spanStart >= W) break;
+      int spanEnd = FirstUnchangedPixel(scanline, prevScanline, spanStart+1, W);
+
+      // Extend the span through runs of at most SPAN_MERGE_THRESHOLD unchanged pixels
+      for(;;)
+      {
+        int searchEnd = MIN(W, spanEnd + mergeThreshold + 1);
+        int nextChanged = FirstChangedPixelInDirtyTiles(scanline, prevScanline, dirtyRow, spanEnd, searchEnd);
+        if (nextChanged >= searchEnd)
+        {
+          x = searchEnd;
+          break;
+        }
+        spanEnd = FirstUnchangedPixel(scanline, prevScanline, nextChanged+1, W);
+      }
+
+      // Submit the span update task
+      Span *span = bandSpans + numSpans;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      span->size = spanEnd - spanStart;
+      if (numSpans > 0) span[-1].next = span;
+      span->next = 0;
+      ++numSpans;
+    }
+    y += yInc;
+    scanline += scanlineInc;
+    prevScanline += scanlineInc;
+  }
+  return numSpans;
+}
+
+#endif
+
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+
+int scrollWrapY = 0;
+
+static uint32_t *scanlineHashes = 0, *prevScanlineHashes = 0;
+static uint16_t *scrolledScanlines = 0;
+
+static void HashScanlines(uint16_t *framebuffer, uint32_t *hashes)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = 0; y < gpuFrameHeight; ++y, framebuffer += stride)
+  {
+    uint32_t hash = HashPixels(FNV_OFFSET_BASIS, (const uint32_t *)framebuffer, gpuFrameWidth>>1);
+    if ((gpuFrameWidth & 1)) hash = (hash ^ framebuffer[gpuFrameWidth-1]) * FNV_PRIME;
+    hashes[y] = hash;
+  }
+}
+
+// Counts how many scanlines of the new framebuffer would be correct on the display, if the previous framebuffer was rotated up by the given amount of scanlines
+static int CountScanlinesMatchingAfterScroll(int scanlines)
+{
+  const int height = gpuFrameHeight;
+  int matches = 0;
+  for(int y = 0; y < height - scanlines; ++y)
+    if (scanlineHashes[y] == prevScanlineHashes[y + scanlines]) ++matches;
+  for(int y = height - scanlines; y < height; ++y)
+    if (scanlineHashes[y] == prevScanlineHashes[y + scanlines - height]) ++matches;
+  return matches;
+}
+
+int DetectVerticalScroll(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  const int height = gpuFrameHeight;
+
+  // Scrolling content changes nearly all scanlines, so first compare a sparse sample of the scanlines to quickly rule out frames where
+  // most of the screen stayed in place.
+  int numSampled = 0, numChanged = 0;
+  for(int y = 0; y < height; y += SCROLL_DETECT_SAMPLE_INTERVAL, ++numSampled)
+    if (memcmp(framebuffer + y*stride, prevFramebuffer + y*stride, gpuFrameWidth*FRAMEBUFFER_BYTESPERPIXEL)) ++numChanged;
+  if (numChanged*2 < numSampled)
+    return 0;
+
+  if (!scanlineHashes)
+  {
+    scanlineHashes = (uint32_t*)Malloc(height * sizeof(uint32_t), "DetectVerticalScroll() scanline hashes");
+    prevScanlineHashes = (uint32_t*)Malloc(height * sizeof(uint32_t), "DetectVerticalScroll() previous scanline hashes");
+  }
+  HashScanlines(framebuffer, scanlineHashes);
+  HashScanlines(prevFramebuffer, prevScanlineHashes);
+
+  // Find the scroll amount that leaves the most scanlines correct on the display. Try the short distances first, so that
+  // ties, such as when scrolling through uniformly colored scanlines, are resolved to the shortest scroll.
+  const int unscrolledMatches = CountScanlinesMatchingAfterScroll(0);
+  int bestScroll = 0, bestMatches = unscrolledMatches;
+  for(int scanlines = 1; scanlines <= height/2; ++scanlines)
+  {
+    int matches = CountScanlinesMatchingAfterScroll(scanlines);
+    if (matches > bestMatches) bestScroll = scanlines, bestMatches = matches;
+    matches = CountScanlinesMatchingAfterScroll(height - scanlines);
+    if (matches > bestMatches) bestScroll = -scanlines, bestMatches = matches;
+  }
+
+  // Only scroll if it saves a good amount of bandwidth, since the newly exposed scanlines briefly show the old contents that wrapped around.
+  return (bestMatches - unscrolledMatches >= height / SCROLL_DETECT_MIN_SAVED_FRACTION) ? bestScroll : 0;
+}
+
+void ScrollFramebuffer(uint16_t *framebuffer, int scanlines)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  const int height = gpuFrameHeight;
+  scanlines = (scanlines % height + height) % height;
+  if (!scrolledScanlines) scrolledScanlines = (uint16_t*)Malloc(height * stride * sizeof(uint16_t), "ScrollFramebuffer() scanlines");
+
+  memcpy(scrolledScanlines, framebuffer, scanlines * stride * sizeof(uint16_t));
+  memmove(framebuffer, framebuffer + scanlines * stride, (height - scanlines) * stride * sizeof(uint16_t));
+  memcpy(framebuffer + (height - scanlines) * stride, scrolledScanlines, scanlines * stride * sizeof(uint16_t));
+
+#ifdef USE_TILE_DIRTY_MAP
+  // The tiles of the previous framebuffer moved, so their hashes are no longer valid.
+  if (tileHashes) memset(tileHashes, 0, numTilesX * numTilesY * sizeof(uint32_t));
+#endif
+
+#ifdef USE_SCANLINE_CHECKSUMS
+  // Whole scanlines moved, so their checksums move along with them.
+  if (scanlineChecksums)
+  {
+    uint32_t *scrolledChecksums = (uint32_t*)scrolledScanlines;
+    memcpy(scrolledChecksums, scanlineChecksums, scanlines * sizeof(uint32_t));
+    memmove(scanlineChecksums, scanlineChecksums + scanlines, (height - scanlines) * sizeof(uint32_t));
+    memcpy(scanlineChecksums + height - scanlines, scrolledChecksums, scanlines * sizeof(uint32_t));
+  }
+#endif
+}
+
+#endif
+
+// Diffs the scanlines [y, endY[ (stepping yInc scanlines at a time) and writes the found spans to consecutive elements of the
+// given span array, linking them into a list. Returns the number of spans produced.
+typedef int (*DiffBandFunc)(uint16_t *framebuffer, uint16_t *prevFramebuffer, int y, int endY, int yInc, Span *bandSpans);
+
+#if defined(DIFF_THREADS) && DIFF_THREADS > 1
+
+// The framebuffer is diffed in DIFF_THREADS horizontal bands, of which the main thread diffs the first one, and a persistent pool
+// of DIFF_THREADS-1 worker threads diffs the rest. Each band writes its spans to its own section of the spans array, so no
+// synchronization is needed other than waiting for all bands to finish before stitching the span lists together.
+struct DiffBand
+{
+  int y, endY;
+  Span *spans;
+  int numSpans;
+};
+
+static DiffBand diffBands[DIFF_THREADS];
+static DiffBandFunc diffBandFunc;
+static uint16_t *diffFramebuffer, *diffPrevFramebuffer;
+static int diffYInc;
+
+static pthread_t diffThreads[DIFF_THREADS-1];
+static volatile int diffJobGeneration = 0; // Incremented by the main thread to wake the workers up to diff a new frame
+static volatile int diffBandsPending = 0; // Number of bands that the workers have yet to finish
+static volatile bool diffThreadsQuit = false;
+
+static void RunDiffBand(int band)
+{
+  DiffBand &b = diffBands[band];
+  b.numSpans = (b.y < b.endY) ? diffBandFunc(diffFramebuffer, diffPrevFramebuffer, b.y, b.endY, diffYInc, b.spans) : 0;
+}
+
+static void *diff_thread(void *arg)
+{
+  const int band = (int)(intptr_t)arg;
+#ifdef DIFF_THREAD_FIRST_CORE
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET((DIFF_THREAD_FIRST_CORE + band - 1) % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    printf("Warning: failed to set CPU affinity of diff thread %d\n", band);
+#endif
+  int generation = 0;
+  for(;;)
+  {
+    int newGeneration;
+    while((newGeneration = __atomic_load_n(&diffJobGeneration, __ATOMIC_ACQUIRE)) == generation)
+      syscall(SYS_futex, &diffJobGeneration, FUTEX_WAIT, generation, 0, 0, 0); // Sleep until the main thread has a new frame to diff
+    generation = newGeneration;
+    if (diffThreadsQuit) break;
+
+    RunDiffBand(band);
+
+    if (__atomic_sub_fetch(&diffBandsPending, 1, __ATOMIC_ACQ_REL) == 0)
+      syscall(SYS_futex, &diffBandsPending, FUTEX_WAKE, 1, 0, 0, 0); // Last band done, wake the main thread
+  }
+  pthread_exit(0);
+}
+
+void InitDiffThreads()
+{
+  for(int i = 0; i < DIFF_THREADS-1; ++i)
+  {
+    int rc = pthread_create(&diffThreads[i], NULL, diff_thread, (void*)(intptr_t)(i+1));
+    if (rc != 0) FATAL_ERROR("Failed to create diff thread!");
+  }
+  printf("Diffing framebuffers in %d threads\n", DIFF_THREADS);
+}
+
+void DeinitDiffThreads()
+{
+  diffThreadsQuit = true;
+  __atomic_add_fetch(&diffJobGeneration, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &diffJobGeneration, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+  for(int i = 0; i < DIFF_THREADS-1; ++i)
+  {
+    pthread_join(diffThreads[i], NULL);
+    diffThreads[i] = (pthread_t)0;
+  }
+}
+
+static void DiffFramebuffersInBands(DiffBandFunc func, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  diffBandFunc = func;
+  diffFramebuffer = framebuffer;
+  diffPrevFramebuffer = prevFramebuffer;
+  diffYInc = interlacedDiff ? 2 : 1;
+  for(int i = 0; i < DIFF_THREADS; ++i)
+  {
+    int y = gpuFrameHeight * i / DIFF_THREADS;
+    diffBands[i].endY = gpuFrameHeight * (i+1) / DIFF_THREADS;
+    diffBands[i].spans = spans + y * ((gpuFrameWidth+1)>>1); // Each scanline can produce at most ceil(width/2) spans
+    // If doing an interlaced update, start each band on a scanline of the field being updated
+    if (interlacedDiff && (y & 1) != interlacedFieldParity) ++y;
+    diffBands[i].y = y;
+  }
+
+  __atomic_store_n(&diffBandsPending, DIFF_THREADS-1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&diffJobGeneration, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &diffJobGeneration, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+
+  RunDiffBand(0);
+
+  int pending;
+  while((pending = __atomic_load_n(&diffBandsPending, __ATOMIC_ACQUIRE)) != 0)
+    syscall(SYS_futex, &diffBandsPending, FUTEX_WAIT, pending, 0, 0, 0);
+
+  // Stitch the span lists of each band together in increasing y order
+  head = 0;
+  Span *tail = 0;
+  for(int i = 0; i < DIFF_THREADS; ++i)
+  {
+    if (diffBands[i].numSpans == 0) continue;
+    if (tail) tail->next = diffBands[i].spans;
+    else head = diffBands[i].spans;
+    tail = diffBands[i].spans + diffBands[i].numSpans - 1;
+  }
+}
+
+#else
+
+void InitDiffThreads()
+{
+}
+
+void DeinitDiffThreads()
+{
+}
+
+static void DiffFramebuffersInBands(DiffBandFunc func, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  int numSpans = func(framebuffer, prevFramebuffer, interlacedDiff ? interlacedFieldParity : 0, gpuFrameHeight, interlacedDiff ? 2 : 1, spans);
+  head = (numSpans > 0) ? spans : 0;
+}
+
+#endif
+
+void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  DiffFramebuffersInBands(DiffFramebuffersToScanlineSpansFastAndCoarse4WideBand, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+}
+
+void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+  if (!damageX) AddDamageRect(0, 0, gpuFrameWidth, gpuFrameHeight);
+#endif
+  DiffFramebuffersInBands(DiffFramebuffersToScanlineSpansExactBand, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+}
+
+#ifdef PERCEPTUAL_DIFF_THRESHOLD
+void DiffFramebuffersToScanlineSpansPerceptual(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  DiffFramebuffersInBands(DiffFramebuffersToScanlineSpansPerceptualBand, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+}
+#endif
+
+#ifdef USE_TILE_DIRTY_MAP
+void DiffFramebuffersToScanlineSpansInDirtyTiles(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+{
+  DiffFramebuffersInBands(DiffFramebuffersToScanlineSpansInDirtyTilesBand, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, head);
+}
+#endif
+
+// Returns the modeled SPI bus cost of sending a task with the given payload size, see SPAN_START_COST in diff.h.
+static inline int SpiTaskCost(int bytes)
+{
+#if defined(ALL_TASKS_SHOULD_DMA)
+  return SPI_DMA_SETUP_COST + bytes * SPI_DMA_BYTE_COST;
+#elif defined(USE_DMA_TRANSFERS)
+  return (bytes > dmaIsFasterThanPolledSpi) ? SPI_DMA_SETUP_COST + bytes * SPI_DMA_BYTE_COST : bytes * SPI_POLLED_BYTE_COST;
+#else
+  return bytes * SPI_POLLED_BYTE_COST;
+#endif
+}
+
+// Returns the modeled SPI bus cost of submitting a span of the given number of pixels
+static inline int SpanCost(int numPixels)
+{
+  return spanStartCost + SpiTaskCost(numPixels * SPI_BYTESPERPIXEL);
+}
+
+// How many preceding spans on a scanline are considered for merging together with a span
+#define SPAN_MERGE_DP_WINDOW 16
+
+// Merges the single scanline spans produced by the diffing functions on each scanline so that the total bus cost of sending the
+// scanline is minimized. The diff merges spans greedily only across gaps of up to SPAN_MERGE_THRESHOLD pixels, whereas this finds
+// the optimal grouping with dynamic programming over the spans of the scanline, which also accounts for when joining small polled
+// SPI tasks to a larger DMA task pays off.
+static void MergeSpansOnScanlines(Span *listHead)
+{
+  static Span **rowSpans = 0;
+  static int *bestCost = 0; // bestCost[k]: minimum cost to send the first k spans of the scanline
+  static int *groupStart = 0; // groupStart[k]: first span of the last merged group in the optimal solution for bestCost[k]
+  if (!rowSpans)
+  {
+    const int maxSpansPerScanline = (gpuFrameWidth+1)/2 + 1;
+    rowSpans = (Span**)Malloc(maxSpansPerScanline * sizeof(Span*), "MergeSpansOnScanlines() row spans");
+    bestCost = (int*)Malloc(maxSpansPerScanline * sizeof(int), "MergeSpansOnScanlines() costs");
+    groupStart = (int*)Malloc(maxSpansPerScanline * sizeof(int), "MergeSpansOnScanlines() groups");
+  }
+
+  for(Span *i = listHead; i;)
+  {
+    int n = 0;
+    Span *rowEnd = i;
+    for(; rowEnd && rowEnd->y == i->y; rowEnd = rowEnd->next) rowSpans[n++] = rowEnd;
+
+    bestCost[0] = 0;
+    for(int k = 1; k <= n; ++k)
+    {
+      bestCost[k] = bestCost[k-1] + SpanCost(rowSpans[k-1]->size);
+      groupStart[k] = k-1;
+      for(int s = k-2; s >= 0 && s >= k - SPAN_MERGE_DP_WINDOW; --s)
+      {
+        int numPixels = rowSpans[k-1]->endX - rowSpans[s]->x;
+#ifdef MAX_SPI_TASK_SIZE
+        if (numPixels*SPI_BYTESPERPIXEL > MAX_SPI_TASK_SIZE) break;
+#endif
+        int cost = bestCost[s] + SpanCost(numPixels);
+        if (cost < bestCost[k])
+        {
+          bestCost[k] = cost;
+          groupStart[k] = s;
+        }
+      }
+    }
+
+    // Walk back through the optimal grouping, merging each group to its first span
+    for(int k = n; k > 0; k = groupStart[k])
+    {
+      Span *first = rowSpans[groupStart[k]];
+      Span *last = rowSpans[k-1];
+      if (first == last) continue;
+      first->endX = first->lastScanEndX = last->endX;
+      first->size = first->endX - first->x;
+      first->next = last->next;
+    }
+    i = rowEnd;
+  }
 }
 
 void MergeScanlineSpanList(Span *listHead)
 {
+  MergeSpansOnScanlines(listHead);
+
   for(Span *i = listHead; i; i = i->next)
   {
     Span *prev = i;
@@ -460,15 +1399,17 @@ void MergeScanlineSpanList(Span *listHead)
       // (the list is nondecreasing with respect to Span::y)
       if (j->y > i->endY) break;
 
-      // Merge the spans i and j, and figure out the wastage of doing so
+      // Merge the spans i and j, and figure out if sending the merged span is cheaper than sending the two separately
       int x = MIN(i->x, j->x);
       int y = MIN(i->y, j->y);
       int endX = MAX(i->endX, j->endX);
       int endY = MAX(i->endY, j->endY);
       int lastScanEndX = (endY > i->endY) ? j->lastScanEndX : ((endY > j->endY) ? i->lastScanEndX : MAX(i->lastScanEndX, j->lastScanEndX));
       int newSize = (endX-x)*(endY-y-1) + (lastScanEndX - x);
-      int wastedPixels = newSize - i->size - j->size;
-      if (wastedPixels <= SPAN_MERGE_THRESHOLD
+      if (SpanCost(newSize) <= SpanCost(i->size) + SpanCost(j->size)
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+        && (y >= scrollWrapY || endY <= scrollWrapY)
+#endif
 #ifdef MAX_SPI_TASK_SIZE
         && newSize*SPI_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE
 #endif
@@ -488,3 +1429,126 @@ void MergeScanlineSpanList(Span *listHead)
     }
   }
 }
+
+#ifdef LATEST_FRAME_WINS
+uint16_t *SaveSpanPixels(const Span *span, const uint16_t *framebuffer, uint16_t *dst)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = span->y; y < span->endY; ++y)
+  {
+    int endX = (y + 1 == span->endY) ? span->lastScanEndX : span->endX;
+    memcpy(dst, framebuffer + y*stride + span->x, (endX - span->x)*FRAMEBUFFER_BYTESPERPIXEL);
+    dst += endX - span->x;
+  }
+  return dst;
+}
+
+const uint16_t *RestoreSpanPixels(const Span *span, uint16_t *framebuffer, const uint16_t *src)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = span->y; y < span->endY; ++y)
+  {
+    int endX = (y + 1 == span->endY) ? span->lastScanEndX : span->endX;
+    memcpy(framebuffer + y*stride + span->x, src, (endX - span->x)*FRAMEBUFFER_BYTESPERPIXEL);
+    src += endX - span->x;
+  }
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+  AddDamageRect(span->x, span->y, span->endX, span->endY);
+#endif
+  return src;
+}
+#endif
+
+#ifdef SCHEDULE_UPDATES_BY_DEADLINE
+
+static uint64_t *scanlineStaleSince = 0; // For each scanline, the time since when it has had changes deferred to a later update, or 0 if it has none
+static bool *scanlineDeferred = 0;
+static Span **scheduledSpans = 0;
+static double *spanPriorities = 0; // Indexed by the position of the span in the list
+static int *spanOrder = 0; // Span list positions, sorted to decreasing priority
+
+static int CompareSpanPriorities(const void *e1, const void *e2)
+{
+  double p1 = spanPriorities[*(const int*)e1], p2 = spanPriorities[*(const int*)e2];
+  return (p1 < p2) - (p1 > p2);
+}
+
+bool DeferSpansOverBudget(Span *&head, double budgetUsecs)
+{
+  if (!scanlineStaleSince)
+  {
+    const int maxSpans = (gpuFrameWidth+1) / 2 * gpuFrameHeight;
+    scanlineStaleSince = (uint64_t*)Malloc(gpuFrameHeight * sizeof(uint64_t), "DeferSpansOverBudget() scanline staleness");
+    memset(scanlineStaleSince, 0, gpuFrameHeight * sizeof(uint64_t));
+    scanlineDeferred = (bool*)Malloc(gpuFrameHeight * sizeof(bool), "DeferSpansOverBudget() deferred scanlines");
+    scheduledSpans = (Span**)Malloc(maxSpans * sizeof(Span*), "DeferSpansOverBudget() spans");
+    spanPriorities = (double*)Malloc(maxSpans * sizeof(double), "DeferSpansOverBudget() span priorities");
+    spanOrder = (int*)Malloc(maxSpans * sizeof(int), "DeferSpansOverBudget() span order");
+  }
+
+  // Estimate the bus time of each span from the same cost model that span merging uses (measured in 1/8ths of the time to send a byte)
+  const double usecsPerCost = spiUsecsPerByte / 8.0;
+  double totalUsecs = 0;
+  int numSpans = 0;
+  for(Span *i = head; i; i = i->next)
+  {
+    scheduledSpans[numSpans++] = i;
+    totalUsecs += SpanCost(i->size) * usecsPerCost;
+  }
+  if (totalUsecs <= budgetUsecs || numSpans == 0)
+  {
+    memset(scanlineStaleSince, 0, gpuFrameHeight * sizeof(uint64_t)); // Everything fits, so all scanlines will be up to date
+    return false;
+  }
+
+  // Prioritize spans by how many changed pixels they update per unit of bus time, multiplied by how many frames their scanlines have
+  // been stale for, so that deferred spans win over fresh changes the longer they wait, and cannot be starved.
+  const uint64_t now = tick();
+  for(int i = 0; i < numSpans; ++i)
+  {
+    Span *s = scheduledSpans[i];
+    uint64_t staleSince = now;
+    for(int y = s->y; y < s->endY; ++y)
+      if (scanlineStaleSince[y]) staleSince = MIN(staleSince, scanlineStaleSince[y]);
+    spanPriorities[i] = (double)s->size / SpanCost(s->size) * (1.0 + (now - staleSince) * (TARGET_FRAME_RATE / 1000000.0));
+    spanOrder[i] = i;
+  }
+  qsort(spanOrder, numSpans, sizeof(int), CompareSpanPriorities);
+
+  // Pick the spans to send in priority order, until the budget runs out. Always send at least the highest priority span, so
+  // that the display makes progress even when the SPI bus is congested.
+  for(int i = 0; i < numSpans; ++i)
+  {
+    int s = spanOrder[i];
+    double usecs = SpanCost(scheduledSpans[s]->size) * usecsPerCost;
+    if (usecs <= budgetUsecs || i == 0)
+      budgetUsecs -= usecs;
+    else
+      scheduledSpans[s] = 0;
+  }
+
+  // Relink the spans to send in their original top-to-bottom order, and track the scanlines that are left stale
+  memset(scanlineDeferred, 0, gpuFrameHeight * sizeof(bool));
+  Span *prev = 0;
+  Span *i = head;
+  for(int s = 0; s < numSpans; ++s, i = i->next)
+  {
+    if (scheduledSpans[s])
+    {
+      if (prev) prev->next = i;
+      else head = i;
+      prev = i;
+    }
+    else
+      for(int y = i->y; y < i->endY; ++y)
+        scanlineDeferred[y] = true;
+  }
+  prev->next = 0;
+
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    if (!scanlineDeferred[y]) scanlineStaleSince[y] = 0;
+    else if (!scanlineStaleSince[y]) scanlineStaleSince[y] = now;
+  return true;
+}
+
+#endif
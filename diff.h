@@ -33,6 +33,47 @@ extern Span *spans;
 #define SPAN_MERGE_THRESHOLD 4
 #endif
 
+// Span merging uses an explicit cost model of the SPI bus time needed to send a span, measured in 1/8ths of the time to send a byte
+// (i.e. in SPI clocks). Starting a new span costs the same command and FIFO flush sequence as described above, but taking into account
+// the command and coordinate widths of the display:
+#if defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
+#define SPI_COMMAND_BYTES 2
+#define SPI_COORDINATE_BYTES 4
+#elif defined(DISPLAY_SET_CURSOR_IS_8_BIT)
+#define SPI_COMMAND_BYTES 1
+#define SPI_COORDINATE_BYTES 1
+#else
+#define SPI_COMMAND_BYTES 1
+#define SPI_COORDINATE_BYTES 2
+#endif
+
+#ifdef MUST_SEND_FULL_CURSOR_WINDOW
+#define SPI_SET_CURSOR_X_BYTES (SPI_COMMAND_BYTES + 1 + 2*SPI_COORDINATE_BYTES + 1)
+#else
+#define SPI_SET_CURSOR_X_BYTES (SPI_COMMAND_BYTES + 1 + SPI_COORDINATE_BYTES + 1)
+#endif
+
+#if defined(ALL_TASKS_SHOULD_DMA)
+// When all tasks go through DMA, the aim is to minimize CPU overhead by producing few large tasks, so weigh starting a new span
+// to match SPAN_MERGE_THRESHOLD.
+#define SPAN_START_COST (SPAN_MERGE_THRESHOLD * SPI_BYTESPERPIXEL * 8)
+#else
+// Wait for FIFO flush + set cursor X + data_write command + wait for FIFO flush
+#define SPAN_START_COST ((1 + SPI_SET_CURSOR_X_BYTES + SPI_COMMAND_BYTES + 1) * 8)
+#endif
+
+// DMA streams bytes back to back, but has a fixed setup cost. Polled SPI starts right away, but the CPU does not keep the FIFO
+// perfectly fed, which is modeled as costing 9 clocks per byte. The DMA setup cost is then solved from the DMA_IS_FASTER_THAN_POLLED_SPI
+// cutoff, where the two have been measured to be equally fast.
+#define SPI_POLLED_BYTE_COST 9
+#define SPI_DMA_BYTE_COST 8
+#define SPI_DMA_SETUP_COST ((SPI_POLLED_BYTE_COST - SPI_DMA_BYTE_COST) * dmaIsFasterThanPolledSpi)
+
+// The span merge threshold and span start cost that are in use: SPAN_MERGE_THRESHOLD and SPAN_START_COST, unless measured at startup
+// with CALIBRATE_SPI_BUS_AT_STARTUP
+extern int spanMergeThreshold;
+extern int spanStartCost;
+
 void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, Span *&head);
 
 void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
@@ -41,4 +82,88 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
 
 void NoDiffChangedRectangle(Span *&head);
 
+#ifdef USE_TILE_DIRTY_MAP
+// The tile dirty map divides the framebuffer to square tiles of this many pixels per side
+#define DIRTY_TILE_SIZE_SHIFT 4
+#define DIRTY_TILE_SIZE (1 << DIRTY_TILE_SIZE_SHIFT)
+
+// Hashes each tile of the new framebuffer and compares the hashes to the previous contents, and then compares pixels
+// exactly only in tiles whose hash changed. Returns the number of changed pixels, and records the dirty tiles for
+// DiffFramebuffersToScanlineSpansInDirtyTiles() to use.
+int DiffFramebuffersToTileDirtyMap(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Same as DiffFramebuffersToScanlineSpansExact(), but only looks at the tiles marked dirty by the latest DiffFramebuffersToTileDirtyMap() call.
+void DiffFramebuffersToScanlineSpansInDirtyTiles(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
+#endif
+
+#ifdef USE_SCANLINE_CHECKSUMS
+// Checksums each scanline of the new framebuffer and compares the checksums to the previous contents, and then compares pixels
+// exactly only on scanlines whose checksum changed. Returns the number of changed pixels, and records the dirty scanlines, which
+// DiffFramebuffersToScanlineSpansExact() then restricts itself to.
+int ChecksumScanlinesAndCountChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+#endif
+
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+// Marks the given rectangle of the framebuffer as damaged, i.e. possibly different from what the display currently shows.
+// DiffFramebuffersToScanlineSpansExact() only scans the damaged areas. Until any damage is added, the whole framebuffer is damaged.
+void AddDamageRect(int x, int y, int endX, int endY);
+
+// Called once the display has been brought up to date with all changes inside the damaged areas.
+void ClearDamage(void);
+
+// Returns the number of changed pixels inside the damaged areas.
+int CountNumChangedPixelsInDamage(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+#endif
+
+#ifdef PERCEPTUAL_DIFF_THRESHOLD
+// Counts the pixels that have changed perceptibly, see PERCEPTUAL_DIFF_THRESHOLD in config.h.
+int CountNumPerceptiblyChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Same as DiffFramebuffersToScanlineSpansExact(), but ignores pixel changes below PERCEPTUAL_DIFF_THRESHOLD.
+void DiffFramebuffersToScanlineSpansPerceptual(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
+
+// Scanlines [perceptualDiffRefreshY, perceptualDiffRefreshY+PERCEPTUAL_DIFF_REFRESH_SCANLINES[ are diffed exactly, to clear away
+// the small differences that perceptual diffing has left on the display. The main loop sweeps this window down the screen.
+extern int perceptualDiffRefreshY;
+#endif
+
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+// Scanlines are sampled at this interval to quickly check whether the frame could have scrolled
+#define SCROLL_DETECT_SAMPLE_INTERVAL 8
+
+// Hardware scrolling is only used if it leaves at least 1/SCROLL_DETECT_MIN_SAVED_FRACTION of the scanlines fewer to update
+#define SCROLL_DETECT_MIN_SAVED_FRACTION 8
+
+// Checks whether the contents of the new framebuffer are the previous framebuffer scrolled vertically. Returns the number of scanlines
+// the contents moved up (negative if down), if hardware scrolling the display by that amount leaves substantially less to update, or 0 otherwise.
+int DetectVerticalScroll(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Rotates the scanlines of the framebuffer up by the given amount (down if negative), to track the display contents after a hardware scroll.
+void ScrollFramebuffer(uint16_t *framebuffer, int scanlines);
+
+// The framebuffer scanline that is written to the first row of the display scroll area in display memory. Spans are not merged
+// across it, since their scanlines would not be consecutive in display memory.
+extern int scrollWrapY;
+#endif
+
 void MergeScanlineSpanList(Span *listHead);
+
+#ifdef LATEST_FRAME_WINS
+// Copies the pixels that the given span covers in the framebuffer to dst, and returns the position in dst after them. This is used to
+// keep an undo log of framebuffer[1] while a frame is submitted, so that the frame can be cancelled afterwards.
+uint16_t *SaveSpanPixels(const Span *span, const uint16_t *framebuffer, uint16_t *dst);
+
+// Writes the pixels saved with SaveSpanPixels() back to the framebuffer, and returns the position in src after them.
+const uint16_t *RestoreSpanPixels(const Span *span, uint16_t *framebuffer, const uint16_t *src);
+#endif
+
+#ifdef SCHEDULE_UPDATES_BY_DEADLINE
+// If sending all the spans in the list would take longer than the given time budget, removes the lowest priority spans from the list
+// so that the rest fit, and returns true to tell that spans were deferred to a later update. Spans are prioritized by how many pixels
+// they update per unit of bus time, and by how long their scanlines have had changes waiting.
+bool DeferSpansOverBudget(Span *&head, double budgetUsecs);
+#endif
+
+// If DIFF_THREADS > 1, starts up the pool of threads that diff the framebuffer in parallel bands.
+void InitDiffThreads(void);
+void DeinitDiffThreads(void);
@@ -37,3 +37,26 @@ void ClearScreen()
 #endif
 }
 
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+void SetVerticalScrollArea(int top, int height)
+{
+  int bottom = DISPLAY_HEIGHT - top - height;
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  QUEUE_SPI_TRANSFER(0x33/*Vertical Scrolling Definition*/, 0, (uint8_t)(top >> 8), 0, (uint8_t)(top & 0xFF), 0, (uint8_t)(height >> 8), 0, (uint8_t)(height & 0xFF), 0, (uint8_t)(bottom >> 8), 0, (uint8_t)(bottom & 0xFF));
+#else
+  QUEUE_SPI_TRANSFER(0x33/*Vertical Scrolling Definition*/, (uint8_t)(top >> 8), (uint8_t)(top & 0xFF), (uint8_t)(height >> 8), (uint8_t)(height & 0xFF), (uint8_t)(bottom >> 8), (uint8_t)(bottom & 0xFF));
+#endif
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+}
+
+void SetVerticalScrollStart(int row)
+{
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  QUEUE_SPI_TRANSFER(0x37/*Vertical Scroll Start Address*/, 0, (uint8_t)(row >> 8), 0, (uint8_t)(row & 0xFF));
+#else
+  QUEUE_SPI_TRANSFER(0x37/*Vertical Scroll Start Address*/, (uint8_t)(row >> 8), (uint8_t)(row & 0xFF));
+#endif
+  IN_SINGLE_THREADED_MODE_RUN_TASK();
+}
+#endif
+
@@ -48,6 +48,11 @@
 #undef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
 #endif
 
+#if defined(USE_HARDWARE_VERTICAL_SCROLL) && (!defined(DISPLAY_SUPPORTS_VERTICAL_SCROLL) || defined(DISPLAY_FLIP_ORIENTATION_IN_HARDWARE) || defined(DISPLAY_ROTATE_180_DEGREES))
+// The display controller scrolls along its native rows, top to bottom, so the framebuffer scanlines must map to those.
+#undef USE_HARDWARE_VERTICAL_SCROLL
+#endif
+
 #ifndef DISPLAY_NATIVE_COVERED_LEFT_SIDE
 #define DISPLAY_NATIVE_COVERED_LEFT_SIDE 0
 #endif
@@ -79,9 +84,19 @@
 #define DISPLAY_DRAWABLE_WIDTH (DISPLAY_WIDTH-DISPLAY_COVERED_LEFT_SIDE-DISPLAY_COVERED_RIGHT_SIDE)
 #define DISPLAY_DRAWABLE_HEIGHT (DISPLAY_HEIGHT-DISPLAY_COVERED_TOP_SIDE-DISPLAY_COVERED_BOTTOM_SIDE)
 
+#if defined(SPI_3WIRE_LOSSI_MODE) && (!defined(SPI_3WIRE_PROTOCOL) || (defined(SPI_3WIRE_DATA_COMMAND_FRAMING_BITS) && SPI_3WIRE_DATA_COMMAND_FRAMING_BITS != 1))
+// LoSSI mode frames each byte with a single data/command bit
+#undef SPI_3WIRE_LOSSI_MODE
+#endif
+
 #ifndef DISPLAY_SPI_DRIVE_SETTINGS
+#ifdef SPI_3WIRE_LOSSI_MODE
+// Keep the SPI0 peripheral in LoSSI mode through all writes to its CS register
+#define DISPLAY_SPI_DRIVE_SETTINGS (BCM2835_SPI0_CS_LEN)
+#else
 #define DISPLAY_SPI_DRIVE_SETTINGS (0)
 #endif
+#endif
 
 #ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
 // 18 bits per pixel padded to 3 bytes
@@ -91,10 +106,10 @@
 #define SPI_BYTESPERPIXEL 2
 #endif
 
-#if (DISPLAY_DRAWABLE_WIDTH % 16 == 0) && defined(ALL_TASKS_SHOULD_DMA) &&!defined(USE_SPI_THREAD) && defined(USE_GPU_VSYNC) && !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2) && !defined(SPI_3WIRE_PROTOCOL)
+#if (DISPLAY_DRAWABLE_WIDTH % 16 == 0) && defined(ALL_TASKS_SHOULD_DMA) &&!defined(USE_SPI_THREAD) && defined(USE_GPU_VSYNC) && !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2) && (!defined(SPI_3WIRE_PROTOCOL) || defined(SPI_3WIRE_LOSSI_MODE)) && !defined(ZERO_COPY_SPI_TASKS)
 // If conditions are suitable, defer moving pixels until the very last moment in dma.cpp when we are about
 // to kick off DMA tasks.
-// TODO: 3-wire SPI displays are not yet compatible with this path. Implement support for this to optimize performance of 3-wire SPI displays on Pi Zero. (Pi 3B does not care that much)
+// 3-wire SPI displays are only compatible with this path in LoSSI mode, since otherwise the pixels would need to be expanded to 9-bit framing after they are moved.
 #define OFFLOAD_PIXEL_COPY_TO_DMA_CPP
 #endif
 
@@ -107,6 +122,14 @@ void TurnDisplayOff(void);
 
 void DeinitSPIDisplay(void);
 
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+// Defines the display rows [top, top+height[ as the vertically scrolling area, and the rest as fixed top and bottom areas.
+void SetVerticalScrollArea(int top, int height);
+
+// Sets the display memory row that is shown at the top of the vertical scrolling area.
+void SetVerticalScrollStart(int row);
+#endif
+
 #if !defined(SPI_BUS_CLOCK_DIVISOR)
 #error Please define -DSPI_BUS_CLOCK_DIVISOR=<some even number> on the CMake command line! This parameter along with core_freq=xxx in /boot/config.txt defines the SPI display speed. (spi speed = core_freq / SPI_BUS_CLOCK_DIVISOR)
 #endif
@@ -0,0 +1,120 @@
+#include "config.h"
+#include "display_commands.h"
+#include "gpu.h"
+#include "util.h"
+
+DisplayCommand *displayCommands = 0;
+
+DisplayWindowState UnknownDisplayWindowState()
+{
+  DisplayWindowState window = { -1, -1, -1 };
+  return window;
+}
+
+// Returns the end of the X window to set up for a single line span that does not fit in the current window: wide enough for the
+// single line spans up to the next multiline span as well, and the same as that multiline span if it is wide enough for them, so
+// that it does not need to set up a window of its own. Otherwise all the way to the right edge of the frame.
+static int ChooseWindowEndX(const Span *i, int endX)
+{
+  for(const Span *j = i->next; j; j = j->next)
+  {
+    int nextEndX = displayXOffset + j->endX;
+    if (j->endY > j->y + 1) return (nextEndX >= endX) ? nextEndX : displayXOffset + gpuFrameWidth;
+    endX = MAX(endX, nextEndX);
+  }
+  return displayXOffset + gpuFrameWidth;
+}
+
+static inline DisplayCommand *AddCommand(DisplayCommand *c, uint8_t type, int start, int end, Span *span)
+{
+  c->type = type;
+  c->start = (uint16_t)start;
+  c->end = (uint16_t)end;
+  c->span = span;
+  return c + 1;
+}
+
+DisplayCommand *PlanDisplayCommands(Span *head, DisplayWindowState &window, int scrollOffset)
+{
+  DisplayCommand *c = displayCommands;
+  const int frameEndY = displayYOffset + gpuFrameHeight; // The Y window always extends to the bottom of the frame
+
+  // Where the previous write left the write cursor. Other commands may have been sent to the display in between frames, so this
+  // is only tracked within a frame.
+  int cursorX = -1, cursorY = -1;
+
+  for(Span *i = head; i; i = i->next)
+  {
+#ifdef ALIGN_TASKS_FOR_DMA_TRANSFERS
+    // DMA transfers smaller than 4 bytes are causing trouble, so in order to ensure smooth DMA operation,
+    // make sure each message is at least 4 bytes in size, hence one pixel spans are forbidden:
+    if (i->size == 1)
+    {
+      if (i->endX < gpuFrameWidth) { ++i->endX; ++i->lastScanEndX; }
+      else --i->x;
+      ++i->size;
+    }
+#endif
+    const int x = displayXOffset + i->x, endX = displayXOffset + i->endX;
+    const int y = displayYOffset + (i->y + scrollOffset) % gpuFrameHeight;
+    const bool multiline = (i->endY > i->y + 1);
+
+#if defined(DISPLAY_WRITE_PIXELS_CONTINUE) && !defined(DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR)
+    // If the previous write left the cursor where this span begins, and the span fits in the window, keep writing from there
+    // instead of setting up the cursor again, which the regular write pixels command would reset to the top left of the window.
+    if (cursorX == x && cursorY == y && (multiline ? (window.x == x && window.endX == endX) : (endX <= window.endX)))
+      c = AddCommand(c, WRITE_PIXELS_CONTINUE, 0, 0, i);
+    else
+#endif
+    {
+#ifdef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+      // Writes start from the cursor, which the set cursor and window commands move along with the window
+      int startX = cursorX, startY = cursorY;
+#else
+      // Writes start from the top left corner of the window
+      int startX = window.x, startY = window.y;
+#endif
+      if (startY != y)
+      {
+#ifdef CURSOR_MOVES_SEND_FULL_WINDOW
+        c = AddCommand(c, SET_WINDOW_Y, y, frameEndY - 1, 0);
+#else
+        c = AddCommand(c, SET_CURSOR_Y, y, 0, 0);
+#endif
+        window.y = cursorY = y;
+      }
+
+      if (multiline ? (window.endX != endX) : (window.endX < endX))
+      {
+        // Multiline spans need a window of their exact width. Single line spans only need one that extends far enough right,
+        // so pick one that the following spans can reuse.
+        int newEndX = multiline ? endX : ChooseWindowEndX(i, endX);
+        c = AddCommand(c, SET_WINDOW_X, x, newEndX - 1, 0);
+        window.x = cursorX = x;
+        window.endX = newEndX;
+      }
+      else if (startX != x || (multiline && window.x != x))
+      {
+        // The end of the window is good as it is, so only move its start
+#ifdef CURSOR_MOVES_SEND_FULL_WINDOW
+        c = AddCommand(c, SET_WINDOW_X, x, window.endX - 1, 0);
+#else
+        c = AddCommand(c, SET_CURSOR_X, x, 0, 0);
+#endif
+        window.x = cursorX = x;
+      }
+      c = AddCommand(c, WRITE_PIXELS, 0, 0, i);
+    }
+
+    // The cursor advances over the pixels of the span, wrapping from the right edge of the window to the start of the next row
+    cursorX = displayXOffset + i->lastScanEndX;
+    cursorY = y + i->endY - i->y - 1;
+    if (cursorX >= window.endX)
+    {
+      cursorX = window.x;
+      ++cursorY;
+    }
+    if (cursorY >= frameEndY) cursorX = cursorY = -1; // Wrapping past the bottom of the frame is not tracked
+  }
+  return c;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+#include "diff.h"
+
+// Before the spans of a frame are queued to the SPI thread, they are planned into a list of display commands. The planner tracks the
+// address window and the write cursor of the display controller in display coordinates, and uses what it knows about how the
+// controller advances the cursor and wraps it at the window edges to leave out set cursor and window commands that the controller
+// state already satisfies, to pick X windows that the following spans can reuse, and to continue writing pixels from where the
+// previous write left off when that is where the next span begins.
+
+#if defined(MUST_SEND_FULL_CURSOR_WINDOW) || defined(ALIGN_TASKS_FOR_DMA_TRANSFERS)
+// The display needs both the start and the end coordinate in each set cursor command, or DMA transfers need at least 4 bytes, so the
+// start of the window is moved by sending the whole window again.
+#define CURSOR_MOVES_SEND_FULL_WINDOW
+#endif
+
+enum DisplayCommandType
+{
+  SET_CURSOR_X, // Moves the start of the X window to start, keeping its end
+  SET_WINDOW_X, // Sets the X window to [start, end]
+  SET_CURSOR_Y, // Moves the start of the Y window to start, keeping its end
+  SET_WINDOW_Y, // Sets the Y window to [start, end]
+  WRITE_PIXELS, // Writes the pixels of span starting from the top left corner of the window
+  WRITE_PIXELS_CONTINUE // Writes the pixels of span starting from where the previous write left off
+};
+
+struct DisplayCommand
+{
+  Span *span;
+  uint16_t start, end; // Display coordinates of the set cursor and window commands, end is inclusive
+  uint8_t type;
+};
+
+// What the main loop knows about the address window of the display controller, in display coordinates. -1 denotes not known.
+struct DisplayWindowState
+{
+  int x, endX; // X window [x, endX[
+  int y; // Start of the Y window, which always extends to the bottom of the frame
+};
+
+// Returns the state of a display controller that nothing is known about
+DisplayWindowState UnknownDisplayWindowState(void);
+
+// Plans the commands to send the given spans to the display with, starting from and updating the given window state. scrollOffset
+// maps framebuffer scanline y to display row displayYOffset + (y + scrollOffset) % gpuFrameHeight. The list is built in displayCommands,
+// and the end of it is returned.
+DisplayCommand *PlanDisplayCommands(Span *head, DisplayWindowState &window, int scrollOffset);
+
+// Each span needs at most a Y window, an X window and a write pixels command
+extern DisplayCommand *displayCommands;
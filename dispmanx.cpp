@@ -0,0 +1,137 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef USE_DISPMANX_FRAME_SOURCE
+
+#include <bcm_host.h> // bcm_host_init, bcm_host_deinit
+#include <stdio.h> // printf
+#include <syslog.h> // syslog, LOG_ERR
+
+#include "gpu.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+bool MarkProgramQuitting(void);
+
+DISPMANX_DISPLAY_HANDLE_T display;
+DISPMANX_RESOURCE_HANDLE_T screen_resource;
+VC_RECT_T rect;
+
+void OpenFrameSource(int *width, int *height)
+{
+  // Initialize GPU frame grabbing subsystem
+  bcm_host_init();
+  display = vc_dispmanx_display_open(0);
+  if (!display) FATAL_ERROR("vc_dispmanx_display_open failed! Make sure to have hdmi_force_hotplug=1 setting in /boot/config.txt");
+  DISPMANX_MODEINFO_T display_info;
+  int ret = vc_dispmanx_display_get_info(display, &display_info);
+  if (ret) FATAL_ERROR("vc_dispmanx_display_get_info failed!");
+  *width = display_info.width;
+  *height = display_info.height;
+}
+
+#ifdef USE_GPU_VSYNC
+static void DispmanXVsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
+{
+  VsyncCallback();
+}
+#endif
+
+void SetupFrameSourceCapture()
+{
+  const int scaledWidth = gpuFrameWidth, scaledHeight = gpuFrameHeight;
+  uint32_t image_prt;
+  printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, (double)(scaledWidth + excessPixelsLeft + excessPixelsRight) / (scaledHeight + excessPixelsTop + excessPixelsBottom));
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledHeight + excessPixelsTop + excessPixelsBottom, scaledWidth + excessPixelsLeft + excessPixelsRight, &image_prt);
+  vc_dispmanx_rect_set(&rect, excessPixelsTop, excessPixelsLeft, scaledHeight, scaledWidth);
+#else
+  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, &image_prt);
+  vc_dispmanx_rect_set(&rect, excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight);
+#endif
+  if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
+  printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d, aspect ratio=%f\n", excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
+
+#ifdef USE_GPU_VSYNC
+  // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
+  // if it was, this signal is not a guaranteed edge trigger for availability of new frames.
+  vc_dispmanx_vsync_callback(display, DispmanXVsyncCallback, 0);
+#endif
+}
+
+bool CaptureFrameSource(uint16_t *destination)
+{
+  // Grab a new frame from the GPU. TODO: Figure out a way to get a frame callback for each GPU-rendered frame,
+  // that would be vastly superior for lower latency, reduced stuttering and lighter processing overhead.
+  // Currently this implemented method just takes a snapshot of the most current GPU framebuffer contents,
+  // without any concept of "finished frames". If this is the case, it's possible that this could grab the same
+  // frame twice, and then potentially missing, or displaying the later appearing new frame at a very last moment.
+  // Profiling, the following two lines take around ~1msec of time.
+  int failed = vc_dispmanx_snapshot(display, screen_resource, (DISPMANX_TRANSFORM_T)0);
+  if (failed)
+  {
+    // We cannot do much better here (or do not know what to do), it looks like if vc_dispmanx_snapshot() fails once, it will crash if attempted to be called again, and it will not recover. We can only terminate here. Sad :/
+    printf("vc_dispmanx_snapshot() failed with return code %d! If this appears related to a change in HDMI/display resolution, see https://github.com/juj/fbcp-ili9341/issues/28 and https://github.com/raspberrypi/userland/issues/461 (try setting fbcp-ili9341 up as an infinitely restarting system service to recover)\n", failed);
+    MarkProgramQuitting();
+    return false;
+  }
+  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
+  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
+  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
+  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
+  // to randomly fail and then subsequently hang if called a second time)
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  static uint16_t *tempTransposeBuffer = 0; // Allocate as static here to keep the number of #ifdefs down a bit
+  const int pixelWidth = gpuFrameHeight+excessPixelsTop+excessPixelsBottom;
+  const int pixelHeight = gpuFrameWidth + excessPixelsLeft + excessPixelsRight;
+  const int stride = RoundUpToMultipleOf(pixelWidth*sizeof(uint16_t), 32);
+  if (!tempTransposeBuffer)
+  {
+    tempTransposeBuffer = (uint16_t *)Malloc(pixelHeight * stride * 2, "dispmanx.cpp tempTransposeBuffer");
+    tempTransposeBuffer += pixelHeight * (stride>>1);
+  }
+  uint16_t *destPtr = tempTransposeBuffer - excessPixelsLeft * (stride >> 1) - excessPixelsTop;
+#else
+  uint16_t *destPtr = destination - excessPixelsTop*(gpuFramebufferScanlineStrideBytes>>1) - excessPixelsLeft;
+  const int stride = gpuFramebufferScanlineStrideBytes;
+#endif
+  failed = vc_dispmanx_resource_read_data(screen_resource, &rect, destPtr, stride);
+  if (failed)
+  {
+    printf("vc_dispmanx_resource_read_data failed with return code %d!\n", failed);
+    MarkProgramQuitting();
+    return false;
+  }
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // Transpose the snapshotted frame from landscape to portrait. The following takes around 0.5-1.0 msec
+  // of extra CPU time, so while this improves tearing to be perhaps a bit nicer visually, it probably
+  // is not good on the Pi Zero.
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      destination[y*(gpuFramebufferScanlineStrideBytes>>1)+x] = tempTransposeBuffer[x*(stride>>1)+y];
+#endif
+  return true;
+}
+
+void CloseFrameSource()
+{
+#ifdef USE_GPU_VSYNC
+  if (display) vc_dispmanx_vsync_callback(display, NULL, 0);
+#endif
+
+  if (screen_resource)
+  {
+    vc_dispmanx_resource_delete(screen_resource);
+    screen_resource = 0;
+  }
+
+  if (display)
+  {
+    vc_dispmanx_display_close(display);
+    display = 0;
+  }
+
+  bcm_host_deinit();
+}
+
+#endif
@@ -243,7 +243,7 @@ int InitDMA()
 
   dmaConstantData = AllocateUncachedGpuMemory(2*sizeof(uint32_t), "DMA constant data");
   uint32_t *constantData = (uint32_t *)dmaConstantData.virtualAddr;
-  constantData[0] = BCM2835_SPI0_CS_DMAEN; // constantData[0] is for disableTransferActive task
+  constantData[0] = BCM2835_SPI0_CS_DMAEN | SPI_LOSSI_DMA_SETTINGS; // constantData[0] is for disableTransferActive task
   constantData[1] = BCM2835_DMA_CS_ACTIVE | BCM2835_DMA_CS_END; // constantData[1] is for startDMATxChannel task
 #endif
 
@@ -483,13 +483,13 @@ static void memcpy_to_dma_and_prev_framebuffer_in_c(uint16_t *dstDma, uint16_t *
   *dstPrevFramebuffer = prevData;
 }
 
-#if defined(ALL_TASKS_SHOULD_DMA) && defined(SPI_3WIRE_PROTOCOL)
+#if defined(ALL_TASKS_SHOULD_DMA) && defined(SPI_3WIRE_PROTOCOL) && !defined(SPI_3WIRE_LOSSI_MODE)
 // Bug: there is something about the chained DMA transfer mechanism that makes write window coordinate set commands not go through properly
 // on 3-wire displays, but do not yet know what. (Remove this #error statement to debug)
-#error ALL_TASKS_SHOULD_DMA and SPI_3WIRE_PROTOCOL are currently not mutually compatible!
+#error ALL_TASKS_SHOULD_DMA and SPI_3WIRE_PROTOCOL are currently not mutually compatible, unless in SPI_3WIRE_LOSSI_MODE!
 #endif
 
-#if defined(OFFLOAD_PIXEL_COPY_TO_DMA_CPP) && defined(SPI_3WIRE_PROTOCOL)
+#if defined(OFFLOAD_PIXEL_COPY_TO_DMA_CPP) && defined(SPI_3WIRE_EXPANDS_TASKS)
 // We would have to convert 8-bit tasks to 9-bit tasks immediately after offloaded memcpy has been done below to implement this.
 #error OFFLOAD_PIXEL_COPY_TO_DMA_CPP and SPI_3WIRE_PROTOCOL are not mutually compatible!
 #endif
@@ -523,6 +523,9 @@ void SPIDMATransfer(SPITask *task)
 
   int bytesLeft = task->PayloadSize();
   int taskStartX = 0;
+#ifdef ZERO_COPY_SPI_TASKS
+  uint32_t pixelIndex = 0;
+#endif
 
   while(bytesLeft > 0)
   {
@@ -551,6 +554,11 @@ void SPIDMATransfer(SPITask *task)
         memcpy_to_dma_and_prev_framebuffer_in_c((uint16_t*)txPtr, (uint16_t**)&prevData, (uint16_t**)&data, sendSize, &taskStartX, task->width, gpuFramebufferScanlineStrideBytes);
     }
     else
+#endif
+#ifdef ZERO_COPY_SPI_TASKS
+    if (task->pixels)
+      CopyZeroCopyTaskPixels(task, (uint8_t*)txPtr, sendSize, &pixelIndex);
+    else
 #endif
     {
       memcpy(txPtr, data, sendSize);
@@ -655,9 +663,16 @@ void SPIDMATransfer(SPITask *task)
 #endif
 
   SET_GPIO(GPIO_TFT_DATA_CONTROL);
+#elif defined(SPI_3WIRE_LOSSI_MODE)
+  // In LoSSI mode the command is a 9-bit word with the data/command bit (bit 8) cleared
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  spi->fifo = 0;
+#endif
+  spi->fifo = task->cmd;
+  while(!(spi->cs & (BCM2835_SPI0_CS_DONE))) /*nop*/;
 #endif
 
-  spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+  spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS | SPI_LOSSI_DMA_SETTINGS;
 
   dmaTx->cbAddr = VIRT_TO_BUS(dmaCb, tx0);
   dmaRx->cbAddr = VIRT_TO_BUS(dmaCb, rx0);
@@ -672,7 +687,7 @@ void SPIDMATransfer(SPITask *task)
 void SPIDMATransfer(SPITask *task)
 {
   // Transition the SPI peripheral to enable the use of DMA
-  spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
+  spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS | SPI_LOSSI_DMA_SETTINGS;
   uint32_t *headerAddr = task->DmaSpiHeaderAddress();
   *headerAddr = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (task->PayloadSize() << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
 
@@ -680,6 +695,16 @@ void SPIDMATransfer(SPITask *task)
   // that pointer is shared to userland, and it is proving troublesome to make it both userland-writable as well as cache-bypassing DMA coherent.
   // Therefore these two memory areas are separate for now, and we memcpy() from SPI ring buffer to an intermediate 'dmaSourceMemory' memory area to perform
   // the DMA transfer. Is there a way to avoid this intermediate buffer? That would improve performance a bit.
+#ifdef ZERO_COPY_SPI_TASKS
+  if (task->pixels)
+  {
+    // Byteswap the pixels straight from the captured frame to the DMA source memory
+    uint32_t pixelIndex = 0;
+    memcpy(dmaSourceBuffer.virtualAddr, headerAddr, 4);
+    CopyZeroCopyTaskPixels(task, (uint8_t*)dmaSourceBuffer.virtualAddr + 4, task->PayloadSize(), &pixelIndex);
+  }
+  else
+#endif
   memcpy(dmaSourceBuffer.virtualAddr, headerAddr, task->PayloadSize() + 4);
 
   volatile DMAControlBlock *cb = (volatile DMAControlBlock *)dmaCb.virtualAddr;
@@ -0,0 +1,201 @@
+#include "config.h"
+
+#ifdef USE_EMULATED_HARDWARE
+
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog, LOG_ERR
+#include <time.h> // clock_gettime
+
+#include "emulated_hardware.h"
+#include "spi.h"
+#include "util.h"
+#include "virtual_panel.h"
+
+// Depth of the SPI0 TX FIFO in bytes
+#define EMULATED_SPI_FIFO_SIZE 16
+
+static GPIORegisterFile emulatedGpio;
+static SPIRegisterFile emulatedSpi;
+
+static uint32_t gpioLevel = 0;
+
+// The writable bits of the SPI0 CS register (TA, chip select, clock polarity and phase, ...)
+static uint32_t spiControl = 0;
+
+// While TA=1, the time in picoseconds at which the last byte in the TX FIFO has been clocked out. While TA=0, bytes are not clocked
+// out, but wait in the FIFO for the next transfer to begin.
+static uint64_t txFifoEmptyTime = 0;
+static uint32_t numBytesWaitingInTxFifo = 0;
+
+// Recorded bus traffic and timing
+static uint64_t startTime = 0;
+static uint64_t numBytesClockedOut = 0;
+static uint64_t numCommandBytesClockedOut = 0;
+static uint64_t busBusyTime = 0;
+static uint64_t numTxFifoOverflows = 0;
+static uint64_t numFramesSubmitted = 0;
+static uint64_t firstFrameTime = 0;
+static uint64_t lastFrameTime = 0;
+
+// Returns the current time in picoseconds
+static uint64_t Now()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec) * 1000ull;
+}
+
+// Returns the number of picoseconds it takes to clock out one byte with the current CDIV and DLEN register values
+static uint64_t ByteTime()
+{
+  uint64_t clockDivisor = emulatedSpi.clk ? emulatedSpi.clk : 65536; // CDIV=0 divides the core clock by 65536
+  uint64_t clocksPerByte = (emulatedSpi.dlen > 1) ? 8 : 9; // See UNLOCK_FAST_8_CLOCKS_SPI() in spi.cpp
+  if ((spiControl & BCM2835_SPI0_CS_LEN)) clocksPerByte = 9; // LoSSI mode always clocks out 9-bit words
+  return clocksPerByte * clockDivisor * 1000000000000ull / EMULATED_BCM_CORE_SPEED;
+}
+
+static uint32_t TxFifoLevel(uint64_t now)
+{
+  if (!(spiControl & BCM2835_SPI0_CS_TA)) return numBytesWaitingInTxFifo;
+  if (now >= txFifoEmptyTime) return 0;
+  uint64_t byteTime = ByteTime();
+  return (uint32_t)((txFifoEmptyTime - now + byteTime - 1) / byteTime);
+}
+
+uint32_t ReadEmulatedSPICS()
+{
+  uint32_t level = TxFifoLevel(Now());
+  uint32_t cs = spiControl;
+  if (level < EMULATED_SPI_FIFO_SIZE) cs |= BCM2835_SPI0_CS_TXD;
+  if (level == 0 && (spiControl & BCM2835_SPI0_CS_TA)) cs |= BCM2835_SPI0_CS_DONE;
+  // The RX FIFO is not emulated: the bytes clocked in from MISO are discarded, so RXD, RXR and RXF always read zero.
+  return cs;
+}
+
+void WriteEmulatedSPICS(uint32_t value)
+{
+  uint64_t now = Now();
+  uint32_t level = (value & BCM2835_SPI0_CS_CLEAR_TX) ? 0 : TxFifoLevel(now);
+  bool transferActive = (value & BCM2835_SPI0_CS_TA);
+  if (transferActive && (!(spiControl & BCM2835_SPI0_CS_TA) || (value & BCM2835_SPI0_CS_CLEAR_TX)))
+    txFifoEmptyTime = now + level * ByteTime(); // Start clocking out what was left waiting in the FIFO
+  else if (!transferActive)
+    numBytesWaitingInTxFifo = level;
+  spiControl = value & ~(BCM2835_SPI0_CS_RXF | BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_TXD | BCM2835_SPI0_CS_RXD | BCM2835_SPI0_CS_DONE | BCM2835_SPI0_CS_CLEAR);
+}
+
+uint32_t ReadEmulatedSPIFIFO()
+{
+  return 0;
+}
+
+void WriteEmulatedSPIFIFO(uint32_t value)
+{
+  uint64_t now = Now();
+  if (TxFifoLevel(now) >= EMULATED_SPI_FIFO_SIZE)
+  {
+    ++numTxFifoOverflows; // Hardware silently drops writes to a full FIFO
+    return;
+  }
+
+  uint64_t byteTime = ByteTime();
+  if ((spiControl & BCM2835_SPI0_CS_TA)) txFifoEmptyTime = MAX(now, txFifoEmptyTime) + byteTime;
+  else ++numBytesWaitingInTxFifo;
+
+  ++numBytesClockedOut;
+  busBusyTime += byteTime;
+#ifdef GPIO_TFT_DATA_CONTROL
+  bool isData = (__atomic_load_n(&gpioLevel, __ATOMIC_RELAXED) & (1 << GPIO_TFT_DATA_CONTROL));
+  if (!isData) ++numCommandBytesClockedOut;
+#else
+  bool isData = true; // 3-wire displays carry the data/command bit in the byte stream
+  if ((spiControl & BCM2835_SPI0_CS_LEN))
+  {
+    // In LoSSI mode, bit 8 of the word written to the FIFO is the data/command bit, generated in hardware
+    isData = (value & 0x100);
+    if (!isData) ++numCommandBytesClockedOut;
+  }
+#endif
+
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+  VirtualPanelReceiveByte((uint8_t)value, isData);
+#else
+  (void)isData;
+#endif
+}
+
+uint32_t ReadEmulatedGPIOLevel()
+{
+  return __atomic_load_n(&gpioLevel, __ATOMIC_RELAXED);
+}
+
+void WriteEmulatedGPIOSet(uint32_t bits)
+{
+  __atomic_fetch_or(&gpioLevel, bits, __ATOMIC_RELAXED);
+}
+
+void WriteEmulatedGPIOClear(uint32_t bits)
+{
+  __atomic_fetch_and(&gpioLevel, ~bits, __ATOMIC_RELAXED);
+}
+
+uint32_t ReadEmulatedWriteOnlyRegister()
+{
+  return 0;
+}
+
+void WriteEmulatedReadOnlyRegister(uint32_t value)
+{
+}
+
+void EmulateMailbox(void *buffer)
+{
+  uint32_t *message = (uint32_t*)buffer;
+  uint32_t messageId = message[2];
+  uint32_t *payload = message + 5;
+  switch(messageId)
+  {
+  case 0x00030002/*Get Clock Rate*/:
+  case 0x00030004/*Get Max Clock Rate*/:
+    payload[1] = (payload[0] == 0x4/*CORE*/) ? EMULATED_BCM_CORE_SPEED : 1200000000/*ARM*/;
+    break;
+  case 0x00030006/*Get Temperature*/:
+    payload[1] = 50000;
+    break;
+  default:
+    FATAL_ERROR("Unsupported VideoCore mailbox message sent to emulated hardware!");
+  }
+}
+
+void InitEmulatedHardware()
+{
+  spi = &emulatedSpi;
+  gpio = &emulatedGpio;
+  startTime = Now();
+  printf("Running on emulated BCM2835 hardware, core speed: %uhz\n", (unsigned int)EMULATED_BCM_CORE_SPEED);
+}
+
+void EmulatedHardwareFrameSubmitted()
+{
+  lastFrameTime = Now();
+  if (numFramesSubmitted++ == 0) firstFrameTime = lastFrameTime;
+}
+
+void DeinitEmulatedHardware()
+{
+  double seconds = (Now() - startTime) / 1e12;
+  printf("Emulated SPI bus: %llu bytes (%llu command bytes) clocked out in %.3f seconds, bus busy %.1f%% of the time, %llu TX FIFO overflows\n",
+    (unsigned long long)numBytesClockedOut, (unsigned long long)numCommandBytesClockedOut, seconds, seconds > 0 ? busBusyTime / 1e10 / seconds : 0.0, (unsigned long long)numTxFifoOverflows);
+  if (numFramesSubmitted > 0)
+  {
+    double frameSeconds = (lastFrameTime - firstFrameTime) / 1e12;
+    printf("Emulated SPI bus: %llu frames, %.2f fps, %.0f bytes/frame\n", (unsigned long long)numFramesSubmitted,
+      frameSeconds > 0 ? (numFramesSubmitted - 1) / frameSeconds : 0.0, (double)numBytesClockedOut / numFramesSubmitted);
+  }
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+  PrintVirtualPanelReport();
+#endif
+}
+
+#endif
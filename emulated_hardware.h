@@ -0,0 +1,59 @@
+#pragma once
+
+#include "config.h"
+
+#ifdef USE_EMULATED_HARDWARE
+
+#include <inttypes.h>
+
+// Software emulation of the BCM2835 SPI0 and GPIO peripherals and of the VideoCore mailbox, so that fbcp-ili9341 can run
+// on a host without Raspberry Pi hardware. The register files keep their layout, but the registers that have side effects
+// are replaced with objects that call into emulated_hardware.cpp on each read and write. The emulated SPI0 peripheral clocks
+// bytes out of its TX FIFO at the virtual bus speed given by EMULATED_BCM_CORE_SPEED and the CDIV and DLEN registers.
+
+uint32_t ReadEmulatedSPICS(void);
+void WriteEmulatedSPICS(uint32_t value);
+uint32_t ReadEmulatedSPIFIFO(void);
+void WriteEmulatedSPIFIFO(uint32_t value);
+uint32_t ReadEmulatedGPIOLevel(void);
+void WriteEmulatedGPIOSet(uint32_t bits);
+void WriteEmulatedGPIOClear(uint32_t bits);
+uint32_t ReadEmulatedWriteOnlyRegister(void);
+void WriteEmulatedReadOnlyRegister(uint32_t value);
+
+template<uint32_t (*Read)(void), void (*Write)(uint32_t)>
+struct EmulatedRegister
+{
+  operator uint32_t() const volatile { return Read(); }
+  uint32_t operator=(uint32_t value) volatile { Write(value); return value; }
+};
+
+typedef struct GPIORegisterFile
+{
+  uint32_t gpfsel[6], reserved0; // GPIO Function Select registers, 3 bits per pin, 10 pins in an uint32_t
+  EmulatedRegister<ReadEmulatedWriteOnlyRegister, WriteEmulatedGPIOSet> gpset[2]; uint32_t reserved1; // Only pins 0-31 are emulated, so gpset[0], gpclr[0] and gplev[0]
+  EmulatedRegister<ReadEmulatedWriteOnlyRegister, WriteEmulatedGPIOClear> gpclr[2]; uint32_t reserved2;
+  EmulatedRegister<ReadEmulatedGPIOLevel, WriteEmulatedReadOnlyRegister> gplev[2];
+} GPIORegisterFile;
+
+typedef struct SPIRegisterFile
+{
+  EmulatedRegister<ReadEmulatedSPICS, WriteEmulatedSPICS> cs; // SPI Master Control and Status register
+  EmulatedRegister<ReadEmulatedSPIFIFO, WriteEmulatedSPIFIFO> fifo; // SPI Master TX and RX FIFOs
+  uint32_t clk;  // SPI Master Clock Divider
+  uint32_t dlen; // SPI Master Number of DMA Bytes to Write
+} SPIRegisterFile;
+
+// Points the spi and gpio register file pointers to the emulated peripherals
+void InitEmulatedHardware(void);
+
+// Prints out the frame rate and SPI bus traffic that was recorded over the run
+void DeinitEmulatedHardware(void);
+
+// Called by the main loop each time it has queued up a new frame to the SPI bus, for the frame rate report
+void EmulatedHardwareFrameSubmitted(void);
+
+// Answers the VideoCore mailbox property messages that fbcp-ili9341 sends
+void EmulateMailbox(void *buffer);
+
+#endif
@@ -26,9 +26,12 @@
 #include "util.h"
 #include "mailbox.h"
 #include "diff.h"
+#include "display_commands.h"
 #include "mem_alloc.h"
 #include "keyboard.h"
 #include "low_battery.h"
+#include "frame_source.h"
+#include "virtual_panel.h"
 
 int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
 {
@@ -45,6 +48,34 @@ int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
   return changedPixels;
 }
 
+// Byteswaps pixels [x, endX[ of a scanline to the big endian order that the display expects, writing them to the task payload at data,
+// and copies the same pixels to the previous framebuffer in the same pass. Doing both at once streams each source pixel through only
+// once, rather than swapping the span to the task first and then memcpy()ing it again to the previous framebuffer (compare with
+// memcpy_to_dma_and_prev_framebuffer() in dma.cpp, which does this for the OFFLOAD_PIXEL_COPY_TO_DMA_CPP path)
+static inline uint16_t *CopyPixelsToTaskAndPrevFramebuffer(uint16_t *data, uint16_t *prevScanline, const uint16_t *scanline, int x, int endX)
+{
+  if (x < endX && (x&1))
+  {
+    prevScanline[x] = scanline[x];
+    *data++ = __builtin_bswap16(scanline[x++]);
+  }
+  for(; x + 4 <= endX; x += 4, data += 4)
+  {
+    uint32_t u0 = *(uint32_t*)(scanline+x);
+    uint32_t u1 = *(uint32_t*)(scanline+x+2);
+    *(uint32_t*)(prevScanline+x) = u0;
+    *(uint32_t*)(prevScanline+x+2) = u1;
+    *(uint32_t*)data = ((u0 & 0xFF00FF00U) >> 8) | ((u0 & 0x00FF00FFU) << 8);
+    *(uint32_t*)(data+2) = ((u1 & 0xFF00FF00U) >> 8) | ((u1 & 0x00FF00FFU) << 8);
+  }
+  for(; x < endX; ++x)
+  {
+    prevScanline[x] = scanline[x];
+    *data++ = __builtin_bswap16(scanline[x]);
+  }
+  return data;
+}
+
 uint64_t displayContentsLastChanged = 0;
 bool displayOff = false;
 
@@ -63,18 +94,6 @@ const char *SignalToString(int signal)
 void MarkProgramQuitting()
 {
   programRunning = false;
-}
-
-void ProgramInterruptHandler(int signal)
-{
-  printf("Signal %s(%d) received, quitting\n", SignalToString(signal), signal);
-  static int quitHandlerCalled = 0;
-  if (++quitHandlerCalled >= 5)
-  {
-    printf("Ctrl-C handler invoked five times, looks like fbcp-ili9341 is not gracefully quitting - performing a forcible shutdown!\n");
-    exit(1);
-  }
-  MarkProgramQuitting();
   __sync_synchronize();
   // Wake the SPI thread if it was sleeping so that it can gracefully quit
   if (spiTaskMemory)
@@ -82,6 +101,7 @@ void ProgramInterruptHandler(int signal)
     __atomic_fetch_add(&spiTaskMemory->queueHead, 1, __ATOMIC_SEQ_CST);
     __atomic_fetch_add(&spiTaskMemory->queueTail, 1, __ATOMIC_SEQ_CST);
     syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+    syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was waiting for room in the SPI task queue
   }
 
   // Wake the main thread if it was sleeping for a new frame so that it can gracefully quit
@@ -89,6 +109,18 @@ void ProgramInterruptHandler(int signal)
   syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0);
 }
 
+void ProgramInterruptHandler(int signal)
+{
+  printf("Signal %s(%d) received, quitting\n", SignalToString(signal), signal);
+  static int quitHandlerCalled = 0;
+  if (++quitHandlerCalled >= 5)
+  {
+    printf("Ctrl-C handler invoked five times, looks like fbcp-ili9341 is not gracefully quitting - performing a forcible shutdown!\n");
+    exit(1);
+  }
+  MarkProgramQuitting();
+}
+
 int main()
 {
   signal(SIGINT, ProgramInterruptHandler);
@@ -105,14 +137,20 @@ int main()
   displayOff = false;
   InitLowBatterySystem();
 
-  // Track current SPI display controller write X and Y cursors.
-  int spiX = -1;
-  int spiY = -1;
-  int spiEndX = DISPLAY_WIDTH;
+  // Track the address window of the SPI display controller.
+  DisplayWindowState displayWindow = UnknownDisplayWindowState();
 
   InitGPU();
 
-  spans = (Span*)Malloc((gpuFrameWidth * gpuFrameHeight / 2) * sizeof(Span), "main() task spans");
+  spans = (Span*)Malloc(((gpuFrameWidth+1) / 2 * gpuFrameHeight) * sizeof(Span), "main() task spans");
+  displayCommands = (DisplayCommand*)Malloc(3 * ((gpuFrameWidth+1) / 2 * gpuFrameHeight) * sizeof(DisplayCommand), "main() display commands");
+  InitDiffThreads();
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+  // Track the hardware scroll state of the display: framebuffer scanline y is stored in display memory row displayYOffset + (y + scrollOffset) % gpuFrameHeight.
+  int scrollOffset = 0;
+  SetVerticalScrollArea(displayYOffset, gpuFrameHeight);
+  SetVerticalScrollStart(displayYOffset);
+#endif
   int size = gpuFramebufferSizeBytes;
 #ifdef USE_GPU_VSYNC
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
@@ -122,8 +160,13 @@ int main()
   // to randomly fail and then subsequently hang if called a second time)
   size *= 2;
 #endif
+#ifdef ZERO_COPY_FRAME_SOURCE
+  // The first buffer is the source display memory itself, which is diffed in place.
+  uint16_t *framebuffer[2] = { MappedFrameSourcePixels(), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
+#else
   uint16_t *framebuffer[2] = { (uint16_t *)Malloc(size, "main() framebuffer0"), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
   memset(framebuffer[0], 0, size); // Doublebuffer received GPU memory contents, first buffer contains current GPU memory,
+#endif
   memset(framebuffer[1], 0, gpuFramebufferSizeBytes); // second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
 #ifdef USE_GPU_VSYNC
   // Due to the above bug. In USE_GPU_VSYNC mode, we directly snapshot to framebuffer[0], so it has to be prepared specially to work around the
@@ -133,6 +176,20 @@ int main()
 
   uint32_t curFrameEnd = spiTaskMemory->queueTail;
   uint32_t prevFrameEnd = spiTaskMemory->queueTail;
+#ifdef LATEST_FRAME_WINS
+  // The newest queued frame while it can still be cancelled, or 0, and what is needed to undo it: the spans it wrote to framebuffer[1],
+  // the pixels that they overwrote there, and the display address window from before it.
+  uint32_t frameNumber = 0, queuedFrame = 0;
+  Span *queuedFrameSpans = 0;
+  uint16_t *queuedFrameUndoPixels = (uint16_t *)Malloc(gpuFrameWidth * gpuFrameHeight * FRAMEBUFFER_BYTESPERPIXEL, "main() queued frame undo pixels");
+  DisplayWindowState queuedFrameDisplayWindow = displayWindow;
+#endif
+
+#ifdef PERCEPTUAL_DIFF_THRESHOLD
+  // The number of scanlines that the exact refresh sweep still needs to cover after the last new frame, to clear away all the small
+  // differences that perceptual diffing may have left on the display.
+  int perceptualDiffScanlinesLeftToRefresh = 0;
+#endif
 
   bool prevFrameWasInterlacedUpdate = false;
   bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
@@ -157,6 +214,19 @@ int main()
       // If THROTTLE_INTERLACING is not defined, we'll fall right through and immediately submit the rest of the remaining content on screen to attempt to minimize the visual
       // observable effect of interlacing, although at the expense of smooth animation (falling through here causes jitter)
     }
+#ifdef PERCEPTUAL_DIFF_THRESHOLD
+    else if (perceptualDiffScanlinesLeftToRefresh > 0)
+    {
+      // The refresh sweep is not yet done with the last new frame, so treat it like a pending interlaced field: keep advancing the sweep
+      // once per frame interval even if no new frames arrive, or else the small differences left on the display would stay there for good.
+      if (__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
+      {
+        timespec timeout = {};
+        timeout.tv_nsec = 1000000000 / TARGET_FRAME_RATE;
+        if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, &timeout, 0, 0); // Sleep until the next frame arrives, or the sweep is due
+      }
+    }
+#endif
     else
     {
       uint64_t waitStart = tick();
@@ -182,45 +252,32 @@ int main()
       }
     }
 
-    bool spiThreadWasWorkingHardBefore = false;
-
-    // At all times keep at most two rendered frames in the SPI task queue pending to be displayed. Only proceed to submit a new frame
-    // once the older of those has been displayed.
-    bool once = true;
-    while ((spiTaskMemory->queueTail + SPI_QUEUE_SIZE - spiTaskMemory->queueHead) % SPI_QUEUE_SIZE > (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - prevFrameEnd) % SPI_QUEUE_SIZE)
+#ifdef LATEST_FRAME_WINS
+    // If a newer frame has arrived while the newest queued frame is still waiting behind the frame that is being sent, drop the queued
+    // frame so that the newer frame gets shown one frame earlier. framebuffer[1] is rolled back to what the display shows without the
+    // dropped frame, so diffing the newer frame against it picks up whatever the dropped frame would have updated.
+    if (queuedFrame && __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) > 0 && spiTaskMemory->queueTail == curFrameEnd
+      && CancelQueuedFrame(queuedFrame, curFrameEnd))
     {
-      if (spiTaskMemory->spiBytesQueued > 10000)
-        spiThreadWasWorkingHardBefore = true; // SPI thread had too much work in queue atm (2 full frames)
-
-      // Peek at the SPI thread's workload and throttle a bit if it has got a lot of work still to do.
-      double usecsUntilSpiQueueEmpty = spiTaskMemory->spiBytesQueued*spiUsecsPerByte;
-      if (usecsUntilSpiQueueEmpty > 0)
-      {
-        uint32_t bytesInQueueBefore = spiTaskMemory->spiBytesQueued;
-        uint32_t sleepUsecs = (uint32_t)(usecsUntilSpiQueueEmpty*0.4);
-#ifdef STATISTICS
-        uint64_t t0 = tick();
-#endif
-        if (sleepUsecs > 1000) usleep(500);
-
+      const uint16_t *undoPixels = queuedFrameUndoPixels;
+      for(Span *i = queuedFrameSpans; i; i = i->next)
+        undoPixels = RestoreSpanPixels(i, framebuffer[1], undoPixels);
+      displayWindow = queuedFrameDisplayWindow;
+      curFrameEnd = prevFrameEnd; // Only the frame being sent is left in the queue, so the newer frame can be submitted right away
 #ifdef STATISTICS
-        uint64_t t1 = tick();
-        uint32_t bytesInQueueAfter = spiTaskMemory->spiBytesQueued;
-        bool starved = (spiTaskMemory->queueHead == spiTaskMemory->queueTail);
-        if (starved) spiThreadWasWorkingHardBefore = false;
-
-/*
-        if (once && starved)
-        {
-          printf("Had %u bytes in queue, asked to sleep for %u usecs, got %u usecs sleep, afterwards %u bytes in queue. (got %.2f%% work done)%s\n",
-            bytesInQueueBefore, sleepUsecs, (uint32_t)(t1 - t0), bytesInQueueAfter, (bytesInQueueBefore-bytesInQueueAfter)*100.0/bytesInQueueBefore,
-            starved ? "  SLEPT TOO LONG, SPI THREAD STARVED" : "");
-          once = false;
-        }
-*/
+      if (frameTimeHistorySize > 0) --frameTimeHistorySize;
+      if (frameSkipTimeHistorySize < FRAMERATE_HISTORY_LENGTH) frameSkipTimeHistory[frameSkipTimeHistorySize++] = tick();
 #endif
-      }
     }
+    else
+#endif
+    // At all times keep at most two rendered frames in the SPI task queue pending to be displayed. Only proceed to submit a new frame
+    // once the older of those has been displayed.
+    WaitForSPIQueueToReach(prevFrameEnd);
+#ifdef LATEST_FRAME_WINS
+    queuedFrame = 0; // The spans of the queued frame are about to be overwritten by the next diff
+    bool frameIsCancellable = true;
+#endif
 
     int expiredFrames = 0;
     uint64_t now = tick();
@@ -248,7 +305,7 @@ int main()
     if (gotNewFramebuffer)
     {
 #ifdef USE_GPU_VSYNC
-      // TODO: Hardcoded vsync interval to 60 for now. Would be better to compute yet another histogram of the vsync arrival times, if vsync is not set to 60hz.
+      // TODO: Hardcoded vsync interval to 60 for now. Would be better to track the vsync arrival times as well, if vsync is not set to 60hz.
       // N.B. copying directly to videoCoreFramebuffer[1] that may be directly accessed by the main thread, so this could
       // produce a visible tear between two adjacent frames, but since we don't have vsync anyways, currently not caring too much.
 
@@ -263,8 +320,17 @@ int main()
 #endif
 
       framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
+#elif defined(ZERO_COPY_FRAME_SOURCE)
+      frameObtainedTime = tick();
 #else
-      memcpy(framebuffer[0], videoCoreFramebuffer[1], gpuFramebufferSizeBytes);
+#ifdef FRAME_SOURCE_REPORTS_DAMAGE
+      TakeFrameSourceDamage();
+#endif
+#ifdef DIFF_CAPTURED_FRAMES_IN_PLACE
+      framebuffer[0] = TakeNewestGpuFrame();
+#else
+      memcpy(framebuffer[0], TakeNewestGpuFrame(), gpuFramebufferSizeBytes);
+#endif
 #endif
 
       PollLowBattery();
@@ -322,6 +388,28 @@ int main()
 #endif
     }
 
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+    if (gotNewFramebuffer && framebufferHasNewChangedPixels && !displayOff)
+    {
+      int scrolled = DetectVerticalScroll(framebuffer[0], framebuffer[1]);
+      if (scrolled)
+      {
+        // Scroll the display, and framebuffer[1] along with it to keep tracking what the display is showing, so that only the newly
+        // exposed scanlines and whatever else changed get diffed and sent.
+        ScrollFramebuffer(framebuffer[1], scrolled);
+        scrollOffset = (scrollOffset + scrolled + gpuFrameHeight) % gpuFrameHeight;
+        scrollWrapY = (gpuFrameHeight - scrollOffset) % gpuFrameHeight;
+        SetVerticalScrollStart(displayYOffset + scrollOffset);
+#ifdef LATEST_FRAME_WINS
+        frameIsCancellable = false; // Undoing the frame would need undoing the scroll as well
+#endif
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+        AddDamageRect(0, 0, gpuFrameWidth, gpuFrameHeight); // The damage was reported against the unscrolled framebuffer[1]
+#endif
+      }
+    }
+#endif
+
     // If too many pixels have changed on screen, drop adaptively to interlaced updating to keep up the frame rate.
     double inputDataFps = 1000000.0 / EstimateFrameRateInterval();
     double desiredTargetFps = MAX(1, MIN(inputDataFps, TARGET_FRAME_RATE));
@@ -334,7 +422,20 @@ int main()
 #endif
     const double tooMuchToUpdateUsecs = timesliceToUseForScreenUpdates / desiredTargetFps; // If updating the current and new frame takes too many frames worth of allotted time, drop to interlacing.
 
-#if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
+#ifdef USE_TILE_DIRTY_MAP
+    // Building the tile dirty map counts the changed pixels as a side product, so no separate counting pass is needed. If the same
+    // frame is diffed again below to finish an interlaced update, the old map is still good, since its dirty tiles stay dirty until rehashed.
+    int numChangedPixels = framebufferHasNewChangedPixels ? DiffFramebuffersToTileDirtyMap(framebuffer[0], framebuffer[1]) : 0;
+#elif defined(USE_SCANLINE_CHECKSUMS)
+    // Same for the scanline checksums, which are needed by the diff below even if the changed pixel count is not.
+    int numChangedPixels = framebufferHasNewChangedPixels ? ChecksumScanlinesAndCountChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+#elif defined(DIFF_ONLY_DAMAGED_AREAS) && ((!defined(NO_INTERLACING) && !defined(SCHEDULE_UPDATES_BY_DEADLINE)) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)))
+    // Pixels outside the damaged areas have not changed, so they do not need to be counted
+    int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixelsInDamage(framebuffer[0], framebuffer[1]) : 0;
+#elif defined(PERCEPTUAL_DIFF_THRESHOLD) && ((!defined(NO_INTERLACING) && !defined(SCHEDULE_UPDATES_BY_DEADLINE)) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)))
+    // Count only the perceptible changes, so that e.g. noisy video content does not needlessly drop to interlacing
+    int numChangedPixels = framebufferHasNewChangedPixels ? CountNumPerceptiblyChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+#elif (!defined(NO_INTERLACING) && !defined(SCHEDULE_UPDATES_BY_DEADLINE)) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
     int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
 #endif
 
@@ -342,6 +443,8 @@ int main()
     interlacedUpdate = false;
 #elif defined(ALWAYS_INTERLACING)
     interlacedUpdate = (numChangedPixels > 0);
+#elif defined(SCHEDULE_UPDATES_BY_DEADLINE)
+    interlacedUpdate = false; // Instead of interlacing, the spans that do not fit in the time budget are deferred below
 #else
     uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
     interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
@@ -359,27 +462,46 @@ int main()
     // Collect all spans in this image
     if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
     {
+#ifdef USE_TILE_DIRTY_MAP
+      DiffFramebuffersToScanlineSpansInDirtyTiles(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
+#elif defined(PERCEPTUAL_DIFF_THRESHOLD)
+      DiffFramebuffersToScanlineSpansPerceptual(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
+
+      // Sweep the exactly diffed scanlines down the screen. A new frame may leave small differences anywhere, so after it, the sweep
+      // needs to go once over the whole screen. (An interlaced update diffs only every second scanline of the window, so it does not count)
+      if (gotNewFramebuffer) perceptualDiffScanlinesLeftToRefresh = gpuFrameHeight;
+      if (!interlacedUpdate) perceptualDiffScanlinesLeftToRefresh = MAX(0, perceptualDiffScanlinesLeftToRefresh - PERCEPTUAL_DIFF_REFRESH_SCANLINES);
+      perceptualDiffRefreshY += PERCEPTUAL_DIFF_REFRESH_SCANLINES;
+      if (perceptualDiffRefreshY >= gpuFrameHeight) perceptualDiffRefreshY = 0;
+#else
       // If possible, utilize a faster 4-wide pixel diffing method
-#ifdef FAST_BUT_COARSE_PIXEL_DIFF
+#if defined(FAST_BUT_COARSE_PIXEL_DIFF) && !defined(USE_SCANLINE_CHECKSUMS) && !defined(DIFF_ONLY_DAMAGED_AREAS)
       if (gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
         DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
       else
 #endif
         DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head); // If disabled, or framebuffer width is not compatible, use the exact method
+#endif
     }
 
     // Merge spans together on adjacent scanlines - works only if doing a progressive update
     if (!interlacedUpdate)
       MergeScanlineSpanList(head);
+
+#ifdef SCHEDULE_UPDATES_BY_DEADLINE
+    // Send only the highest priority spans that fit in the time slice for this frame. If some were deferred, treat this like an
+    // interlaced update, so that the rest get sent on the next round even if no new frame arrives by then.
+    if (!displayOff)
+      interlacedUpdate = DeferSpansOverBudget(head, tooMuchToUpdateUsecs - spiTaskMemory->spiBytesQueued*spiUsecsPerByte);
+#endif
 #endif
 
-#ifdef USE_GPU_VSYNC
+#if defined(USE_GPU_VSYNC) || defined(ZERO_COPY_FRAME_SOURCE)
     if (head) // do we have a new frame?
     {
-      // If using vsync, this main thread is responsible for maintaining the frame histogram. If not using vsync,
-      // but instead are using a dedicated GPU thread, then that dedicated thread maintains the frame histogram,
-      // in which case this is not needed.
-      AddHistogramSample(frameObtainedTime);
+      // If using vsync, or diffing the source display memory in place, this main thread is responsible for tracking frame arrival times.
+      // Otherwise the dedicated GPU thread tracks them, in which case this is not needed.
+      AddFrameArrivalTimeSample(frameObtainedTime);
 
       // We got a new frame, so update contents of the statistics overlay as well
       if (!displayOff)
@@ -387,93 +509,80 @@ int main()
     }
 #endif
 
-    // Submit spans
-    if (!displayOff)
-    for(Span *i = head; i; i = i->next)
+#ifdef LATEST_FRAME_WINS
+    // Mark where the tasks of this frame begin in the SPI queue, so that the SPI thread can skip them if the frame gets cancelled
+    if (head && !displayOff && frameIsCancellable)
     {
-#ifdef ALIGN_TASKS_FOR_DMA_TRANSFERS
-      // DMA transfers smaller than 4 bytes are causing trouble, so in order to ensure smooth DMA operation,
-      // make sure each message is at least 4 bytes in size, hence one pixel spans are forbidden:
-      if (i->size == 1)
-      {
-        if (i->endX < DISPLAY_DRAWABLE_WIDTH) { ++i->endX; ++i->lastScanEndX; }
-        else --i->x;
-        ++i->size;
-      }
-#endif
-      // Update the write cursor if needed
-#ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
-      if (spiY != i->y)
-#endif
-      {
-#if defined(MUST_SEND_FULL_CURSOR_WINDOW) || defined(ALIGN_TASKS_FOR_DMA_TRANSFERS)
-        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y, displayYOffset + gpuFrameHeight - 1);
-#else
-        QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y);
+      if (++frameNumber == 0) frameNumber = 1;
+      QueueFrameMarker(frameNumber);
+      queuedFrame = frameNumber;
+      queuedFrameSpans = head;
+      queuedFrameDisplayWindow = displayWindow;
+    }
+    uint16_t *undoPixels = queuedFrameUndoPixels;
 #endif
-        IN_SINGLE_THREADED_MODE_RUN_TASK();
-        spiY = i->y;
-      }
 
-      if (i->endY > i->y + 1 && (spiX != i->x || spiEndX != i->endX)) // Multiline span?
-      {
-        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x, displayXOffset + i->endX - 1);
-        IN_SINGLE_THREADED_MODE_RUN_TASK();
-        spiX = i->x;
-        spiEndX = i->endX;
-      }
-      else // Singleline span
-      {
-#ifdef ALIGN_TASKS_FOR_DMA_TRANSFERS
-        if (spiX != i->x || spiEndX < i->endX)
-        {
-          QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x, displayXOffset + gpuFrameWidth - 1);
-          IN_SINGLE_THREADED_MODE_RUN_TASK();
-          spiX = i->x;
-          spiEndX = gpuFrameWidth;
-        }
+    // Plan and submit the display commands to send the spans with
+    DisplayCommand *displayCommandsEnd = displayCommands;
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+    if (!displayOff) displayCommandsEnd = PlanDisplayCommands(head, displayWindow, scrollOffset);
 #else
-        if (spiEndX < i->endX) // Need to push the X end window?
-        {
-          // We are doing a single line span and need to increase the X window. If possible,
-          // peek ahead to cater to the next multiline span update if that will be compatible.
-          int nextEndX = gpuFrameWidth;
-          for(Span *j = i->next; j; j = j->next)
-            if (j->endY > j->y+1)
-            {
-              if (j->endX >= i->endX) nextEndX = j->endX;
-              break;
-            }
-          QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x, displayXOffset + nextEndX - 1);
-          IN_SINGLE_THREADED_MODE_RUN_TASK();
-          spiX = i->x;
-          spiEndX = nextEndX;
-        }
-        else
-#ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
-        if (spiX != i->x)
+    if (!displayOff) displayCommandsEnd = PlanDisplayCommands(head, displayWindow, 0);
 #endif
+    for(DisplayCommand *c = displayCommands; c < displayCommandsEnd; ++c)
+    {
+      if (c->type != WRITE_PIXELS && c->type != WRITE_PIXELS_CONTINUE)
+      {
+        switch(c->type)
         {
-#ifdef MUST_SEND_FULL_CURSOR_WINDOW
-          QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x, displayXOffset + spiEndX - 1);
-#else
-          QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + i->x);
+#ifndef CURSOR_MOVES_SEND_FULL_WINDOW
+        case SET_CURSOR_X: QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_X, c->start); break;
+        case SET_CURSOR_Y: QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, c->start); break;
 #endif
-          IN_SINGLE_THREADED_MODE_RUN_TASK();
-          spiX = i->x;
+        case SET_WINDOW_X: QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, c->start, c->end); break;
+        case SET_WINDOW_Y: QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, c->start, c->end); break;
         }
-#endif
+        IN_SINGLE_THREADED_MODE_RUN_TASK();
+        continue;
       }
 
+      Span *i = c->span;
+#ifdef LATEST_FRAME_WINS
+      if (queuedFrame) undoPixels = SaveSpanPixels(i, framebuffer[1], undoPixels);
+#endif
       // Submit the span pixels
+#ifdef ZERO_COPY_SPI_TASKS
+      // The task references the span in the captured frame, and the SPI thread byteswaps the pixels from there when it sends the task
+      SPITask *task = AllocTask(0);
+      task->pixels = framebuffer[0] + i->y * (gpuFramebufferScanlineStrideBytes>>1) + i->x;
+      task->numPixelBytes = i->size*SPI_BYTESPERPIXEL;
+      task->width = i->endX - i->x;
+      task->strideBytes = gpuFramebufferScanlineStrideBytes;
+      task->frame = NewestGpuFrameIndex();
+      RetainGpuFrame(task->frame);
+#else
       SPITask *task = AllocTask(i->size*SPI_BYTESPERPIXEL);
+#endif
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+      task->cmd = (c->type == WRITE_PIXELS_CONTINUE) ? DISPLAY_WRITE_PIXELS_CONTINUE : DISPLAY_WRITE_PIXELS;
+#else
       task->cmd = DISPLAY_WRITE_PIXELS;
+#endif
 
       bytesTransferred += task->PayloadSize()+1;
       uint16_t *scanline = framebuffer[0] + i->y * (gpuFramebufferScanlineStrideBytes>>1);
       uint16_t *prevScanline = framebuffer[1] + i->y * (gpuFramebufferScanlineStrideBytes>>1);
 
-#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
+#ifdef ZERO_COPY_SPI_TASKS
+      // The pixels only need to be copied to the previous framebuffer
+#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
+      for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+      {
+        int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+        memcpy(prevScanline + i->x, scanline + i->x, (endX - i->x)*FRAMEBUFFER_BYTESPERPIXEL);
+      }
+#endif
+#elif defined(OFFLOAD_PIXEL_COPY_TO_DMA_CPP)
       // If running a singlethreaded build without a separate SPI thread, we can offload the whole flow of the pixel data out to the code in the dma.cpp backend,
       // which does the pixel task handoff out to DMA in inline assembly. This is done mainly to save an extra memcpy() when passing data off from GPU to SPI,
       // since in singlethreaded mode, snapshotting GPU and sending data to SPI is done sequentially in this main loop.
@@ -492,7 +601,11 @@ int main()
         // Convert from R5G6B5 to R6X2G6X2B6X2 on the fly
         while(x < endX)
         {
-          uint16_t pixel = scanline[x++];
+          uint16_t pixel = scanline[x];
+#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
+          prevScanline[x] = pixel;
+#endif
+          ++x;
           uint16_t r = (pixel >> 8) & 0xF8;
           uint16_t g = (pixel >> 3) & 0xFC;
           uint16_t b = (pixel << 3) & 0xF8;
@@ -501,7 +614,9 @@ int main()
           ((uint8_t*)data)[2] = b | (b >> 5);
           data = (uint16_t*)((uintptr_t)data + 3);
         }
-#else
+#elif !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING))
+        data = CopyPixelsToTaskAndPrevFramebuffer(data, prevScanline, scanline, x, endX);
+#else // If not diffing, no need to maintain prev frame, so only byteswap the pixels to the task.
         while(x < endX && (x&1)) *data++ = __builtin_bswap16(scanline[x++]);
         while(x < (endX&~1U))
         {
@@ -511,9 +626,6 @@ int main()
           x += 2;
         }
         while(x < endX) *data++ = __builtin_bswap16(scanline[x++]);
-#endif
-#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
-        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*FRAMEBUFFER_BYTESPERPIXEL);
 #endif
       }
 #endif
@@ -521,6 +633,13 @@ int main()
       IN_SINGLE_THREADED_MODE_RUN_TASK();
     }
 
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+    // After a progressive update, framebuffer[1] matches framebuffer[0] everywhere, so nothing is damaged until the frame source reports
+    // new changes. Interlaced or deferred updates leave changes behind, so their damage is kept until a later pass finishes sending them.
+    if (!interlacedUpdate && !displayOff)
+      ClearDamage();
+#endif
+
 #ifdef KERNEL_MODULE_CLIENT
     // Wake the kernel module up to run tasks. TODO: This might not be best placed here, we could pre-empt
     // to start running tasks already half-way during task submission above.
@@ -533,6 +652,16 @@ int main()
     {
       prevFrameEnd = curFrameEnd;
       curFrameEnd = spiTaskMemory->queueTail;
+#ifdef USE_EMULATED_HARDWARE
+      EmulatedHardwareFrameSubmitted();
+#endif
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+#ifdef LATEST_FRAME_WINS
+      // Verifying waits until the frame has been sent, so skip it while a newer frame is waiting that could cancel this one
+      if (__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
+#endif
+      VerifyVirtualPanel(framebuffer[0], framebuffer[1]);
+#endif
     }
 
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
@@ -571,6 +700,7 @@ int main()
 #endif
   }
 
+  DeinitDiffThreads();
   DeinitGPU();
   DeinitSPI();
   CloseMailbox();
@@ -0,0 +1,107 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef USE_FBDEV_FRAME_SOURCE
+
+#include <fcntl.h> // open, O_RDONLY
+#include <linux/fb.h> // fb_var_screeninfo, fb_fix_screeninfo, FBIOGET_VSCREENINFO, FBIOGET_FSCREENINFO
+#include <memory.h> // memcpy
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <sys/ioctl.h> // ioctl
+#include <sys/mman.h> // mmap, munmap
+#include <syslog.h> // syslog
+#include <unistd.h> // close
+
+#include "gpu.h"
+#include "util.h"
+
+static int fbFd = -1;
+static uint8_t *fbMemory = 0;
+static size_t fbMemorySize = 0;
+static fb_var_screeninfo fbVarInfo;
+static fb_fix_screeninfo fbFixInfo;
+
+void OpenFrameSource(int *width, int *height)
+{
+  fbFd = open(FBDEV_FRAME_SOURCE_DEVICE, O_RDONLY);
+  if (fbFd < 0) FATAL_ERROR("Failed to open framebuffer device " FBDEV_FRAME_SOURCE_DEVICE "!");
+  if (ioctl(fbFd, FBIOGET_FSCREENINFO, &fbFixInfo) < 0) FATAL_ERROR("FBIOGET_FSCREENINFO failed on " FBDEV_FRAME_SOURCE_DEVICE "!");
+  if (ioctl(fbFd, FBIOGET_VSCREENINFO, &fbVarInfo) < 0) FATAL_ERROR("FBIOGET_VSCREENINFO failed on " FBDEV_FRAME_SOURCE_DEVICE "!");
+  if (fbVarInfo.bits_per_pixel != 16 || fbVarInfo.red.offset != 11 || fbVarInfo.green.length != 6 || fbVarInfo.blue.offset != 0)
+  {
+    printf("Framebuffer device " FBDEV_FRAME_SOURCE_DEVICE " is in %u bits per pixel mode, but fbcp-ili9341 needs R5G6B5. Set framebuffer_depth=16 in /boot/config.txt, or run 'fbset -depth 16'.\n", fbVarInfo.bits_per_pixel);
+    FATAL_ERROR("Unsupported framebuffer device pixel format!");
+  }
+
+  fbMemorySize = fbFixInfo.smem_len;
+  fbMemory = (uint8_t*)mmap(NULL, fbMemorySize, PROT_READ, MAP_SHARED, fbFd, 0);
+  if (fbMemory == MAP_FAILED) FATAL_ERROR("Failed to mmap framebuffer device " FBDEV_FRAME_SOURCE_DEVICE "!");
+
+  printf("Capturing frames from " FBDEV_FRAME_SOURCE_DEVICE ": %ux%u pixels, %u bytes per scanline\n", fbVarInfo.xres, fbVarInfo.yres, fbFixInfo.line_length);
+  *width = fbVarInfo.xres;
+  *height = fbVarInfo.yres;
+}
+
+// Returns the top left pixel of the capture area in the visible part of the framebuffer device memory. (N.B. if the fbdev client
+// pans the framebuffer after startup to flip pages, the new offset is not picked up)
+static uint16_t *FrameSourcePixels()
+{
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The source display is captured transposed, so the excess pixels of the source are on the other axes
+  return (uint16_t*)(fbMemory + (fbVarInfo.yoffset + excessPixelsLeft) * fbFixInfo.line_length) + fbVarInfo.xoffset + excessPixelsTop;
+#else
+  return (uint16_t*)(fbMemory + (fbVarInfo.yoffset + excessPixelsTop) * fbFixInfo.line_length) + fbVarInfo.xoffset + excessPixelsLeft;
+#endif
+}
+
+void SetupFrameSourceCapture()
+{
+#ifdef ZERO_COPY_FRAME_SOURCE
+  // The main loop reads the framebuffer device memory in place, so scanlines are laid out as they are in the device memory.
+  gpuFramebufferScanlineStrideBytes = fbFixInfo.line_length;
+  gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * (gpuFrameHeight + excessPixelsTop + excessPixelsBottom);
+  printf("Diffing framebuffer device memory directly, without snapshotting it\n");
+#endif
+  syslog(LOG_INFO, "Capturing frames from " FBDEV_FRAME_SOURCE_DEVICE " area offset x=%d,y=%d, size w=%dxh=%d", excessPixelsLeft, excessPixelsTop, gpuFrameWidth, gpuFrameHeight);
+}
+
+#ifdef ZERO_COPY_FRAME_SOURCE
+uint16_t *MappedFrameSourcePixels()
+{
+  return FrameSourcePixels();
+}
+#endif
+
+bool CaptureFrameSource(uint16_t *destination)
+{
+  const uint16_t *source = FrameSourcePixels();
+  const int sourceStride = fbFixInfo.line_length >> 1;
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // Transpose the source frame from landscape to portrait.
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      destination[y*stride+x] = source[x*sourceStride+y];
+#else
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    memcpy(destination + y*stride, source + y*sourceStride, gpuFrameWidth*FRAMEBUFFER_BYTESPERPIXEL);
+#endif
+  return true;
+}
+
+void CloseFrameSource()
+{
+  if (fbMemory)
+  {
+    munmap(fbMemory, fbMemorySize);
+    fbMemory = 0;
+  }
+  if (fbFd >= 0)
+  {
+    close(fbFd);
+    fbFd = -1;
+  }
+}
+
+#endif
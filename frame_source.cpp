@@ -0,0 +1,121 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef FRAME_SOURCE_REPORTS_DAMAGE
+
+#include <limits.h> // INT_MAX
+#include <pthread.h> // pthread_mutex_t
+#include <stdio.h> // fprintf
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog
+
+#include "gpu.h"
+#include "diff.h"
+#include "util.h"
+
+static DamageList capturedDamage; // Areas converted by captures that have not been published yet, only accessed by the GPU polling thread.
+static DamageList frameDamage; // Areas of published frames since the main thread last took the damage, guarded by frameDamageLock.
+static pthread_mutex_t frameDamageLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The areas that have changed since the last capture into each framebuffer, only accessed by the GPU polling thread. The main loop
+// can also capture straight into its own framebuffer, hence one more than the number of captured framebuffers.
+#define MAX_CAPTURE_DESTINATIONS (NUM_CAPTURED_FRAMEBUFFERS+1)
+struct CaptureDestination
+{
+  const uint16_t *framebuffer;
+  DamageList damage;
+};
+static CaptureDestination captureDestinations[MAX_CAPTURE_DESTINATIONS];
+static int numCaptureDestinations = 0;
+static DamageList damageToConvert;
+
+void AddToDamageList(DamageList &list, int x, int y, int endX, int endY)
+{
+  if (x >= endX || y >= endY) return;
+  if (list.numRects == MAX_DAMAGE_RECTS)
+  {
+    for(int i = 0; i < list.numRects; ++i)
+    {
+      x = MIN(x, list.rects[i].x);
+      y = MIN(y, list.rects[i].y);
+      endX = MAX(endX, list.rects[i].endX);
+      endY = MAX(endY, list.rects[i].endY);
+    }
+    list.numRects = 0;
+  }
+  DamageRect &rect = list.rects[list.numRects++];
+  rect.x = x;
+  rect.y = y;
+  rect.endX = endX;
+  rect.endY = endY;
+}
+
+bool SourceRectToFramebufferRect(const DamageRect &rect, int *x, int *y, int *endX, int *endY)
+{
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The source display is captured transposed, so the excess pixels of the source are on the other axes
+  *x = MAX(0, rect.y - excessPixelsLeft);
+  *y = MAX(0, rect.x - excessPixelsTop);
+  *endX = MIN(gpuFrameWidth, rect.endY - excessPixelsLeft);
+  *endY = MIN(gpuFrameHeight, rect.endX - excessPixelsTop);
+#else
+  *x = MAX(0, rect.x - excessPixelsLeft);
+  *y = MAX(0, rect.y - excessPixelsTop);
+  *endX = MIN(gpuFrameWidth, rect.endX - excessPixelsLeft);
+  *endY = MIN(gpuFrameHeight, rect.endY - excessPixelsTop);
+#endif
+  return *x < *endX && *y < *endY;
+}
+
+void AddCapturedDamage(const DamageRect &rect)
+{
+  AddToDamageList(capturedDamage, rect.x, rect.y, rect.endX, rect.endY);
+}
+
+const DamageList &DamageSinceLastCaptureInto(const uint16_t *destination, const DamageList &damage)
+{
+  int dst = 0;
+  while(dst < numCaptureDestinations && captureDestinations[dst].framebuffer != destination) ++dst;
+  if (dst == numCaptureDestinations)
+  {
+    if (numCaptureDestinations == MAX_CAPTURE_DESTINATIONS) FATAL_ERROR("Captured frames into more framebuffers than expected!");
+    ++numCaptureDestinations;
+    captureDestinations[dst].framebuffer = destination;
+    captureDestinations[dst].damage.numRects = 0;
+    AddToDamageList(captureDestinations[dst].damage, 0, 0, INT_MAX, INT_MAX);
+  }
+
+  for(int i = 0; i < numCaptureDestinations; ++i)
+    for(int j = 0; j < damage.numRects; ++j)
+      AddToDamageList(captureDestinations[i].damage, damage.rects[j].x, damage.rects[j].y, damage.rects[j].endX, damage.rects[j].endY);
+
+  damageToConvert = captureDestinations[dst].damage;
+  captureDestinations[dst].damage.numRects = 0;
+  return damageToConvert;
+}
+
+void PublishFrameSourceDamage()
+{
+  pthread_mutex_lock(&frameDamageLock);
+  for(int i = 0; i < capturedDamage.numRects; ++i)
+    AddToDamageList(frameDamage, capturedDamage.rects[i].x, capturedDamage.rects[i].y, capturedDamage.rects[i].endX, capturedDamage.rects[i].endY);
+  pthread_mutex_unlock(&frameDamageLock);
+  capturedDamage.numRects = 0;
+}
+
+void TakeFrameSourceDamage()
+{
+  pthread_mutex_lock(&frameDamageLock);
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+  for(int i = 0; i < frameDamage.numRects; ++i)
+  {
+    int x, y, endX, endY;
+    if (SourceRectToFramebufferRect(frameDamage.rects[i], &x, &y, &endX, &endY))
+      AddDamageRect(x, y, endX, endY);
+  }
+#endif
+  frameDamage.numRects = 0;
+  pthread_mutex_unlock(&frameDamageLock);
+}
+
+#endif // ~FRAME_SOURCE_REPORTS_DAMAGE
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+
+// The frame source provides the source display contents that are mirrored to the SPI display. gpu.cpp drives one of the following
+// backends, chosen at build time:
+// - USE_DISPMANX_FRAME_SOURCE (default): frames are snapshot from the VideoCore GPU with the DispmanX API, see dispmanx.cpp.
+// - USE_FBDEV_FRAME_SOURCE: frames are read from a memory mapped Linux framebuffer device, see fbdev.cpp.
+// - USE_X11_FRAME_SOURCE: frames are captured from an X server with MIT-SHM when XDamage reports changes, see x11.cpp.
+// - USE_MEMFD_FRAME_SOURCE: frames are received from a local client application that shares its framebuffer as a memfd, see memfd.cpp.
+// - USE_TRACE_FRAME_SOURCE: frames are replayed from a recorded frame trace, see trace_replay.cpp.
+
+#ifdef USE_FBDEV_FRAME_SOURCE
+// A Linux framebuffer device has no scaler, so the source display is shown pixel for pixel, cropped if it is larger than the SPI display.
+#define FRAME_SOURCE_CANNOT_SCALE
+
+#if !defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && !defined(STATISTICS) && !defined(LOW_BATTERY_PIN) && !defined(RECORD_FRAME_TRACE)
+// The main loop diffs the mapped framebuffer device memory directly, without snapshotting it to a copy first. Transposing the source,
+// drawing the statistics overlay or the low battery icon on top of it, or recording the snapshots to a frame trace need the copy.
+#define ZERO_COPY_FRAME_SOURCE
+#endif
+#endif
+
+#if !defined(ZERO_COPY_FRAME_SOURCE) && !defined(USE_GPU_VSYNC) && !defined(STATISTICS) && !defined(LOW_BATTERY_PIN)
+// The main loop diffs the newest captured frame in place in the triple buffer that the GPU polling thread captures to. Drawing the
+// statistics overlay or the low battery icon on top of the frame needs a copy of it, since the polling thread compares new snapshots against it.
+#define DIFF_CAPTURED_FRAMES_IN_PLACE
+#endif
+
+#if defined(ZERO_COPY_SPI_TASKS) && !defined(DIFF_CAPTURED_FRAMES_IN_PLACE)
+#error ZERO_COPY_SPI_TASKS streams pixels from the captured frames that the main loop diffs in place. Build with -DSTATISTICS=0 and without LOW_BATTERY_PIN, USE_GPU_VSYNC or a frame source that is diffed in place!
+#endif
+
+#if defined(USE_X11_FRAME_SOURCE) || defined(USE_MEMFD_FRAME_SOURCE) || defined(USE_TRACE_FRAME_SOURCE)
+// The root window, the client framebuffer or the recorded frames are used as is, so like the framebuffer device, they are cropped and not scaled.
+#define FRAME_SOURCE_CANNOT_SCALE
+#endif
+
+// Opens the frame source, and returns the size of the source display in pixels.
+void OpenFrameSource(int *width, int *height);
+
+// Called by InitGPU() after it has computed the area of the source display to capture (gpuFrameWidth, gpuFrameHeight and the
+// excessPixels* globals). The frame source may adjust gpuFramebufferScanlineStrideBytes and gpuFramebufferSizeBytes to match its memory layout.
+void SetupFrameSourceCapture(void);
+
+// Captures the current contents of the source display to the given framebuffer. Returns false if capturing failed.
+bool CaptureFrameSource(uint16_t *destination);
+
+#ifdef ZERO_COPY_FRAME_SOURCE
+// Returns a pointer to the top left pixel of the capture area in the mapped source display memory.
+uint16_t *MappedFrameSourcePixels(void);
+#endif
+
+void CloseFrameSource(void);
+
+#ifdef FRAME_SOURCE_REPORTS_DAMAGE
+// Blocks until the source display has changed since the last capture, or until a timeout of about a hundred milliseconds passes,
+// so that the caller can check whether the program is quitting. Returns true if there is something new to capture.
+bool WaitForFrameSourceDamage(void);
+
+// Called by the GPU polling thread after it has published the captured frame for the main thread to take with TakeNewestGpuFrame().
+void PublishFrameSourceDamage(void);
+
+// Called by the main thread before it takes a new frame, passes the damaged areas of the frames published since the last call on
+// to the diff. Taking the damage before the frame ensures that the damage never belongs to a newer frame than the one taken.
+void TakeFrameSourceDamage(void);
+
+// The following are shared by the frame sources that report damage, see frame_source.cpp.
+
+// A rectangle [x, endX[ * [y, endY[ in source display coordinates.
+struct DamageRect
+{
+  int x, y, endX, endY;
+};
+
+// If more rectangles are added to a DamageList than fit, they are collapsed to their bounding box, which is a good enough
+// approximation when that much of the screen is changing.
+#define MAX_DAMAGE_RECTS 64
+struct DamageList
+{
+  DamageRect rects[MAX_DAMAGE_RECTS];
+  int numRects;
+};
+
+void AddToDamageList(DamageList &list, int x, int y, int endX, int endY);
+
+// Converts a rectangle of the source display to the area of the framebuffer that it covers, taking the cropping and the software
+// orientation flip into account. Returns false if the rectangle is outside the captured area.
+bool SourceRectToFramebufferRect(const DamageRect &rect, int *x, int *y, int *endX, int *endY);
+
+// Called by CaptureFrameSource() for each area of the source display that it captured, to be published after the frame.
+void AddCapturedDamage(const DamageRect &rect);
+
+// Frames are captured into several framebuffers in turn (see TakeNewestGpuFrame() in gpu.cpp), so a framebuffer that is captured into
+// again last saw the source display several captures ago. Called by CaptureFrameSource() with the areas that have changed since the
+// previous capture, returns the areas that have changed since the previous capture into the given framebuffer, which are the areas
+// to convert. A framebuffer that has not been captured into before is converted as a whole.
+const DamageList &DamageSinceLastCaptureInto(const uint16_t *destination, const DamageList &damage);
+#endif
+
+#ifdef USE_GPU_VSYNC
+// Called by the frame source on each vsync of the source display.
+void VsyncCallback(void);
+#endif
@@ -1,6 +1,8 @@
-#include <bcm_host.h> // bcm_host_init, bcm_host_deinit
-
 #include <linux/futex.h> // FUTEX_WAKE
+#include <memory.h> // memcpy, memset
+#include <pthread.h> // pthread_create, pthread_join, pthread_exit
+#include <stdlib.h> // exit
+#include <unistd.h> // usleep
 #include <sys/syscall.h> // SYS_futex
 #include <syslog.h> // syslog, LOG_ERR
 #include <stdio.h> // fprintf
@@ -13,8 +15,9 @@
 #include "util.h"
 #include "statistics.h"
 #include "mem_alloc.h"
-
-bool MarkProgramQuitting(void);
+#include "frame_source.h"
+#include "trace.h"
+#include "spi.h"
 
 // Uncomment these build options to make the display output a random performance test pattern instead of the actual
 // display content. Used to debug/measure performance.
@@ -24,17 +27,38 @@ bool MarkProgramQuitting(void);
 
 #define RANDOM_TEST_PATTERN_FRAME_RATE 120
 
-DISPMANX_DISPLAY_HANDLE_T display;
-DISPMANX_RESOURCE_HANDLE_T screen_resource;
-VC_RECT_T rect;
-
 int frameTimeHistorySize = 0;
 
 FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
 
-uint16_t *videoCoreFramebuffer[2] = {};
+// The GPU polling thread snapshots frames to its back buffer, and publishes each new frame by exchanging the back buffer with
+// the middle buffer. The main thread takes the newest published frame by exchanging its front buffer with the middle buffer.
+// Only buffer indices change hands, so frames are never copied on the way, and neither thread waits for the other.
+uint16_t *videoCoreFramebuffer[NUM_CAPTURED_FRAMEBUFFERS] = {};
 volatile int numNewGpuFrames = 0;
 
+extern volatile bool programRunning;
+
+// Set in middleFramebuffer if it holds a frame that the main thread has not yet taken
+#define FRAMEBUFFER_IS_NEW 0x8
+
+static volatile uint32_t middleFramebuffer = 1;
+static int backFramebuffer = 0; // Owned by the GPU polling thread
+static int frontFramebuffer = 2; // Owned by the main thread
+
+// The most recently published frame, which new snapshots are compared against. It stays either in the middle or the front buffer
+// until the next frame is published, and neither thread writes to those, so the polling thread can keep reading it.
+static int lastPublishedFramebuffer = 2;
+
+#ifdef ZERO_COPY_SPI_TASKS
+// The number of queued SPI tasks that send pixels from each captured frame
+static volatile uint32_t gpuFrameReferences[NUM_CAPTURED_FRAMEBUFFERS] = {};
+
+// Bitmask of the buffers that the main thread owns: the front buffer, and the earlier front buffers that SPI tasks may still be
+// sending from. When the main thread takes a new frame, it hands one of the latter that is no longer referenced to the polling thread.
+static uint32_t mainThreadFramebuffers = ((1 << NUM_CAPTURED_FRAMEBUFFERS) - 1) & ~((1 << 0) | (1 << 1));
+#endif
+
 int displayXOffset = 0;
 int displayYOffset = 0;
 int gpuFrameWidth = 0;
@@ -42,20 +66,15 @@ int gpuFrameHeight = 0;
 int gpuFramebufferScanlineStrideBytes = 0;
 int gpuFramebufferSizeBytes = 0;
 
+#ifdef RECORD_FRAME_TRACE
+static FrameTraceWriter traceWriter;
+#endif
+
 int excessPixelsLeft = 0;
 int excessPixelsRight = 0;
 int excessPixelsTop = 0;
 int excessPixelsBottom = 0;
 
-// If one first runs content that updates at e.g. 24fps, a video perhaps, the frame rate histogram will lock to that update
-// rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
-// launcher menu, there needs to be some mechanism that detects that update rate has now increased, and synchronizes to the
-// new update rate. If snapshots keep occurring at fixed 24fps, the increase in content update rate would go unnoticed.
-// Therefore maintain a "linear increases/geometric slowdowns" style of factor that pulls the frame snapshotting mechanism
-// to drive itself at faster rates, poking snapshots to be performed more often to discover if the content update rate is
-// more than what is currently expected.
-int eagerFastTrackToSnapshottingFramesEarlierFactor = 0;
-
 uint64_t lastFramePollTime = 0;
 
 pthread_t gpuPollingThread;
@@ -65,15 +84,103 @@ int RoundUpToMultipleOf(int val, int multiple)
   return ((val + multiple - 1) / multiple) * multiple;
 }
 
+// Before comparing whole frames, IsNewFramebuffer() first probes this many pixels spread pseudo-randomly over the frame, and then
+// the scanline where it last found a change. Content that changes either covers much of the frame, e.g. video and scrolling, or
+// keeps changing in the same place, e.g. a blinking cursor or a clock, so when a new frame has arrived, the probes usually find it
+// without reading through the frame up to the first changed pixel.
+#define NUM_NEW_FRAME_PROBE_PIXELS 256
+
+static uint32_t newFrameProbeOffsets[NUM_NEW_FRAME_PROBE_PIXELS];
+static int lastChangedScanline = 0;
+
+static void InitNewFrameProbes()
+{
+  uint32_t rng = 0x9E3779B9u;
+  for(int i = 0; i < NUM_NEW_FRAME_PROBE_PIXELS; ++i)
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    newFrameProbeOffsets[i] = rng % (gpuFramebufferSizeBytes / FRAMEBUFFER_BYTESPERPIXEL);
+  }
+}
+
 // Tests if the pixels on the given new captured frame actually contain new image data from the previous frame
 bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer)
 {
-  for(uint32_t *newfb = (uint32_t*)possiblyNewFramebuffer, *oldfb = (uint32_t*)oldFramebuffer, *endfb = (uint32_t*)oldFramebuffer + gpuFramebufferSizeBytes/4; oldfb < endfb;)
-    if (*newfb++ != *oldfb++)
+  // A change in any of the probes proves that the frame is new, but if none changed, only comparing the whole frame can tell.
+  for(int i = 0; i < NUM_NEW_FRAME_PROBE_PIXELS; ++i)
+    if (possiblyNewFramebuffer[newFrameProbeOffsets[i]] != oldFramebuffer[newFrameProbeOffsets[i]])
+      return true;
+
+  const int stride = gpuFramebufferScanlineStrideBytes;
+  const int numScanlines = gpuFramebufferSizeBytes / stride;
+  uint8_t *newfb = (uint8_t*)possiblyNewFramebuffer, *oldfb = (uint8_t*)oldFramebuffer;
+  if (memcmp(newfb + lastChangedScanline*stride, oldfb + lastChangedScanline*stride, stride))
+    return true;
+
+  // The C library memcmp() compares several words per iteration, which beats a loop over single 32-bit words
+  for(int y = 0; y < numScanlines; ++y, newfb += stride, oldfb += stride)
+    if (memcmp(newfb, oldfb, stride))
+    {
+      lastChangedScanline = y;
       return true;
+    }
   return false;
 }
 
+#ifdef ZERO_COPY_SPI_TASKS
+// Returns a buffer that the main thread owns besides the front buffer, and that no queued SPI task sends from anymore. If the SPI
+// thread is still sending from all of them, waits for it to finish the queue.
+static int FindUnreferencedGpuFrame()
+{
+  for(;;)
+  {
+    int spareFramebuffer = 0;
+    for(int i = 0; i < NUM_CAPTURED_FRAMEBUFFERS; ++i)
+      if (i != frontFramebuffer && (mainThreadFramebuffers & (1 << i)))
+      {
+        spareFramebuffer = i;
+        if (__atomic_load_n(&gpuFrameReferences[i], __ATOMIC_ACQUIRE) == 0)
+          return i;
+      }
+    if (!programRunning) return spareFramebuffer; // The rest of the SPI queue is dropped when quitting
+    WaitForSPIQueueToReach(spiTaskMemory->queueTail);
+  }
+}
+
+int NewestGpuFrameIndex()
+{
+  return frontFramebuffer;
+}
+
+void RetainGpuFrame(int frame)
+{
+  __atomic_fetch_add(&gpuFrameReferences[frame], 1, __ATOMIC_RELAXED);
+}
+
+void ReleaseGpuFrame(int frame)
+{
+  __atomic_fetch_sub(&gpuFrameReferences[frame], 1, __ATOMIC_RELEASE);
+}
+#endif
+
+uint16_t *TakeNewestGpuFrame()
+{
+  if ((__atomic_load_n(&middleFramebuffer, __ATOMIC_ACQUIRE) & FRAMEBUFFER_IS_NEW))
+  {
+#ifdef ZERO_COPY_SPI_TASKS
+    // The old front buffer stays with the main thread until the SPI tasks that send from it are done
+    int freeFramebuffer = FindUnreferencedGpuFrame();
+    frontFramebuffer = __atomic_exchange_n(&middleFramebuffer, freeFramebuffer, __ATOMIC_ACQ_REL) & ~FRAMEBUFFER_IS_NEW;
+    mainThreadFramebuffers = (mainThreadFramebuffers & ~(1 << freeFramebuffer)) | (1 << frontFramebuffer);
+#else
+    frontFramebuffer = __atomic_exchange_n(&middleFramebuffer, frontFramebuffer, __ATOMIC_ACQ_REL) & ~FRAMEBUFFER_IS_NEW;
+#endif
+  }
+  return videoCoreFramebuffer[frontFramebuffer];
+}
+
 bool SnapshotFramebuffer(uint16_t *destination)
 {
   lastFramePollTime = tick();
@@ -114,63 +221,17 @@ bool SnapshotFramebuffer(uint16_t *destination)
   }
   barY = (barY + 1) % gpuFrameHeight;
 #else
-  // Grab a new frame from the GPU. TODO: Figure out a way to get a frame callback for each GPU-rendered frame,
-  // that would be vastly superior for lower latency, reduced stuttering and lighter processing overhead.
-  // Currently this implemented method just takes a snapshot of the most current GPU framebuffer contents,
-  // without any concept of "finished frames". If this is the case, it's possible that this could grab the same
-  // frame twice, and then potentially missing, or displaying the later appearing new frame at a very last moment.
-  // Profiling, the following two lines take around ~1msec of time.
-  int failed = vc_dispmanx_snapshot(display, screen_resource, (DISPMANX_TRANSFORM_T)0);
-  if (failed)
-  {
-    // We cannot do much better here (or do not know what to do), it looks like if vc_dispmanx_snapshot() fails once, it will crash if attempted to be called again, and it will not recover. We can only terminate here. Sad :/
-    printf("vc_dispmanx_snapshot() failed with return code %d! If this appears related to a change in HDMI/display resolution, see https://github.com/juj/fbcp-ili9341/issues/28 and https://github.com/raspberrypi/userland/issues/461 (try setting fbcp-ili9341 up as an infinitely restarting system service to recover)\n", failed);
-    MarkProgramQuitting();
-    return false;
-  }
-  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
-  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
-  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
-  // to randomly fail and then subsequently hang if called a second time)
-#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  static uint16_t *tempTransposeBuffer = 0; // Allocate as static here to keep the number of #ifdefs down a bit
-  const int pixelWidth = gpuFrameHeight+excessPixelsTop+excessPixelsBottom;
-  const int pixelHeight = gpuFrameWidth + excessPixelsLeft + excessPixelsRight;
-  const int stride = RoundUpToMultipleOf(pixelWidth*sizeof(uint16_t), 32);
-  if (!tempTransposeBuffer)
-  {
-    tempTransposeBuffer = (uint16_t *)Malloc(pixelHeight * stride * 2, "gpu.cpp tempTransposeBuffer");
-    tempTransposeBuffer += pixelHeight * (stride>>1);
-  }
-  uint16_t *destPtr = tempTransposeBuffer - excessPixelsLeft * (stride >> 1) - excessPixelsTop;
-#else
-  uint16_t *destPtr = destination - excessPixelsTop*(gpuFramebufferScanlineStrideBytes>>1) - excessPixelsLeft;
-  const int stride = gpuFramebufferScanlineStrideBytes;
-#endif
-  failed = vc_dispmanx_resource_read_data(screen_resource, &rect, destPtr, stride);
-  if (failed)
-  {
-    printf("vc_dispmanx_resource_read_data failed with return code %d!\n", failed);
-    MarkProgramQuitting();
-    return false;
-  }
-#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  // Transpose the snapshotted frame from landscape to portrait. The following takes around 0.5-1.0 msec
-  // of extra CPU time, so while this improves tearing to be perhaps a bit nicer visually, it probably
-  // is not good on the Pi Zero.
-  for(int y = 0; y < gpuFrameHeight; ++y)
-    for(int x = 0; x < gpuFrameWidth; ++x)
-      destination[y*(gpuFramebufferScanlineStrideBytes>>1)+x] = tempTransposeBuffer[x*(stride>>1)+y];
+  if (!CaptureFrameSource(destination)) return false;
 #endif
-
+#ifdef RECORD_FRAME_TRACE
+  WriteTraceFrame(traceWriter, destination, gpuFramebufferScanlineStrideBytes, lastFramePollTime);
 #endif
   return true;
 }
 
 #ifdef USE_GPU_VSYNC
 
-void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
+void VsyncCallback()
 {
   // If TARGET_FRAME_RATE is e.g. 30 or 20, decimate only every second or third vsync callback to be processed.
   static int frameSkipCounter = 0;
@@ -184,11 +245,19 @@ void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
 
 #else // !USE_GPU_VSYNC
 
-extern volatile bool programRunning;
-
 void *gpu_polling_thread(void*)
 {
   uint64_t lastNewFrameReceivedTime = tick();
+
+  // If one first runs content that updates at e.g. 24fps, a video perhaps, the frame arrival predictor locks to that update
+  // rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
+  // launcher menu, the frames are only ever looked at 24 times a second, so each of them seems to arrive right on time, and
+  // the increase in content update rate would go unnoticed. Therefore whenever a few frames in a row were already there at the
+  // first snapshot after sleeping, probe once in the middle of the predicted interval to see if frames are arriving faster. If
+  // the probe finds nothing, back off geometrically before probing again, so that content running at the predicted rate costs
+  // only very few extra snapshots.
+  int numFramesFoundOnFirstSnapshot = 0;
+  int framesFoundOnFirstSnapshotBeforeProbing = 2;
   while(programRunning)
   {
 #ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
@@ -199,24 +268,59 @@ void *gpu_polling_thread(void*)
       usleep(earliestNextFrameArrivaltime - now);
 #endif
 
-#if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
+#ifdef FRAME_SOURCE_REPORTS_DAMAGE
+    // The frame source tells when the source display changes, so there is no need to predict frame arrival times, or to poll and
+    // compare snapshots to find out whether a new frame has arrived.
+    if (!WaitForFrameSourceDamage())
+      continue;
+#elif defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
     uint64_t nextFrameArrivalTime = PredictNextFrameArrivalTime();
+    bool probing = numFramesFoundOnFirstSnapshot >= framesFoundOnFirstSnapshotBeforeProbing && nextFrameArrivalTime > lastNewFrameReceivedTime;
+    if (probing)
+      nextFrameArrivalTime = lastNewFrameReceivedTime + (nextFrameArrivalTime - lastNewFrameReceivedTime) / 2;
     int64_t timeToSleep = nextFrameArrivalTime - tick();
     const int64_t minimumSleepTime = 150; // Don't sleep if the next frame is expected to arrive in less than this much time
-    if (timeToSleep > minimumSleepTime)
+    bool slept = timeToSleep > minimumSleepTime;
+    if (slept)
       usleep(timeToSleep - minimumSleepTime);
 #endif
 
+#ifdef ZERO_COPY_FRAME_SOURCE
+    // The main thread diffs the mapped source display memory directly, so there is no snapshot to take here to find out whether
+    // a new frame has arrived. Instead wake the main thread up once per frame interval, and let the diff tell what has changed.
+    const uint64_t frameInterval = 1000000/TARGET_FRAME_RATE;
+    uint64_t pollTime = tick();
+    if (lastFramePollTime + frameInterval > pollTime)
+      usleep(lastFramePollTime + frameInterval - pollTime);
+    lastFramePollTime = tick();
+    __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
+    continue;
+#endif
+
     uint64_t t0 = tick();
 
-    bool gotNewFramebuffer = SnapshotFramebuffer(videoCoreFramebuffer[0]);
+    bool gotNewFramebuffer = SnapshotFramebuffer(videoCoreFramebuffer[backFramebuffer]);
+#ifndef FRAME_SOURCE_REPORTS_DAMAGE
     // Check the pixel contents of the snapshot to see if we actually received a new frame to render
-    gotNewFramebuffer = gotNewFramebuffer && IsNewFramebuffer(videoCoreFramebuffer[0], videoCoreFramebuffer[1]);
+    gotNewFramebuffer = gotNewFramebuffer && IsNewFramebuffer(videoCoreFramebuffer[backFramebuffer], videoCoreFramebuffer[lastPublishedFramebuffer]);
+#endif
     if (gotNewFramebuffer)
     {
       lastNewFrameReceivedTime = t0;
-      AddHistogramSample(lastNewFrameReceivedTime);
+      AddFrameArrivalTimeSample(lastNewFrameReceivedTime);
+    }
+
+#if !defined(FRAME_SOURCE_REPORTS_DAMAGE) && (defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE))
+    if (probing)
+    {
+      // A frame found by a probe comes in well ahead of its predicted time, which makes the predictor relock to the faster rate.
+      numFramesFoundOnFirstSnapshot = 0;
+      framesFoundOnFirstSnapshotBeforeProbing = gotNewFramebuffer ? 2 : MIN(framesFoundOnFirstSnapshotBeforeProbing * 2, 64);
     }
+    else if (slept)
+      numFramesFoundOnFirstSnapshot = gotNewFramebuffer ? numFramesFoundOnFirstSnapshot + 1 : 0;
+#endif
 
     uint64_t t1 = tick();
     if (!gotNewFramebuffer)
@@ -224,17 +328,15 @@ void *gpu_polling_thread(void*)
 #ifdef STATISTICS
       __atomic_fetch_add(&timeWastedPollingGPU, t1-t0, __ATOMIC_RELAXED);
 #endif
-      // We did not get a new frame - halve the eager fast tracking factor geometrically, we are probably
-      // near synchronized to the update rate of the content.
-      eagerFastTrackToSnapshottingFramesEarlierFactor /= 2;
       continue;
     }
     else
     {
-      // We got a new framebuffer, so linearly increase the driving rate to snapshot next framebuffer a bit earlier, in case
-      // our update rate is too slow for the content.
-      ++eagerFastTrackToSnapshottingFramesEarlierFactor;
-      memcpy(videoCoreFramebuffer[1], videoCoreFramebuffer[0], gpuFramebufferSizeBytes);
+      lastPublishedFramebuffer = backFramebuffer;
+      backFramebuffer = __atomic_exchange_n(&middleFramebuffer, backFramebuffer | FRAMEBUFFER_IS_NEW, __ATOMIC_ACQ_REL) & ~FRAMEBUFFER_IS_NEW;
+#ifdef FRAME_SOURCE_REPORTS_DAMAGE
+      PublishFrameSourceDamage();
+#endif
       __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
       syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
     }
@@ -244,106 +346,154 @@ void *gpu_polling_thread(void*)
 
 #endif // ~USE_GPU_VSYNC
 
-// Since we are polling for received GPU frames, run a histogram to predict when the next frame will arrive.
-// The histogram needs to be sufficiently small as to not cause a lag when frame rate suddenly changes on e.g.
-// main menu <-> ingame transitions
-uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
-uint64_t frameArrivalTimesTail = 0;
-int histogramSize = 0;
-
-// If framerate has been high for a long time, but then drops to e.g. 1fps, it would take a very very long time to fill up
-// the histogram of these 1fps intervals, so fbcp-ili9341 would take a long time to go back to sleep. Introduce a max age
-// for histogram entries of 10 seconds, so that if refresh rate drops from 60hz to 1hz, then after 10 seconds the histogram
-// buffer will have only these 1fps intervals in it, and it will go to sleep to yield CPU time.
-#define HISTOGRAM_MAX_SAMPLE_AGE 10000000
+// Since we are polling for received GPU frames, track the times at which they arrive to predict when the next frame will come.
+// This is a phase-locked loop: the content is assumed to update on a grid of times framePhase + k*framePeriod, and each arriving
+// frame nudges the phase and the period of the grid towards where it was observed. Frames that fall on a later grid point than
+// the next one are frames that the content skipped (or that were missed while polling), and do not disturb the lock. Updating
+// the estimate takes constant time per frame, so it can be done on every poll.
+static double framePeriod = 1000000.0 / TARGET_FRAME_RATE; // usecs between frames
+static double framePhase = 0; // Time of the grid point that the most recent frame was locked to
+static double frameArrivalJitter = 0; // Running average of how far from the grid frames have arrived, in usecs
+static uint64_t mostRecentFrameArrivalTime = 0;
+
+// Gains of the loop filter for the phase and the period. These are close to critically damped, so that a slightly off period
+// (e.g. 50Hz content when 60Hz was predicted) is locked onto within a handful of frames without overshooting.
+#define FRAME_PHASE_GAIN 0.5
+#define FRAME_PERIOD_GAIN 0.2
+#define FRAME_JITTER_GAIN 0.125
+
+// Frames that land further than this from the nearest grid point are outliers. Two outliers in a row mean that the content
+// has changed its update rate, e.g. from a 60Hz menu to a 25Hz video, and the loop is relocked to the average interval of them.
+#define FRAME_OUTLIER_DISTANCE(period, jitter) MIN(MAX((period)/8, 3*(jitter)), (period)/4)
+static int numOutlierFrames = 0;
+static uint64_t outlierFrameIntervals = 0;
+
+// If several frames in a row skip the same number of grid points, the content has dropped to a fraction of the locked rate (e.g.
+// from 60Hz to 30Hz), and the loop is relocked to the average interval of those frames. Content that skips an irregular number
+// of grid points, e.g. a menu that redraws only when something happens, or 24fps video on a 60Hz display, stays on the grid.
+#define FRAMES_SKIPPING_GRID_POINTS_BEFORE_RELOCKING 3
+static int numFramesSkippingGridPoints = 0;
+static int numGridPointsSkipped = 0;
+static uint64_t skippingFrameIntervals = 0;
+
+// A gap this many grid points long means that the content stopped updating for a while, after which the phase is restarted
+#define MAX_SKIPPED_GRID_POINTS 8
+
+static void RelockFramePeriod(double period, uint64_t t)
+{
+  framePeriod = MIN(MAX(period, 1000000.0/TARGET_FRAME_RATE), 100000.0);
+  framePhase = (double)t;
+  numOutlierFrames = numFramesSkippingGridPoints = 0;
+  outlierFrameIntervals = skippingFrameIntervals = 0;
+}
 
-void AddHistogramSample(uint64_t t)
+void AddFrameArrivalTimeSample(uint64_t t)
 {
-  frameArrivalTimes[frameArrivalTimesTail] = t;
-  frameArrivalTimesTail = (frameArrivalTimesTail + 1) % HISTOGRAM_SIZE;
-  if (histogramSize < HISTOGRAM_SIZE) ++histogramSize;
+  uint64_t interval = t - mostRecentFrameArrivalTime;
+  bool firstFrame = (mostRecentFrameArrivalTime == 0);
+  mostRecentFrameArrivalTime = t;
+  if (firstFrame)
+  {
+    framePhase = (double)t;
+    return;
+  }
 
-  // Expire too old entries.
-  while(t - GET_HISTOGRAM(histogramSize-1) > HISTOGRAM_MAX_SAMPLE_AGE) --histogramSize;
-}
+  double elapsed = (double)t - framePhase;
+  int k = (int)floor(elapsed / framePeriod + 0.5); // Nearest grid point to the arrival
+  if (k > MAX_SKIPPED_GRID_POINTS)
+  {
+    RelockFramePeriod(framePeriod, t);
+    return;
+  }
+  double error = elapsed - k * framePeriod;
+  frameArrivalJitter += (MIN(fabs(error), framePeriod/2) - frameArrivalJitter) * FRAME_JITTER_GAIN;
 
-int cmp(const void *e1, const void *e2) { return *(uint64_t*)e1 > *(uint64_t*)e2; }
+  if (k < 1 || fabs(error) > FRAME_OUTLIER_DISTANCE(framePeriod, frameArrivalJitter))
+  {
+    // Restart the grid from the outlier: if it was a one-off shift in phase, the next frame lands back on the grid.
+    framePhase = (double)t;
+    outlierFrameIntervals += interval;
+    if (++numOutlierFrames >= 2)
+      RelockFramePeriod((double)outlierFrameIntervals / numOutlierFrames, t);
+    return;
+  }
+  numOutlierFrames = 0;
+  outlierFrameIntervals = 0;
+
+  framePhase += k * framePeriod + FRAME_PHASE_GAIN * error;
+  framePeriod = MIN(MAX(framePeriod + FRAME_PERIOD_GAIN * error / k, 1000000.0/TARGET_FRAME_RATE), 100000.0);
+
+  if (k > 1)
+  {
+    if (k != numGridPointsSkipped)
+    {
+      numGridPointsSkipped = k;
+      numFramesSkippingGridPoints = 0;
+      skippingFrameIntervals = 0;
+    }
+    skippingFrameIntervals += interval;
+    if (++numFramesSkippingGridPoints >= FRAMES_SKIPPING_GRID_POINTS_BEFORE_RELOCKING)
+      RelockFramePeriod((double)skippingFrameIntervals / numFramesSkippingGridPoints, t);
+  }
+  else
+  {
+    numFramesSkippingGridPoints = 0;
+    skippingFrameIntervals = 0;
+  }
+}
 
 uint64_t EstimateFrameRateInterval()
 {
 #ifdef RANDOM_TEST_PATTERN
   return 1000000/RANDOM_TEST_PATTERN_FRAME_RATE;
 #endif
-  if (histogramSize == 0) return 1000000/TARGET_FRAME_RATE;
-  uint64_t mostRecentFrame = GET_HISTOGRAM(0);
+  if (mostRecentFrameArrivalTime == 0) return 1000000/TARGET_FRAME_RATE;
 
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
-  uint64_t timeNow = tick();
 #ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
   // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return 500000; } // if it's been more than one minute since last seen update, assume interval of 500ms.
-  if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+  uint64_t timeNow = tick();
+  if (timeNow - mostRecentFrameArrivalTime > 60000000) return 500000; // if it's been more than one minute since last seen update, assume interval of 500ms.
+  if (timeNow - mostRecentFrameArrivalTime > 5000000) return 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
 #endif
 
 #ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
   return 1000000/TARGET_FRAME_RATE;
 #else
-  if (histogramSize < 2) return 100000; // Frame histogram needs to have at least a few entries to bootstrap, if there's very few, either refresh rate is low, or fbcp-ili9341 just started
-
-  // Look at the intervals of all previous arrived frames, and take some percentile value as our expected current frame rate
-  uint64_t intervals[HISTOGRAM_SIZE-1];
-  for(int i = 0; i < histogramSize-1; ++i)
-    intervals[i] = MIN(100000, GET_HISTOGRAM(i) - GET_HISTOGRAM(i+1));
-  qsort(intervals, histogramSize-1, sizeof(uint64_t), cmp);
-
-  // Apply frame rate increase discovery factor to both the percentile position and the interpreted frame interval to catch
-  // up with display update rate if it has increased
-  int percentile = (histogramSize-1)*2/5;
-  percentile = MAX(percentile-eagerFastTrackToSnapshottingFramesEarlierFactor, 0);
-  uint64_t interval = intervals[percentile];
-  // Fast tracking #1: Always look at two most recent frames in addition to the ~40% percentile and follow whichever is a shorter period of time
-  interval = MIN(interval, GET_HISTOGRAM(0) - GET_HISTOGRAM(1));
-  // Fast tracking #2: if we seem to always get a new frame whenever snapshotting, we should try speeding up
-  interval = MAX((int64_t)interval - eagerFastTrackToSnapshottingFramesEarlierFactor*1000, (int64_t)1000000/TARGET_FRAME_RATE);
-  if (interval > 100000) interval = 100000;
-  return MAX(interval, 1000000/TARGET_FRAME_RATE);
+  return (uint64_t)framePeriod;
 #endif
 }
 
 uint64_t PredictNextFrameArrivalTime()
 {
-  uint64_t mostRecentFrame = histogramSize > 0 ? GET_HISTOGRAM(0) : tick();
-
   // High sleep mode hacks to save battery when ~idle: (These could be removed with an event based VideoCore display refresh API)
   uint64_t timeNow = tick();
+  if (mostRecentFrameArrivalTime == 0) return timeNow;
 #ifdef SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE
   // "Deep sleep" options: is user leaves the device with static content on screen for a long time.
-  if (timeNow - mostRecentFrame > 60000000) { histogramSize = 1; return lastFramePollTime + 100000; } // if it's been more than one minute since last seen update, assume interval of 100ms.
-  if (timeNow - mostRecentFrame > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+  if (timeNow - mostRecentFrameArrivalTime > 60000000) return lastFramePollTime + 500000; // if it's been more than one minute since last seen update, assume interval of 500ms.
+  if (timeNow - mostRecentFrameArrivalTime > 5000000) return lastFramePollTime + 100000; // if it's been more than 5 seconds since last seen update, assume interval of 100ms.
+#endif
+#ifndef SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
+  double period = 1000000.0 / TARGET_FRAME_RATE, phase = (double)mostRecentFrameArrivalTime, jitter = 0;
+#else
+  double period = framePeriod, phase = framePhase, jitter = frameArrivalJitter;
 #endif
-  uint64_t interval = EstimateFrameRateInterval();
-
-  // Assume that frames are arriving at times mostRecentFrame + k * interval.
-  // Find integer k such that mostRecentFrame + k * interval >= timeNow
-  // i.e. k = ceil((timeNow - mostRecentFrame) / interval)
-  uint64_t k = (timeNow - mostRecentFrame + interval - 1) / interval;
-  uint64_t nextFrameArrivalTime = mostRecentFrame + k * interval;
-  uint64_t timeOfPreviousMissedFrame = nextFrameArrivalTime - interval;
-
-  // If there should have been a frame just 1/3rd of our interval window ago, assume it was just missed and report back "the next frame is right now"
-  if (timeNow - timeOfPreviousMissedFrame < interval/3 && timeOfPreviousMissedFrame > mostRecentFrame) return timeNow;
-  else return nextFrameArrivalTime;
+
+  // Wake up a bit ahead of the next grid point to not be late for frames that arrive early, and if the frame has not yet come by
+  // the grid point, keep looking for a while in case it arrives late. Both windows widen as the arrival times get more jittery.
+  double wakeEarly = MIN(2*jitter, period/4);
+  double keepLooking = MIN(2*jitter + 1000, period/3);
+  double k = ceil(((double)timeNow - phase - keepLooking) / period);
+  double nextGridPoint = phase + MAX(k, 1) * period;
+  if (timeNow + wakeEarly >= nextGridPoint) return timeNow; // The frame is due, so look for it now
+  return (uint64_t)(nextGridPoint - wakeEarly);
 }
 
 void InitGPU()
 {
-  // Initialize GPU frame grabbing subsystem
-  bcm_host_init();
-  display = vc_dispmanx_display_open(0);
-  if (!display) FATAL_ERROR("vc_dispmanx_display_open failed! Make sure to have hdmi_force_hotplug=1 setting in /boot/config.txt");
-  DISPMANX_MODEINFO_T display_info;
-  int ret = vc_dispmanx_display_get_info(display, &display_info);
-  if (ret) FATAL_ERROR("vc_dispmanx_display_get_info failed!");
+  struct { int width, height; } display_info;
+  OpenFrameSource(&display_info.width, &display_info.height);
 
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   // Pretend that the display framebuffer would be in portrait mode for the purposes of size computation etc.
@@ -391,7 +541,7 @@ void InitGPU()
 
   // If specified, computes overscan that crops away equally much content from all sides of the source frame
   // to display the center of the source frame pixel perfect.
-#ifdef DISPLAY_CROPPED_INSTEAD_OF_SCALING
+#if defined(DISPLAY_CROPPED_INSTEAD_OF_SCALING) || defined(FRAME_SOURCE_CANNOT_SCALE)
   if (DISPLAY_DRAWABLE_WIDTH < display_info.width)
   {
     overscanLeft = (display_info.width - DISPLAY_DRAWABLE_WIDTH) * 0.5 / display_info.width;
@@ -423,6 +573,11 @@ void InitGPU()
   scalingFactorWidth = scalingFactorHeight = MIN(scalingFactorWidth, scalingFactorHeight);
 #endif
 
+#ifdef FRAME_SOURCE_CANNOT_SCALE
+  // The frame source can only crop, so smaller source displays are shown pixel for pixel in the center of the SPI display
+  scalingFactorWidth = scalingFactorHeight = 1.0;
+#endif
+
   // Since display resolution must be full pixels and not fractional, round the scaling to nearest pixel size
   // (and recompute after the subpixel rounding what the actual scaling factor ends up being)
   int scaledWidth = ROUND_TO_NEAREST_INT(relevantDisplayWidth * scalingFactorWidth);
@@ -442,43 +597,32 @@ void InitGPU()
   gpuFrameHeight = scaledHeight;
   gpuFramebufferScanlineStrideBytes = RoundUpToMultipleOf((gpuFrameWidth + excessPixelsLeft + excessPixelsRight) * 2, 32);
   gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * (gpuFrameHeight + excessPixelsTop + excessPixelsBottom);
+  SetupFrameSourceCapture();
+  InitNewFrameProbes();
+
+#ifdef RECORD_FRAME_TRACE
+  if (!OpenFrameTraceWriter(traceWriter, RECORD_FRAME_TRACE_FILE, gpuFrameWidth, gpuFrameHeight)) FATAL_ERROR("Failed to create frame trace " RECORD_FRAME_TRACE_FILE "!");
+  printf("Recording frames to " RECORD_FRAME_TRACE_FILE "\n");
+#endif
 
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
   // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
   // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
   // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
   // to randomly fail and then subsequently hang if called a second time)
-  videoCoreFramebuffer[0] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer0");
-  videoCoreFramebuffer[1] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer1");
-  memset(videoCoreFramebuffer[0], 0, gpuFramebufferSizeBytes*2);
-  memset(videoCoreFramebuffer[1], 0, gpuFramebufferSizeBytes*2);
-  videoCoreFramebuffer[0] += (gpuFramebufferSizeBytes>>1);
-  videoCoreFramebuffer[1] += (gpuFramebufferSizeBytes>>1);
+  for(int i = 0; i < NUM_CAPTURED_FRAMEBUFFERS; ++i)
+  {
+    videoCoreFramebuffer[i] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp triple buffered framebuffer");
+    memset(videoCoreFramebuffer[i], 0, gpuFramebufferSizeBytes*2);
+    videoCoreFramebuffer[i] += (gpuFramebufferSizeBytes>>1);
+  }
 
   syslog(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d with drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
   printf("Source GPU display is %dx%d. Output SPI display is %dx%d with a drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d\n", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
 
-  uint32_t image_prt;
-  printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, (double)(scaledWidth + excessPixelsLeft + excessPixelsRight) / (scaledHeight + excessPixelsTop + excessPixelsBottom));
-#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledHeight + excessPixelsTop + excessPixelsBottom, scaledWidth + excessPixelsLeft + excessPixelsRight, &image_prt);
-  vc_dispmanx_rect_set(&rect, excessPixelsTop, excessPixelsLeft, scaledHeight, scaledWidth);
-#else
-  screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, &image_prt);
-  vc_dispmanx_rect_set(&rect, excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight);
-#endif
-  if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
-  printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d, aspect ratio=%f\n", excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
-
-#ifdef USE_GPU_VSYNC
-  // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
-  // if it was, this signal is not a guaranteed edge trigger for availability of new frames.
-  vc_dispmanx_vsync_callback(display, VsyncCallback, 0);
-#else
-  // Record some fake samples to frame rate histogram to fast track it to warm state.
-  uint64_t now = tick();
-  for(int i = 0; i < HISTOGRAM_SIZE; ++i)
-    AddHistogramSample(now - 1000000ULL*(HISTOGRAM_SIZE-i) / TARGET_FRAME_RATE);
+#ifndef USE_GPU_VSYNC
+  // Start the frame arrival predictor off at TARGET_FRAME_RATE from now, so the polling thread has a schedule before the first frame.
+  AddFrameArrivalTimeSample(tick());
 
   int rc = pthread_create(&gpuPollingThread, NULL, gpu_polling_thread, NULL); // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
   if (rc != 0) FATAL_ERROR("Failed to create GPU polling thread!");
@@ -487,24 +631,14 @@ void InitGPU()
 
 void DeinitGPU()
 {
-#ifdef USE_GPU_VSYNC
-  if (display) vc_dispmanx_vsync_callback(display, NULL, 0);
-#else
+#ifndef USE_GPU_VSYNC
   pthread_join(gpuPollingThread, NULL);
   gpuPollingThread = (pthread_t)0;
 #endif
 
-  if (screen_resource)
-  {
-    vc_dispmanx_resource_delete(screen_resource);
-    screen_resource = 0;
-  }
-
-  if (display)
-  {
-    vc_dispmanx_display_close(display);
-    display = 0;
-  }
-
-  bcm_host_deinit();
+  CloseFrameSource();
+#ifdef RECORD_FRAME_TRACE
+  printf("Recorded %d frames to " RECORD_FRAME_TRACE_FILE "\n", traceWriter.numFrames);
+  CloseFrameTraceWriter(traceWriter);
+#endif
 }
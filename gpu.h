@@ -2,15 +2,43 @@
 
 #include <inttypes.h>
 
+#include "config.h"
+
 void InitGPU(void);
 void DeinitGPU(void);
-void AddHistogramSample(uint64_t t);
+void AddFrameArrivalTimeSample(uint64_t t);
 bool SnapshotFramebuffer(uint16_t *destination);
 bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer);
 uint64_t EstimateFrameRateInterval(void);
 uint64_t PredictNextFrameArrivalTime(void);
+int RoundUpToMultipleOf(int val, int multiple);
+
+// Returns the newest frame that the GPU polling thread has captured. The frame stays unchanged until the next call, so the main
+// thread can read it in place. Called on the main thread after numNewGpuFrames has told that a new frame has arrived.
+uint16_t *TakeNewestGpuFrame(void);
+
+#ifdef ZERO_COPY_SPI_TASKS
+// Index of the frame that TakeNewestGpuFrame() last returned
+int NewestGpuFrameIndex(void);
+
+// SPI tasks that send pixels straight from a captured frame hold a reference to it, so that the frame is not captured over before
+// the tasks have been sent. References are taken on the main thread when queueing the tasks, and released by the SPI thread.
+void RetainGpuFrame(int frame);
+void ReleaseGpuFrame(int frame);
 
-extern uint16_t *videoCoreFramebuffer[2];
+// Besides the triple buffer, a fourth buffer keeps the frame that the SPI thread sends from while the main thread diffs the next one
+#ifdef LATEST_FRAME_WINS
+// and a fifth the frame that was cancelled behind it, until the SPI thread has skipped over its tasks
+#define NUM_CAPTURED_FRAMEBUFFERS 5
+#else
+#define NUM_CAPTURED_FRAMEBUFFERS 4
+#endif
+#else
+#define NUM_CAPTURED_FRAMEBUFFERS 3
+#endif
+
+// Captured frames are handed from the GPU polling thread to the main thread in a triple buffer, see gpu.cpp
+extern uint16_t *videoCoreFramebuffer[NUM_CAPTURED_FRAMEBUFFERS];
 extern volatile int numNewGpuFrames;
 extern int displayXOffset;
 extern int displayYOffset;
@@ -35,13 +63,5 @@ struct FrameHistory
 
 extern FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE];
 
-#define HISTOGRAM_SIZE 240
-extern uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
-extern uint64_t frameArrivalTimesTail;
-extern int histogramSize;
-
-// Returns Nth most recent entry in the frame times histogram, 0 = most recent, (histogramSize-1) = oldest
-#define GET_HISTOGRAM(idx) frameArrivalTimes[(frameArrivalTimesTail - 1 - (idx) + HISTOGRAM_SIZE) % HISTOGRAM_SIZE]
-
 // Source framebuffer captured from DispmanX is (currently) always 16-bits R5G6B5
 #define FRAMEBUFFER_BYTESPERPIXEL 2
@@ -6,6 +6,7 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Memory Write Continue: writes pixels from where the previous write left off
 
 #ifdef ADAFRUIT_HX8357D_PITFT
 #include "pitft_35r_hx8357d.h"
@@ -162,6 +162,9 @@ void TurnDisplayOn()
 
 void DeinitSPIDisplay()
 {
+#ifdef USE_HARDWARE_VERTICAL_SCROLL
+  SPI_TRANSFER(0x13/*Normal Display Mode ON*/); // Exits vertical scrolling mode
+#endif
   ClearScreen();
   SPI_TRANSFER(/*Display OFF*/0x28);
   TurnBacklightOff();
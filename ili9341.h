@@ -27,6 +27,10 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Memory Write Continue: writes pixels from where the previous write left off
+
+// Supports the Vertical Scrolling Definition (0x33) and Vertical Scroll Start Address (0x37) commands
+#define DISPLAY_SUPPORTS_VERTICAL_SCROLL
 
 // ILI9341 displays are able to update at any rate between 61Hz to up to 119Hz. Default at power on is 70Hz.
 #define ILI9341_FRAMERATE_61_HZ 0x1F
@@ -6,6 +6,7 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Memory Write Continue: writes pixels from where the previous write left off
 
 #ifdef WAVESHARE35B_ILI9486
 #include "waveshare35b.h"
@@ -21,6 +22,9 @@
 // ILI9486 does not behave well if one sends partial commands, but must finish each command or the command does not apply
 #define MUST_SEND_FULL_CURSOR_WINDOW
 
+// Supports the Vertical Scrolling Definition (0x33) and Vertical Scroll Start Address (0x37) commands
+#define DISPLAY_SUPPORTS_VERTICAL_SCROLL
+
 void InitILI9486(void);
 #define InitSPIDisplay InitILI9486
 
@@ -10,6 +10,7 @@
 #define DISPLAY_SET_CURSOR_X 0x2A
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Memory Write Continue: writes pixels from where the previous write left off
 
 #define DISPLAY_NATIVE_WIDTH 320
 #define DISPLAY_NATIVE_HEIGHT 480
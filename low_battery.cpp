@@ -4,6 +4,7 @@
 #include "low_battery.h"
 #include "gpu.h"
 #include "spi.h"
+#include "diff.h"
 
 #ifdef LOW_BATTERY_PIN
 
@@ -61,6 +62,12 @@ void PollLowBattery()
 
 void DrawLowBatteryIcon(uint16_t *framebuffer)
 {
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+  // The icon is drawn over the captured frame, and when it goes away, the frame shows under it again. Neither is reported as damage
+  // by the frame source.
+  AddDamageRect(LOW_BATTERY_ICON_TOP_LEFT_X, LOW_BATTERY_ICON_TOP_LEFT_Y, LOW_BATTERY_ICON_TOP_LEFT_X + LOW_BATTERY_ICON_WIDTH, LOW_BATTERY_ICON_TOP_LEFT_Y + LOW_BATTERY_ICON_HEIGHT);
+#endif
+
   if (!lowBattery)
     return;
 
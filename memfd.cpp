@@ -0,0 +1,261 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef USE_MEMFD_FRAME_SOURCE
+
+#include <errno.h> // errno, EINTR
+#include <fcntl.h> // fcntl, F_GET_SEALS, F_SEAL_SHRINK
+#include <memory.h> // memcpy
+#include <poll.h> // poll
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <string.h> // strncpy
+#include <sys/mman.h> // mmap, munmap
+#include <sys/socket.h> // socket, bind, listen, accept, recvmsg, send
+#include <sys/stat.h> // fstat
+#include <sys/un.h> // sockaddr_un
+#include <syslog.h> // syslog
+#include <unistd.h> // close, unlink
+
+#include "client/fbcp_protocol.h"
+#include "gpu.h"
+#include "util.h"
+#include "virtual_panel.h"
+
+static int listenFd = -1;
+static int clientFd = -1;
+static uint8_t *sharedMemory = 0;
+static size_t sharedMemorySize = 0;
+static FbcpHelloMessage clientInfo; // Framebuffer layout of the connected client. Later clients need to match the first one.
+static bool haveClientInfo = false;
+
+static int pendingBuffer = -1; // The newest buffer presented by the client that has not been captured yet, or -1
+static DamageList captureDamage; // Areas of the client framebuffer that the next capture needs to copy
+
+static void ReleaseBuffer(int buffer)
+{
+  FbcpReleaseMessage msg = { FBCP_MESSAGE_RELEASE, (uint32_t)buffer };
+  send(clientFd, &msg, sizeof(msg), MSG_NOSIGNAL | MSG_DONTWAIT); // (if this fails, the client is gone, which is noticed when receiving)
+}
+
+static void DisconnectClient()
+{
+  if (clientFd < 0) return;
+  close(clientFd);
+  clientFd = -1;
+  if (sharedMemory) munmap(sharedMemory, sharedMemorySize);
+  sharedMemory = 0;
+  pendingBuffer = -1;
+  captureDamage.numRects = 0;
+  printf("Client disconnected from " MEMFD_FRAME_SOURCE_SOCKET ", waiting for a new one\n");
+}
+
+// Receives the hello message from a newly connected client, and maps its framebuffer memfd. Returns false if the client was rejected.
+static bool ReceiveHello(int fd)
+{
+  FbcpHelloMessage hello;
+  iovec iov = { &hello, sizeof(hello) };
+  union { cmsghdr header; char data[CMSG_SPACE(sizeof(int))]; } control;
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = sizeof(control.data);
+  ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+  int memFd = -1;
+  cmsghdr *cmsg = (len > 0) ? CMSG_FIRSTHDR(&msg) : 0;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&memFd, CMSG_DATA(cmsg), sizeof(int));
+
+  const char *error = 0;
+  struct stat st;
+  if (len != (ssize_t)sizeof(hello) || hello.type != FBCP_MESSAGE_HELLO || hello.magic != FBCP_PROTOCOL_MAGIC) error = "not an fbcp-ili9341 client";
+  else if (hello.version != FBCP_PROTOCOL_VERSION) error = "unsupported protocol version";
+  else if (memFd < 0) error = "no framebuffer memfd was passed";
+  else if (hello.width == 0 || hello.height == 0 || hello.width > 65535 || hello.height > 65535 || hello.strideBytes < hello.width*2 || hello.strideBytes % 4 != 0
+    || hello.numBuffers < 1 || hello.numBuffers > FBCP_MAX_BUFFERS) error = "invalid framebuffer layout";
+  else if (haveClientInfo && (hello.width != clientInfo.width || hello.height != clientInfo.height || hello.strideBytes != clientInfo.strideBytes)) error = "framebuffer size differs from that of the first client";
+  else if (fstat(memFd, &st) < 0 || (uint64_t)st.st_size < (uint64_t)hello.strideBytes * hello.height * hello.numBuffers) error = "framebuffer memfd is too small";
+  else if (!(fcntl(memFd, F_GET_SEALS) & F_SEAL_SHRINK)) error = "framebuffer memfd is not sealed against shrinking";
+
+  if (!error)
+  {
+    sharedMemorySize = (size_t)hello.strideBytes * hello.height * hello.numBuffers;
+    sharedMemory = (uint8_t*)mmap(0, sharedMemorySize, PROT_READ, MAP_SHARED, memFd, 0);
+    if (sharedMemory == MAP_FAILED)
+    {
+      sharedMemory = 0;
+      error = "mapping the framebuffer memfd failed";
+    }
+  }
+  if (memFd >= 0) close(memFd); // The mapping keeps the memory alive
+  if (error)
+  {
+    printf("Rejected client on " MEMFD_FRAME_SOURCE_SOCKET ": %s\n", error);
+    return false;
+  }
+
+  clientInfo = hello;
+  haveClientInfo = true;
+  printf("Client connected to " MEMFD_FRAME_SOURCE_SOCKET ": %ux%u pixels, %u buffers\n", hello.width, hello.height, hello.numBuffers);
+  return true;
+}
+
+static void AcceptClient()
+{
+  int fd = accept4(listenFd, 0, 0, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  if (clientFd >= 0) // Only one client is served at a time
+  {
+    printf("Rejected client on " MEMFD_FRAME_SOURCE_SOCKET ": another client is already connected\n");
+    close(fd);
+    return;
+  }
+  timeval helloTimeout = { 1, 0 }; // Don't let a client that never says hello stall frame delivery
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &helloTimeout, sizeof(helloTimeout));
+  if (!ReceiveHello(fd))
+  {
+    close(fd);
+    return;
+  }
+  clientFd = fd;
+  AddToDamageList(captureDamage, 0, 0, clientInfo.width, clientInfo.height); // The new client's first frame replaces everything
+}
+
+// Handles a message from the client. Returns false if there are no more messages to handle.
+static bool ReceiveFrameMessage()
+{
+  FbcpFrameMessage msg;
+  ssize_t len = recv(clientFd, &msg, sizeof(msg), MSG_DONTWAIT);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return false;
+  const ssize_t headerSize = sizeof(msg) - sizeof(msg.rects);
+  if (len < headerSize || msg.type != FBCP_MESSAGE_FRAME || msg.buffer >= clientInfo.numBuffers
+    || msg.numRects > FBCP_MAX_DAMAGE_RECTS || len != headerSize + (ssize_t)(msg.numRects * sizeof(FbcpRect)))
+  {
+    DisconnectClient(); // Connection closed, or a protocol violation
+    return false;
+  }
+
+  // Only the newest frame is captured, so hand back the buffer of a frame that was not captured in time. Its damage is still
+  // accumulated, since the newer frame contains those changes as well.
+  if (pendingBuffer >= 0 && pendingBuffer != (int)msg.buffer) ReleaseBuffer(pendingBuffer);
+  pendingBuffer = msg.buffer;
+
+  if (msg.numRects == 0)
+    AddToDamageList(captureDamage, 0, 0, clientInfo.width, clientInfo.height);
+  for(uint32_t i = 0; i < msg.numRects; ++i)
+  {
+    const FbcpRect &r = msg.rects[i];
+    AddToDamageList(captureDamage, r.x, r.y, MIN(r.x + r.width, (int)clientInfo.width), MIN(r.y + r.height, (int)clientInfo.height));
+  }
+  return true;
+}
+
+void OpenFrameSource(int *width, int *height)
+{
+  listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listenFd < 0) FATAL_ERROR("Failed to create a socket for the memfd frame source!");
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, MEMFD_FRAME_SOURCE_SOCKET, sizeof(addr.sun_path) - 1);
+  unlink(MEMFD_FRAME_SOURCE_SOCKET); // Remove a stale socket left behind by a previous run
+  if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 1) < 0) FATAL_ERROR("Failed to listen on " MEMFD_FRAME_SOURCE_SOCKET "!");
+
+  // The size of the source display is that of the client framebuffer, so wait for the first client to know what to set up
+  printf("Waiting for a client to connect to " MEMFD_FRAME_SOURCE_SOCKET "\n");
+  while(clientFd < 0)
+    AcceptClient();
+  *width = clientInfo.width;
+  *height = clientInfo.height;
+}
+
+void SetupFrameSourceCapture()
+{
+}
+
+bool WaitForFrameSourceDamage()
+{
+  if (pendingBuffer < 0)
+  {
+    pollfd fds[2] = { { listenFd, POLLIN, 0 }, { clientFd, POLLIN, 0 } };
+    poll(fds, (clientFd >= 0) ? 2 : 1, 100);
+  }
+
+  pollfd listenPoll = { listenFd, POLLIN, 0 };
+  if (poll(&listenPoll, 1, 0) > 0)
+    AcceptClient();
+  while(clientFd >= 0 && ReceiveFrameMessage())
+    ;
+  return pendingBuffer >= 0;
+}
+
+bool CaptureFrameSource(uint16_t *destination)
+{
+  if (pendingBuffer < 0) return false;
+  const uint8_t *buffer = sharedMemory + (size_t)pendingBuffer * clientInfo.strideBytes * clientInfo.height;
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  const int sourceStride = clientInfo.strideBytes >> 1;
+
+  // Read the areas changed since the previous capture into this framebuffer straight out of the client framebuffer
+  const DamageList &convert = DamageSinceLastCaptureInto(destination, captureDamage);
+  for(int i = 0; i < convert.numRects; ++i)
+  {
+    int x, y, endX, endY;
+    if (!SourceRectToFramebufferRect(convert.rects[i], &x, &y, &endX, &endY))
+      continue;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    // The source is captured transposed, so the excess pixels of the source are on the other axes
+    const uint16_t *src = (const uint16_t*)buffer + excessPixelsLeft * sourceStride + excessPixelsTop;
+    for(; y < endY; ++y)
+      for(int X = x; X < endX; ++X)
+        destination[y*stride + X] = src[X*sourceStride + y];
+#else
+    const uint16_t *src = (const uint16_t*)buffer + excessPixelsTop * sourceStride + excessPixelsLeft;
+    for(; y < endY; ++y)
+      memcpy(destination + y*stride + x, src + y*sourceStride + x, (endX - x) * 2);
+#endif
+  }
+  for(int i = 0; i < captureDamage.numRects; ++i)
+    AddCapturedDamage(captureDamage.rects[i]);
+  captureDamage.numRects = 0;
+
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+  // Check that the framebuffer now holds the whole client frame, and not only the areas that were converted
+  int numStalePixels = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+      numStalePixels += destination[y*stride + x] != ((const uint16_t*)buffer)[(excessPixelsLeft + x) * sourceStride + excessPixelsTop + y];
+#else
+      numStalePixels += destination[y*stride + x] != ((const uint16_t*)buffer)[(excessPixelsTop + y) * sourceStride + excessPixelsLeft + x];
+#endif
+  VirtualPanelCapturedFrame(numStalePixels);
+#endif
+
+  // The frame has been copied, so the client can draw to the buffer again
+  ReleaseBuffer(pendingBuffer);
+  pendingBuffer = -1;
+  return true;
+}
+
+void CloseFrameSource()
+{
+  if (clientFd >= 0)
+  {
+    close(clientFd);
+    clientFd = -1;
+  }
+  if (sharedMemory) munmap(sharedMemory, sharedMemorySize);
+  sharedMemory = 0;
+  if (listenFd >= 0)
+  {
+    close(listenFd);
+    listenFd = -1;
+    unlink(MEMFD_FRAME_SOURCE_SOCKET);
+  }
+}
+
+#endif // ~USE_MEMFD_FRAME_SOURCE
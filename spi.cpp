@@ -1,18 +1,26 @@
 #ifndef KERNEL_MODULE
 #include <stdio.h> // printf, stderr
+#include <stdlib.h> // exit, free
+#include <string.h> // memset
 #include <syslog.h> // syslog
 #include <fcntl.h> // open, O_RDWR, O_SYNC
 #include <sys/mman.h> // mmap, munmap
 #include <pthread.h> // pthread_create
-#include <bcm_host.h> // bcm_host_get_peripheral_address, bcm_host_get_peripheral_size, bcm_host_get_sdram_address
+#include <unistd.h> // usleep
 #endif
 
 #include "config.h"
+
+#if !defined(KERNEL_MODULE) && !defined(USE_EMULATED_HARDWARE)
+#include <bcm_host.h> // bcm_host_get_peripheral_address, bcm_host_get_peripheral_size, bcm_host_get_sdram_address
+#endif
 #include "spi.h"
+#include "gpu.h"
 #include "util.h"
 #include "dma.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
+#include "calibration.h"
 
 // Uncomment this to print out all bytes sent to the SPI bus
 // #define DEBUG_SPI_BUS_WRITES
@@ -35,7 +43,21 @@ void ChipSelectHigh();
 
 static uint32_t writeCounter = 0;
 
+#ifdef SPI_3WIRE_LOSSI_MODE
+// In LoSSI mode, each write to the FIFO sends out one 9-bit word, where bit 8 is the data/command bit (1=data, 0=command)
+#define LOSSI_DATA_BIT 0x100
+#else
+#define LOSSI_DATA_BIT 0
+#endif
+
 #define WRITE_FIFO(word) do { \
+  uint8_t w = (word); \
+  spi->fifo = LOSSI_DATA_BIT | w; \
+  TOGGLE_CHIP_SELECT_LINE(); \
+  DEBUG_PRINT_WRITTEN_BYTE(w); \
+  } while(0)
+
+#define WRITE_FIFO_COMMAND(word) do { \
   uint8_t w = (word); \
   spi->fifo = w; \
   TOGGLE_CHIP_SELECT_LINE(); \
@@ -105,7 +127,7 @@ void SetRealtimeThreadPriority()
 bool previousTaskWasSPI = true;
 #endif
 
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
 
 uint32_t NumBytesNeededFor32BitSPITask(uint32_t byteSizeFor8BitTask)
 {
@@ -248,7 +270,7 @@ void Interleave16BitSPITaskTo32Bit(SPITask *task)
     dst[i] = 0x1500 | (src[i] << 16);
 }
 
-#endif // ~SPI_3WIRE_PROTOCOL
+#endif // ~SPI_3WIRE_EXPANDS_TASKS
 
 void WaitForPolledSPITransferToFinish()
 {
@@ -260,6 +282,49 @@ void WaitForPolledSPITransferToFinish()
   if ((cs & BCM2835_SPI0_CS_RXD)) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
 }
 
+#ifdef ZERO_COPY_SPI_TASKS
+void CopyZeroCopyTaskPixels(const SPITask *task, uint8_t *dst, uint32_t numBytes, uint32_t *pixelIndex)
+{
+  const uint32_t width = task->width;
+  uint32_t x = *pixelIndex % width;
+  const uint16_t *scanline = (const uint16_t*)((const uint8_t*)task->pixels + (*pixelIndex / width) * task->strideBytes);
+  uint16_t *data = (uint16_t*)dst;
+  *pixelIndex += numBytes >> 1;
+  for(uint32_t pixelsLeft = numBytes >> 1; pixelsLeft > 0;)
+  {
+    uint32_t endX = MIN(width, x + pixelsLeft);
+    pixelsLeft -= endX - x;
+    while(x < endX) *data++ = __builtin_bswap16(scanline[x++]);
+    if (x == width)
+    {
+      x = 0;
+      scanline = (const uint16_t*)((const uint8_t*)scanline + task->strideBytes);
+    }
+  }
+}
+
+// Pushes the pixels of a zero copy task through the SPI FIFO, byteswapping them a small chunk at a time to a buffer on the stack
+static void WriteZeroCopyTaskPixelsToFIFO(const SPITask *task)
+{
+  uint16_t chunk[32];
+  uint32_t pixelIndex = 0;
+  for(uint32_t bytesLeft = task->PayloadSize(); bytesLeft > 0;)
+  {
+    uint32_t chunkSize = MIN(bytesLeft, (uint32_t)sizeof(chunk));
+    CopyZeroCopyTaskPixels(task, (uint8_t*)chunk, chunkSize, &pixelIndex);
+    bytesLeft -= chunkSize;
+    uint8_t *tStart = (uint8_t*)chunk;
+    uint8_t *tEnd = tStart + chunkSize;
+    while(tStart < tEnd)
+    {
+      uint32_t cs = spi->cs;
+      if ((cs & BCM2835_SPI0_CS_TXD)) WRITE_FIFO(*tStart++);
+      if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+    }
+  }
+}
+#endif
+
 #ifdef ALL_TASKS_SHOULD_DMA
 
 #ifndef USE_DMA_TRANSFERS
@@ -276,8 +341,13 @@ void RunSPITask(SPITask *task)
   uint8_t *tPrefillEnd = tStart + MIN(15, payloadSize);
 
 #define TASK_SIZE_TO_USE_DMA 4
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+#define IS_DMA_TASK_CMD(cmd) ((cmd) == DISPLAY_WRITE_PIXELS || (cmd) == DISPLAY_WRITE_PIXELS_CONTINUE || (cmd) == DISPLAY_SET_CURSOR_X || (cmd) == DISPLAY_SET_CURSOR_Y)
+#else
+#define IS_DMA_TASK_CMD(cmd) ((cmd) == DISPLAY_WRITE_PIXELS || (cmd) == DISPLAY_SET_CURSOR_X || (cmd) == DISPLAY_SET_CURSOR_Y)
+#endif
   // Do a DMA transfer if this task is suitable in size for DMA to handle
-  if (payloadSize >= TASK_SIZE_TO_USE_DMA && (task->cmd == DISPLAY_WRITE_PIXELS || task->cmd == DISPLAY_SET_CURSOR_X || task->cmd == DISPLAY_SET_CURSOR_Y))
+  if (task->PayloadSize() >= TASK_SIZE_TO_USE_DMA && IS_DMA_TASK_CMD(task->cmd))
   {
     if (previousTaskWasSPI)
       WaitForPolledSPITransferToFinish();
@@ -318,16 +388,29 @@ void RunSPITask(SPITask *task)
 #endif
 
     SET_GPIO(GPIO_TFT_DATA_CONTROL);
+#elif defined(SPI_3WIRE_LOSSI_MODE)
+    // In LoSSI mode the SPI0 peripheral generates the data/command bit in hardware, so send the command as a 9-bit word with that bit cleared
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+    WRITE_FIFO_COMMAND(0x00);
+#endif
+    WRITE_FIFO_COMMAND(task->cmd);
 #endif
 
     // Send the data payload:
-    while(tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
-    while(tStart < tEnd)
+#ifdef ZERO_COPY_SPI_TASKS
+    if (task->pixels)
+      WriteZeroCopyTaskPixelsToFIFO(task);
+    else
+#endif
     {
-      cs = spi->cs;
-      if ((cs & BCM2835_SPI0_CS_TXD)) WRITE_FIFO(*tStart++);
-// TODO:      else asm volatile("yield");
-      if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+      while(tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
+      while(tStart < tEnd)
+      {
+        cs = spi->cs;
+        if ((cs & BCM2835_SPI0_CS_TXD)) WRITE_FIFO(*tStart++);
+// TODO:        else asm volatile("yield");
+        if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+      }
     }
 
     previousTaskWasSPI = true;
@@ -372,22 +455,33 @@ void RunSPITask(SPITask *task)
 #endif
 
   SET_GPIO(GPIO_TFT_DATA_CONTROL);
+#elif defined(SPI_3WIRE_LOSSI_MODE)
+  // In LoSSI mode the SPI0 peripheral generates the data/command bit in hardware, so send the command as a 9-bit word with that bit cleared
+#ifdef DISPLAY_SPI_BUS_IS_16BITS_WIDE
+  WRITE_FIFO_COMMAND(0x00);
+#endif
+  WRITE_FIFO_COMMAND(task->cmd);
 #endif // ~!SPI_3WIRE_PROTOCOL
 
-// For small transfers, using DMA is not worth it, but pushing through with polled SPI gives better bandwidth.
-// For larger transfers though that are more than this amount of bytes, using DMA is faster.
-// This cutoff number was experimentally tested to find where Polled SPI and DMA are as fast.
-#define DMA_IS_FASTER_THAN_POLLED_SPI 140
   // Do a DMA transfer if this task is suitable in size for DMA to handle
 #ifdef USE_DMA_TRANSFERS
-  if (tEnd - tStart > DMA_IS_FASTER_THAN_POLLED_SPI)
+  if ((int)task->PayloadSize() > dmaIsFasterThanPolledSpi)
   {
+#ifdef SPI_3WIRE_LOSSI_MODE
+    // Switching to DMA clears the TX FIFO, so the command word must have been clocked out first
+    while(!(spi->cs & (BCM2835_SPI0_CS_DONE))) /*nop*/;
+#endif
     SPIDMATransfer(task);
 
     // After having done a DMA transfer, the SPI0 DLEN register has reset to zero, so restore it to fast mode.
     UNLOCK_FAST_8_CLOCKS_SPI();
   }
   else
+#endif
+#ifdef ZERO_COPY_SPI_TASKS
+  if (task->pixels)
+    WriteZeroCopyTaskPixelsToFIFO(task);
+  else
 #endif
   {
     while(tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
@@ -411,6 +505,7 @@ volatile uint64_t spiThreadIdleUsecs = 0;
 volatile uint64_t spiThreadSleepStartTime = 0;
 volatile int spiThreadSleeping = 0;
 double spiUsecsPerByte;
+int dmaIsFasterThanPolledSpi = DMA_IS_FASTER_THAN_POLLED_SPI;
 
 SPITask *GetTask() // Returns the first task in the queue, called in worker thread
 {
@@ -418,10 +513,16 @@ SPITask *GetTask() // Returns the first task in the queue, called in worker thre
   uint32_t tail = spiTaskMemory->queueTail;
   if (head == tail) return 0;
   SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
+#ifdef LATEST_FRAME_WINS
+  if (task->cmd == 0 && task->size == 0) // Wrapped around?
+#else
   if (task->cmd == 0) // Wrapped around?
+#endif
   {
-    spiTaskMemory->queueHead = 0;
-    __sync_synchronize();
+    __atomic_store_n(&spiTaskMemory->queueHead, 0, __ATOMIC_SEQ_CST);
+#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
+    if (__atomic_load_n(&spiTaskMemory->queueHeadWaiting, __ATOMIC_SEQ_CST)) syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was waiting for room in the queue
+#endif
     if (tail == 0) return 0;
     task = (SPITask*)spiTaskMemory->buffer;
   }
@@ -430,13 +531,102 @@ SPITask *GetTask() // Returns the first task in the queue, called in worker thre
 
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
+#ifdef ZERO_COPY_SPI_TASKS
+  // Release the frame before the task, so that once the main thread sees the task done, the frame is free to capture to again
+  if (task->pixels) ReleaseGpuFrame(task->frame);
+#endif
   __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
-  spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __sync_synchronize();
+  uint32_t taskStart = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer);
+  uint32_t newHead = taskStart + sizeof(SPITask) + task->size;
+  __atomic_store_n(&spiTaskMemory->queueHead, newHead, __ATOMIC_SEQ_CST);
+#if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
+  if (__atomic_load_n(&spiTaskMemory->queueHeadWaiting, __ATOMIC_SEQ_CST))
+  {
+    uint32_t wakePosition = spiTaskMemory->queueHeadWakePosition;
+    if (taskStart <= wakePosition && wakePosition <= newHead) syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was waiting for this task to finish
+  }
+#endif
 }
 
 extern volatile bool programRunning;
 
+#ifndef KERNEL_MODULE
+void WaitForSPIQueueHeadToAdvance(uint32_t head, uint32_t wakePosition)
+{
+#ifdef KERNEL_MODULE_CLIENT
+  // The kernel module cannot wake a futex in user space
+  usleep(100);
+#else
+  spiTaskMemory->queueHeadWakePosition = wakePosition;
+  __atomic_store_n(&spiTaskMemory->queueHeadWaiting, 1, __ATOMIC_SEQ_CST);
+  // If the SPI thread moved queueHead before it saw queueHeadWaiting, queueHead no longer equals head and this returns immediately
+  if (programRunning) syscall(SYS_futex, &spiTaskMemory->queueHead, FUTEX_WAIT, head, 0, 0, 0);
+  __atomic_store_n(&spiTaskMemory->queueHeadWaiting, 0, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void WaitForSPIQueueToReach(uint32_t position)
+{
+  while(programRunning)
+  {
+    uint32_t head = spiTaskMemory->queueHead;
+    uint32_t tail = spiTaskMemory->queueTail;
+    if ((tail + SPI_QUEUE_SIZE - head) % SPI_QUEUE_SIZE <= (tail + SPI_QUEUE_SIZE - position) % SPI_QUEUE_SIZE)
+      return;
+    WaitForSPIQueueHeadToAdvance(head, position);
+  }
+}
+#endif
+
+#ifdef LATEST_FRAME_WINS
+void QueueFrameMarker(uint32_t frame)
+{
+  SPITask *task = AllocTask(sizeof(frame));
+  task->cmd = 0;
+  memcpy(task->data, &frame, sizeof(frame));
+  // Only the newest frame can be cancelled, so that the main thread always knows which frame the display ends up showing
+  __atomic_store_n(&spiTaskMemory->cancellableFrame, frame, __ATOMIC_SEQ_CST);
+  CommitTask(task);
+}
+
+bool CancelQueuedFrame(uint32_t frame, uint32_t frameEnd)
+{
+  if (__atomic_load_n(&spiTaskMemory->cancelledFrame, __ATOMIC_SEQ_CST) != 0) return false;
+  spiTaskMemory->cancelledFrameEnd = frameEnd;
+  __atomic_store_n(&spiTaskMemory->cancelledFrame, frame, __ATOMIC_SEQ_CST);
+  // Whichever of the two threads first claims the frame decides whether it is sent or skipped
+  uint32_t expected = frame;
+  if (__atomic_compare_exchange_n(&spiTaskMemory->cancellableFrame, &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return true;
+  __atomic_store_n(&spiTaskMemory->cancelledFrame, 0, __ATOMIC_SEQ_CST);
+  return false;
+}
+
+// Called on the SPI thread when it reaches the marker task at the beginning of a frame
+static void BeginFrame(SPITask *marker)
+{
+  uint32_t frame;
+  memcpy(&frame, marker->data, sizeof(frame));
+  uint32_t expected = frame;
+  if (__atomic_compare_exchange_n(&spiTaskMemory->cancellableFrame, &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+    || __atomic_load_n(&spiTaskMemory->cancelledFrame, __ATOMIC_SEQ_CST) != frame)
+  {
+    DoneTask(marker); // Not cancelled, send the frame
+    return;
+  }
+
+  // The main thread cancelled this frame, and has already diffed a newer frame against what the display showed before it
+  uint32_t frameEnd = spiTaskMemory->cancelledFrameEnd;
+  DoneTask(marker);
+  while(programRunning && spiTaskMemory->queueHead != frameEnd)
+  {
+    SPITask *task = GetTask();
+    if (task) DoneTask(task);
+  }
+  __atomic_store_n(&spiTaskMemory->cancelledFrame, 0, __ATOMIC_SEQ_CST);
+}
+#endif
+
 void ExecuteSPITasks()
 {
 #ifndef USE_DMA_TRANSFERS
@@ -448,6 +638,13 @@ void ExecuteSPITasks()
       SPITask *task = GetTask();
       if (task)
       {
+#ifdef LATEST_FRAME_WINS
+        if (task->cmd == 0)
+        {
+          BeginFrame(task);
+          continue;
+        }
+#endif
         RunSPITask(task);
         DoneTask(task);
       }
@@ -506,6 +703,9 @@ int InitSPI()
   spi = (volatile SPIRegisterFile*)((uintptr_t)bcm2835 + BCM2835_SPI0_BASE - BCM2835_GPIO_BASE);
   gpio = (volatile GPIORegisterFile*)((uintptr_t)bcm2835);
 
+#elif defined(USE_EMULATED_HARDWARE)
+  InitEmulatedHardware();
+
 #else // Userland version
   // Memory map GPIO and SPI peripherals for direct access
   mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
@@ -593,6 +793,9 @@ int InitSPI()
 #endif
 
   spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
+#ifdef LATEST_FRAME_WINS
+  spiTaskMemory->cancellableFrame = spiTaskMemory->cancelledFrame = spiTaskMemory->cancelledFrameEnd = 0;
+#endif
 #endif
 
 #ifdef USE_DMA_TRANSFERS
@@ -605,6 +808,9 @@ int InitSPI()
 #if !defined(KERNEL_MODULE) && (!defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE_CLIENT_DRIVES))
   printf("Initializing display\n");
   InitSPIDisplay();
+  BEGIN_SPI_COMMUNICATION(); // InitSPIDisplay() ended the transfer, resume it for the calibration tasks
+  CalibrateSPIBus(maxBcmCoreTurboSpeed);
+  END_SPI_COMMUNICATION();
 
 #ifdef USE_SPI_THREAD
   // Create a dedicated thread to feed the SPI bus. While this is fast, it consumes a lot of CPU. It would be best to replace
@@ -628,6 +834,10 @@ void DeinitSPI()
 #ifdef USE_SPI_THREAD
   pthread_join(spiThread, NULL);
   spiThread = (pthread_t)0;
+#ifndef USE_DMA_TRANSFERS
+  // The SPI thread ended its last batch of tasks with END_SPI_COMMUNICATION(), so resume the transfer to send the display deinit commands
+  BEGIN_SPI_COMMUNICATION();
+#endif
 #endif
   DeinitSPIDisplay();
 #ifdef USE_DMA_TRANSFERS
@@ -647,11 +857,15 @@ void DeinitSPI()
   SET_GPIO_MODE(GPIO_SPI0_CLK, 0);
 #endif
 
+#ifdef USE_EMULATED_HARDWARE
+  DeinitEmulatedHardware();
+#else
   if (bcm2835)
   {
     munmap((void*)bcm2835, bcm_host_get_peripheral_size());
     bcm2835 = 0;
   }
+#endif
 
   if (mem_fd >= 0)
   {
@@ -15,6 +15,8 @@
 #define BCM2835_SPI0_BASE                    0x204000   // Address to SPI0 register file
 #define BCM2835_TIMER_BASE                   0x3000     // Address to System Timer register file
 
+#define BCM2835_SPI0_CS_LEN_LONG             0x02000000 // In LoSSI DMA mode, write 32-bit words to the FIFO instead of single bytes
+#define BCM2835_SPI0_CS_DMA_LEN              0x01000000 // Enable DMA in LoSSI mode
 #define BCM2835_SPI0_CS_RXF                  0x00100000 // Receive FIFO is full
 #define BCM2835_SPI0_CS_RXR                  0x00080000 // FIFO needs reading
 #define BCM2835_SPI0_CS_TXD                  0x00040000 // TXD TX FIFO can accept Data
@@ -22,6 +24,7 @@
 #define BCM2835_SPI0_CS_DONE                 0x00010000 // Done transfer Done
 #define BCM2835_SPI0_CS_ADCS                 0x00000800 // Automatically Deassert Chip Select
 #define BCM2835_SPI0_CS_INTR                 0x00000400 // Fire interrupts on RXR?
+#define BCM2835_SPI0_CS_LEN                  0x00002000 // LoSSI mode: send 9-bit words, where bit 8 of the word written to the FIFO is the data/command bit
 #define BCM2835_SPI0_CS_INTD                 0x00000200 // Fire interrupts on DONE?
 #define BCM2835_SPI0_CS_DMAEN                0x00000100 // Enable DMA transfers?
 #define BCM2835_SPI0_CS_TA                   0x00000080 // Transfer Active
@@ -56,6 +59,9 @@
 
 extern volatile void *bcm2835;
 
+#ifdef USE_EMULATED_HARDWARE
+#include "emulated_hardware.h" // Defines GPIORegisterFile and SPIRegisterFile with emulated registers
+#else
 typedef struct GPIORegisterFile
 {
   uint32_t gpfsel[6], reserved0; // GPIO Function Select registers, 3 bits per pin, 10 pins in an uint32_t
@@ -63,6 +69,7 @@ typedef struct GPIORegisterFile
   uint32_t gpclr[2], reserved2; // GPIO Pin Output Clear registers, write a 1 to bit at index I to set the pin at index I low
   uint32_t gplev[2];
 } GPIORegisterFile;
+#endif
 extern volatile GPIORegisterFile *gpio;
 
 #define SET_GPIO_MODE(pin, mode) gpio->gpfsel[(pin)/10] = (gpio->gpfsel[(pin)/10] & ~(0x7 << ((pin) % 10) * 3)) | ((mode) << ((pin) % 10) * 3)
@@ -71,6 +78,7 @@ extern volatile GPIORegisterFile *gpio;
 #define SET_GPIO(pin) gpio->gpset[0] = 1 << (pin) // Pin must be (0-31)
 #define CLEAR_GPIO(pin) gpio->gpclr[0] = 1 << (pin) // Pin must be (0-31)
 
+#ifndef USE_EMULATED_HARDWARE
 typedef struct SPIRegisterFile
 {
   uint32_t cs;   // SPI Master Control and Status register
@@ -78,16 +86,34 @@ typedef struct SPIRegisterFile
   uint32_t clk;  // SPI Master Clock Divider
   uint32_t dlen; // SPI Master Number of DMA Bytes to Write
 } SPIRegisterFile;
+#endif
 extern volatile SPIRegisterFile *spi;
 
 // Defines the size of the SPI task memory buffer in bytes. This memory buffer can contain two frames worth of tasks at maximum,
 // so for best performance, should be at least ~DISPLAY_WIDTH*DISPLAY_HEIGHT*BYTES_PER_PIXEL*2 bytes in size, plus some small
 // amount for structuring each SPITask command. Technically this can be something very small, like 4096b, and not need to contain
 // even a single full frame of data, but such small buffers can cause performance issues from threads starving.
+#ifdef ZERO_COPY_SPI_TASKS
+// Pixel tasks only reference the captured frames, so the queue holds the task headers and the small command payloads.
+#define SHARED_MEMORY_SIZE (DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT*SPI_BYTESPERPIXEL)
+#else
 #define SHARED_MEMORY_SIZE (DISPLAY_DRAWABLE_WIDTH*DISPLAY_DRAWABLE_HEIGHT*SPI_BYTESPERPIXEL*3)
+#endif
 #define SPI_QUEUE_SIZE (SHARED_MEMORY_SIZE - sizeof(SharedMemory))
 
-#if defined(SPI_3WIRE_DATA_COMMAND_FRAMING_BITS) && SPI_3WIRE_DATA_COMMAND_FRAMING_BITS == 1
+#if defined(SPI_3WIRE_PROTOCOL) && !defined(SPI_3WIRE_LOSSI_MODE)
+// The SPI tasks of 3-wire displays are expanded to 9-bit or 32-bit framing in software when they are committed
+#define SPI_3WIRE_EXPANDS_TASKS
+#endif
+
+#ifdef SPI_3WIRE_LOSSI_MODE
+// In LoSSI mode, DMA transfers write the payload to the FIFO in 32-bit words, which the SPI0 peripheral sends out as 9-bit data words
+#define SPI_LOSSI_DMA_SETTINGS (BCM2835_SPI0_CS_LEN | BCM2835_SPI0_CS_DMA_LEN | BCM2835_SPI0_CS_LEN_LONG)
+#else
+#define SPI_LOSSI_DMA_SETTINGS 0
+#endif
+
+#if defined(SPI_3WIRE_EXPANDS_TASKS) && SPI_3WIRE_DATA_COMMAND_FRAMING_BITS == 1
 // Need a byte of padding for 8-bit -> 9-bit expansion for performance
 #define SPI_9BIT_TASK_PADDING_BYTES 1
 #else
@@ -101,10 +127,35 @@ extern volatile SPIRegisterFile *spi;
 #define MAX_SPI_TASK_SIZE 65528
 #endif
 
+// For small transfers, using DMA is not worth it, but pushing through with polled SPI gives better bandwidth.
+// For larger transfers though that are more than this amount of bytes, using DMA is faster.
+// This cutoff number was experimentally tested to find where Polled SPI and DMA are as fast.
+#define DMA_IS_FASTER_THAN_POLLED_SPI 140
+
+// The DMA cutoff that is in use: DMA_IS_FASTER_THAN_POLLED_SPI, unless measured at startup with CALIBRATE_SPI_BUS_AT_STARTUP
+extern int dmaIsFasterThanPolledSpi;
+
+#ifdef ZERO_COPY_SPI_TASKS
+#if defined(SPI_3WIRE_EXPANDS_TASKS)
+// 3-wire tasks are expanded to 9-bit or 32-bit framing in the task queue when they are committed.
+#error ZERO_COPY_SPI_TASKS is not compatible with SPI_3WIRE_PROTOCOL, unless in SPI_3WIRE_LOSSI_MODE!
+#endif
+#if defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2) || SPI_BYTESPERPIXEL != 2
+#error ZERO_COPY_SPI_TASKS only sends R5G6B5 pixels, and is not compatible with displays that take 18-bit pixels!
+#endif
+#if defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT)
+#error ZERO_COPY_SPI_TASKS is not compatible with the kernel module, which cannot read the captured frames of the userland program!
+#endif
+#endif
+
+#if defined(LATEST_FRAME_WINS) && (defined(KERNEL_MODULE) || defined(KERNEL_MODULE_CLIENT))
+#error LATEST_FRAME_WINS is not compatible with the kernel module, which does not skip over the tasks of cancelled frames!
+#endif
+
 typedef struct __attribute__((packed)) SPITask
 {
   uint32_t size; // Size, including both 8-bit and 9-bit tasks
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
   uint32_t sizeExpandedTaskWithPadding; // Size of the expanded 9-bit/32-bit task. The expanded task starts at address spiTask->data + spiTask->size - spiTask->sizeExpandedTaskWithPadding;
 #endif
 #ifdef SPI_32BIT_COMMANDS
@@ -117,10 +168,19 @@ typedef struct __attribute__((packed)) SPITask
   uint8_t *fb;
   uint8_t *prevFb;
   uint16_t width;
+#endif
+#ifdef ZERO_COPY_SPI_TASKS
+  // If nonzero, this task carries no payload in data[], but sends numPixelBytes worth of pixels from the captured frame at this
+  // address: rows of width pixels, strideBytes apart, starting each row at the same x coordinate as the first.
+  const uint16_t *pixels;
+  uint32_t numPixelBytes;
+  uint16_t width;
+  uint16_t strideBytes;
+  uint8_t frame; // The captured frame that pixels points to, see RetainGpuFrame() in gpu.h
 #endif
   uint8_t data[]; // Contains both 8-bit and 9-bit tasks back to back, 8-bit first, then 9-bit.
 
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
   inline uint8_t *PayloadStart() { return data + (size - sizeExpandedTaskWithPadding); }
   inline uint8_t *PayloadEnd() { return data + (size - SPI_9BIT_TASK_PADDING_BYTES); }
   inline uint32_t PayloadSize() const { return sizeExpandedTaskWithPadding - SPI_9BIT_TASK_PADDING_BYTES; }
@@ -128,7 +188,11 @@ typedef struct __attribute__((packed)) SPITask
 #else
   inline uint8_t *PayloadStart() { return data; }
   inline uint8_t *PayloadEnd() { return data + size; }
+#ifdef ZERO_COPY_SPI_TASKS
+  inline uint32_t PayloadSize() const { return pixels ? numPixelBytes : size; }
+#else
   inline uint32_t PayloadSize() const { return size; }
+#endif
   inline uint32_t *DmaSpiHeaderAddress() { return &dmaSpiHeader; }
 #endif
 
@@ -246,7 +310,14 @@ typedef struct SharedMemory
   volatile uint32_t queueHead;
   volatile uint32_t queueTail;
   volatile uint32_t spiBytesQueued; // Number of actual payload bytes in the queue
+  volatile uint32_t queueHeadWaiting; // Nonzero while the main thread sleeps on queueHead, see WaitForSPIQueueHeadToAdvance()
+  volatile uint32_t queueHeadWakePosition; // The ring buffer position that the main thread is waiting for queueHead to reach
   volatile uint32_t interruptsRaised;
+#ifdef LATEST_FRAME_WINS
+  volatile uint32_t cancellableFrame; // The newest queued frame, until the SPI thread starts to send it, see QueueFrameMarker()
+  volatile uint32_t cancelledFrame; // Nonzero if the SPI thread should skip the tasks of this frame, up to queue position cancelledFrameEnd
+  volatile uint32_t cancelledFrameEnd;
+#endif
   volatile uintptr_t sharedMemoryBaseInPhysMemory;
   volatile uint8_t buffer[];
 } SharedMemory;
@@ -268,7 +339,7 @@ extern volatile int spiThreadSleeping;
 
 extern int mem_fd;
 
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
 
 // Converts the given SPI task in-place from an 8-bit task to a 9-bit task.
 void Interleave8BitSPITaskTo9Bit(SPITask *task);
@@ -284,9 +355,34 @@ uint32_t NumBytesNeededFor32BitSPITask(uint32_t byteSizeFor8BitTask);
 
 #endif
 
+// Sleeps the main thread until the SPI thread has moved queueHead away from the given head value. To not be woken up after each
+// task, the SPI thread only wakes the main thread when it has finished the task that covers ring buffer position wakePosition,
+// or when it wraps queueHead back to the beginning of the buffer. The caller should recheck what it waits for after this returns.
+void WaitForSPIQueueHeadToAdvance(uint32_t head, uint32_t wakePosition);
+
+// Sleeps the main thread until the SPI thread has finished all the tasks that were queued before the given ring buffer position,
+// e.g. the value of queueTail at the end of a frame.
+void WaitForSPIQueueToReach(uint32_t position);
+
+#ifdef LATEST_FRAME_WINS
+// Queues a marker task that tells the SPI thread where the tasks of the given frame begin. The frame number must be nonzero. The
+// frame is cancellable until the SPI thread reaches the marker, or until the marker of the next frame is queued.
+void QueueFrameMarker(uint32_t frame);
+
+// Tells the SPI thread to skip over the tasks of the given frame, which end at ring buffer position frameEnd, instead of sending them.
+// Returns false if the SPI thread has already started to send the frame, or if an earlier cancelled frame has not yet been skipped.
+bool CancelQueuedFrame(uint32_t frame, uint32_t frameEnd);
+#endif
+
+#ifdef ZERO_COPY_SPI_TASKS
+// Byteswaps the next numBytes of pixels that the given zero copy task references to dst, in the big endian order that the display
+// expects. *pixelIndex keeps the position within the task between calls, and should start at zero.
+void CopyZeroCopyTaskPixels(const SPITask *task, uint8_t *dst, uint32_t numBytes, uint32_t *pixelIndex);
+#endif
+
 static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new SPI task block, called on main thread
 {
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
   // For 3-wire/9-bit tasks, store the converted task right at the end of the 8-bit task.
 #ifdef SPI_32BIT_COMMANDS
   uint32_t sizeExpandedTaskWithPadding = NumBytesNeededFor32BitSPITask(bytes) + SPI_9BIT_TASK_PADDING_BYTES;
@@ -316,11 +412,17 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
       // Wait until there are no remaining bytes to process in the far right end of the buffer - we'll write an eob marker there as soon as the read pointer has cleared it.
       // At this point the SPI queue may actually be quite empty, so don't sleep (except for now in kernel client app)
       usleep(100);
+#else
+      // Wait until the SPI thread has wrapped around and finished the task at the beginning of the buffer
+      WaitForSPIQueueHeadToAdvance(head, 0);
 #endif
       head = spiTaskMemory->queueHead;
     }
     SPITask *endOfBuffer = (SPITask*)(spiTaskMemory->buffer + tail);
     endOfBuffer->cmd = 0; // Use cmd=0x00 to denote "end of buffer, wrap to beginning"
+#ifdef LATEST_FRAME_WINS
+    endOfBuffer->size = 0; // Frame markers are cmd=0x00 tasks as well, but carry the frame number as payload
+#endif
     __sync_synchronize();
     spiTaskMemory->queueTail = 0;
     __sync_synchronize();
@@ -339,25 +441,28 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
       // Hack: Pump the kernel module to start transferring in case it has stopped. TODO: Remove this line:
     if (!(spi->cs & BCM2835_SPI0_CS_TA)) spi->cs |= BCM2835_SPI0_CS_TA;
 #endif
-    usleep(100); // Since the SPI queue is full, we can afford to sleep a bit on the main thread without introducing lag.
+    WaitForSPIQueueHeadToAdvance(head, newTail); // Since the SPI queue is full, we can afford to sleep on the main thread without introducing lag.
     head = spiTaskMemory->queueHead;
   }
 
   SPITask *task = (SPITask*)(spiTaskMemory->buffer + tail);
   task->size = bytes;
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
   task->sizeExpandedTaskWithPadding = sizeExpandedTaskWithPadding;
 #endif
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   task->fb = &task->data[0];
   task->prevFb = 0;
+#endif
+#ifdef ZERO_COPY_SPI_TASKS
+  task->pixels = 0;
 #endif
   return task;
 }
 
 static inline void CommitTask(SPITask *task) // Advertises the given SPI task from main thread to worker, called on main thread
 {
-#ifdef SPI_3WIRE_PROTOCOL
+#ifdef SPI_3WIRE_EXPANDS_TASKS
 #ifdef SPI_32BIT_COMMANDS
   Interleave16BitSPITaskTo32Bit(task);
 #else
@@ -390,6 +495,7 @@ int InitSPI(void);
 void DeinitSPI(void);
 void ExecuteSPITasks(void);
 void RunSPITask(SPITask *task);
+void WaitForPolledSPITransferToFinish(void);
 SPITask *GetTask(void);
 void DoneTask(SPITask *task);
 void DumpSPICS(uint32_t reg);
@@ -16,6 +16,7 @@
 #define DISPLAY_WRITE_PIXELS 0x2C
 
 #if defined(ST7789) || defined(ST7789VW)
+#define DISPLAY_WRITE_PIXELS_CONTINUE 0x3C // Memory Write Continue, which ST7735 controllers do not have
 #define DISPLAY_NATIVE_WIDTH 240
 #define DISPLAY_NATIVE_HEIGHT 240
 #elif defined(ST7735R)
@@ -17,6 +17,7 @@
 #include "mailbox.h"
 #include "mem_alloc.h"
 #include "dma.h"
+#include "diff.h"
 
 volatile uint64_t timeWastedPollingGPU = 0;
 volatile float statsSpiBusSpeed = 0;
@@ -88,6 +89,16 @@ void UpdateStatisticsNumbers()
 
 void DrawStatisticsOverlay(uint16_t *framebuffer)
 {
+#ifdef DIFF_ONLY_DAMAGED_AREAS
+  // The overlay is drawn over the captured frame, so the frame source does not report changes to it as damage. Mark the whole band
+  // of overlay text lines as damaged, which also covers the pixels of a previously longer text that now show the frame again.
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  AddDamageRect(0, 0, 10 + MONACO_HEIGHT + 1, gpuFrameHeight);
+#else
+  AddDamageRect(0, 0, gpuFrameWidth, 10 + MONACO_HEIGHT + 1);
+#endif
+#endif
+
   DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, fpsText, 1, 1, fpsColor, 0);
   DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), 0);
 
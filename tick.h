@@ -4,9 +4,23 @@
 #include <inttypes.h>
 #include <unistd.h>
 
+#include "config.h"
+
+#ifdef USE_EMULATED_HARDWARE
+#include <time.h>
+
+// Without the BCM2835 system timer, read the monotonic clock instead, in the same microsecond units
+static inline uint64_t tick()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+#else
 // Initialized in spi.cpp along with the rest of the BCM2835 peripheral:
 extern volatile uint64_t *systemTimerRegister;
 #define tick() (*systemTimerRegister)
+#endif
 
 #endif
 
@@ -0,0 +1,184 @@
+#include "config.h"
+
+#if defined(RECORD_FRAME_TRACE) || defined(USE_TRACE_FRAME_SOURCE)
+
+#include <memory.h> // memset, memcmp
+#include <stdlib.h> // free
+
+#include "trace.h"
+#include "mem_alloc.h"
+
+// Runs of unchanged pixels shorter than this are stored as changed pixels, since starting a new run costs as much as two pixels
+#define MIN_UNCHANGED_RUN_LENGTH 3
+
+static inline void PutU16(uint8_t *&out, uint16_t value)
+{
+  memcpy(out, &value, 2);
+  out += 2;
+}
+
+static inline uint16_t GetU16(const uint8_t *&in)
+{
+  uint16_t value;
+  memcpy(&value, in, 2);
+  in += 2;
+  return value;
+}
+
+bool OpenFrameTraceWriter(FrameTraceWriter &writer, const char *filename, int width, int height)
+{
+  memset(&writer, 0, sizeof(writer));
+  writer.file = fopen(filename, "wb");
+  if (!writer.file) return false;
+  setvbuf(writer.file, 0, _IOFBF, 1024*1024);
+  writer.width = width;
+  writer.height = height;
+  writer.prevFrame = (uint16_t*)Malloc(width * height * 2, "OpenFrameTraceWriter() previous frame");
+  memset(writer.prevFrame, 0, width * height * 2);
+  writer.delta = (uint16_t*)Malloc(width * height * 2, "OpenFrameTraceWriter() delta");
+  // Short unchanged runs are folded into changed runs, so the worst case is well below two run headers per pixel
+  writer.payload = (uint8_t*)Malloc(width * height * 4 + 8, "OpenFrameTraceWriter() payload");
+
+  FrameTraceHeader header;
+  memcpy(header.magic, FRAME_TRACE_MAGIC, sizeof(header.magic));
+  header.version = FRAME_TRACE_VERSION;
+  header.width = width;
+  header.height = height;
+  fwrite(&header, sizeof(header), 1, writer.file);
+  return true;
+}
+
+void WriteTraceFrame(FrameTraceWriter &writer, const uint16_t *frame, int strideBytes, uint64_t timestamp)
+{
+  if (!writer.file) return;
+
+  // XOR the frame against the previous one, and keep the frame as the new previous one
+  uint16_t *delta = writer.delta;
+  bool frameChanged = false;
+  for(int y = 0, i = 0; y < writer.height; ++y, frame = (const uint16_t*)((const uint8_t*)frame + strideBytes))
+    for(int x = 0; x < writer.width; ++x, ++i)
+    {
+      delta[i] = frame[x] ^ writer.prevFrame[i];
+      writer.prevFrame[i] = frame[x];
+      frameChanged = frameChanged || delta[i];
+    }
+  if (!frameChanged && writer.numFrames > 0) return; // Duplicate of the previous frame
+
+  // Run length encode the deltas. Runs may span scanlines.
+  uint8_t *out = writer.payload;
+  const int numPixels = writer.width * writer.height;
+  int i = 0;
+  while(i < numPixels)
+  {
+    int numUnchanged = 0;
+    while(i < numPixels && !delta[i] && numUnchanged < 0xFFFF)
+    {
+      ++i;
+      ++numUnchanged;
+    }
+
+    // Extend the run of changed pixels over short runs of unchanged ones
+    const int start = i;
+    while(i < numPixels && i - start < 0xFFFF)
+    {
+      if (!delta[i])
+      {
+        int numZeros = 1;
+        while(numZeros < MIN_UNCHANGED_RUN_LENGTH && i + numZeros < numPixels && !delta[i + numZeros]) ++numZeros;
+        if (numZeros >= MIN_UNCHANGED_RUN_LENGTH || i + numZeros == numPixels) break;
+      }
+      ++i;
+    }
+
+    PutU16(out, numUnchanged);
+    PutU16(out, i - start);
+    memcpy(out, delta + start, (i - start) * 2);
+    out += (i - start) * 2;
+  }
+
+  if (writer.numFrames == 0) writer.firstTimestamp = timestamp;
+  FrameTraceFrameHeader frameHeader;
+  frameHeader.timestamp = timestamp - writer.firstTimestamp;
+  frameHeader.payloadBytes = (uint32_t)(out - writer.payload);
+  frameHeader.unused = 0;
+  fwrite(&frameHeader, sizeof(frameHeader), 1, writer.file);
+  fwrite(writer.payload, 1, frameHeader.payloadBytes, writer.file);
+  ++writer.numFrames;
+}
+
+void CloseFrameTraceWriter(FrameTraceWriter &writer)
+{
+  if (writer.file) fclose(writer.file);
+  free(writer.prevFrame);
+  free(writer.delta);
+  free(writer.payload);
+  memset(&writer, 0, sizeof(writer));
+}
+
+// Reads the header of the frame after the current one, if there is one
+static void PeekNextTraceFrame(FrameTraceReader &reader)
+{
+  reader.hasNextFrame = fread(&reader.nextFrame, sizeof(reader.nextFrame), 1, reader.file) == 1;
+}
+
+bool OpenFrameTraceReader(FrameTraceReader &reader, const char *filename)
+{
+  memset(&reader, 0, sizeof(reader));
+  reader.file = fopen(filename, "rb");
+  if (!reader.file) return false;
+  setvbuf(reader.file, 0, _IOFBF, 1024*1024);
+  if (fread(&reader.header, sizeof(reader.header), 1, reader.file) != 1 || memcmp(reader.header.magic, FRAME_TRACE_MAGIC, sizeof(reader.header.magic))
+    || reader.header.version != FRAME_TRACE_VERSION || reader.header.width == 0 || reader.header.height == 0
+    || reader.header.width > 16384 || reader.header.height > 16384)
+  {
+    CloseFrameTraceReader(reader);
+    return false;
+  }
+  const int numPixels = reader.header.width * reader.header.height;
+  reader.frame = (uint16_t*)Malloc(numPixels * 2, "OpenFrameTraceReader() frame");
+  memset(reader.frame, 0, numPixels * 2);
+  PeekNextTraceFrame(reader);
+  return true;
+}
+
+bool ReadNextTraceFrame(FrameTraceReader &reader)
+{
+  if (!reader.hasNextFrame) return false;
+  const uint32_t payloadBytes = reader.nextFrame.payloadBytes;
+  if (payloadBytes > reader.payloadCapacity)
+  {
+    free(reader.payload);
+    reader.payload = (uint8_t*)Malloc(payloadBytes, "ReadNextTraceFrame() payload");
+    reader.payloadCapacity = payloadBytes;
+  }
+  if (fread(reader.payload, 1, payloadBytes, reader.file) != payloadBytes) return false;
+
+  // Apply the runs of XOR deltas to the current frame
+  const int numPixels = reader.header.width * reader.header.height;
+  const uint8_t *in = reader.payload, *end = reader.payload + payloadBytes;
+  int i = 0;
+  while(in + 4 <= end)
+  {
+    i += GetU16(in);
+    int numChanged = GetU16(in);
+    if (i + numChanged > numPixels || in + numChanged * 2 > end) return false;
+    for(int j = 0; j < numChanged; ++j)
+      reader.frame[i++] ^= GetU16(in);
+  }
+  if (in != end || i != numPixels) return false;
+
+  reader.timestamp = reader.nextFrame.timestamp;
+  ++reader.numFrames;
+  PeekNextTraceFrame(reader);
+  return true;
+}
+
+void CloseFrameTraceReader(FrameTraceReader &reader)
+{
+  if (reader.file) fclose(reader.file);
+  free(reader.frame);
+  free(reader.payload);
+  memset(&reader, 0, sizeof(reader));
+}
+
+#endif
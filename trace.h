@@ -0,0 +1,69 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Frame traces record the frames that the frame source produced along with their arrival times, so that a run can be replayed
+// deterministically later with USE_TRACE_FRAME_SOURCE. The file format is streamable, and consists of a FrameTraceHeader followed by
+// frames, each of which is a FrameTraceFrameHeader followed by payloadBytes of compressed pixel data. The pixel data of a frame is the
+// XOR of its R5G6B5 pixels against the previous frame (the first frame is XORed against black), run length encoded in row major order
+// as a sequence of runs, each of which is:
+//   uint16_t numUnchangedPixels, uint16_t numChangedPixels, followed by numChangedPixels uint16_t XOR values.
+// The runs of a frame cover exactly width*height pixels. All fields are little endian.
+
+#define FRAME_TRACE_MAGIC "FBCPTRCE"
+#define FRAME_TRACE_VERSION 1
+
+struct FrameTraceHeader
+{
+  char magic[8]; // FRAME_TRACE_MAGIC
+  uint32_t version; // FRAME_TRACE_VERSION
+  uint32_t width, height;
+};
+
+struct FrameTraceFrameHeader
+{
+  uint64_t timestamp; // Arrival time of the frame in microseconds, relative to the first frame
+  uint32_t payloadBytes;
+  uint32_t unused;
+};
+
+struct FrameTraceWriter
+{
+  FILE *file;
+  int width, height;
+  uint16_t *prevFrame; // The previously written frame, width*height pixels
+  uint16_t *delta;
+  uint8_t *payload;
+  uint64_t firstTimestamp;
+  int numFrames;
+};
+
+// Creates a trace file for frames of the given size. Returns false on failure.
+bool OpenFrameTraceWriter(FrameTraceWriter &writer, const char *filename, int width, int height);
+
+// Appends a frame to the trace, unless it is identical to the previously written frame. timestamp is in microseconds.
+void WriteTraceFrame(FrameTraceWriter &writer, const uint16_t *frame, int strideBytes, uint64_t timestamp);
+
+void CloseFrameTraceWriter(FrameTraceWriter &writer);
+
+struct FrameTraceReader
+{
+  FILE *file;
+  FrameTraceHeader header;
+  uint16_t *frame; // The current frame, header.width*header.height pixels
+  uint64_t timestamp; // Arrival time of the current frame
+  bool hasNextFrame; // If true, nextFrame holds the header of the frame after the current one
+  FrameTraceFrameHeader nextFrame;
+  uint8_t *payload;
+  uint32_t payloadCapacity;
+  int numFrames; // Number of frames read so far
+};
+
+// Opens a trace file for reading. The current frame is black until ReadNextTraceFrame() is called. Returns false on failure.
+bool OpenFrameTraceReader(FrameTraceReader &reader, const char *filename);
+
+// Advances to the next frame of the trace. Returns false at the end of the trace, or if the trace is corrupt.
+bool ReadNextTraceFrame(FrameTraceReader &reader);
+
+void CloseFrameTraceReader(FrameTraceReader &reader);
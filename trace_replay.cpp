@@ -0,0 +1,84 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef USE_TRACE_FRAME_SOURCE
+
+#include <memory.h> // memcpy
+#include <stdio.h> // printf
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog
+#include <unistd.h> // usleep
+
+#include "gpu.h"
+#include "tick.h"
+#include "trace.h"
+#include "util.h"
+
+void MarkProgramQuitting(void);
+extern volatile bool programRunning;
+
+static FrameTraceReader trace;
+static uint64_t replayStartTime = 0;
+static bool lastFrameDelivered = false;
+
+void OpenFrameSource(int *width, int *height)
+{
+  if (!OpenFrameTraceReader(trace, TRACE_FRAME_SOURCE_FILE)) FATAL_ERROR("Failed to open frame trace " TRACE_FRAME_SOURCE_FILE "!");
+  printf("Replaying frames from " TRACE_FRAME_SOURCE_FILE ": %ux%u pixels\n", trace.header.width, trace.header.height);
+
+  // The frames were recorded as they were handed to the main loop, i.e. already transposed if DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE was
+  // enabled, so report the size that InitGPU() turns back into the recorded one.
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  *width = trace.header.height;
+  *height = trace.header.width;
+#else
+  *width = trace.header.width;
+  *height = trace.header.height;
+#endif
+}
+
+void SetupFrameSourceCapture()
+{
+}
+
+bool CaptureFrameSource(uint16_t *destination)
+{
+  if (lastFrameDelivered)
+  {
+    // Let the main thread take the last frame before quitting
+    if (__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) > 0) return false;
+    printf("Replayed %d frames of " TRACE_FRAME_SOURCE_FILE " in %.3f seconds\n", trace.numFrames, (tick() - replayStartTime) / 1000000.0);
+    MarkProgramQuitting();
+    return false;
+  }
+
+#ifdef REPLAY_FRAME_TRACE_AS_FAST_AS_POSSIBLE
+  // Hand the next frame over only after the main thread has taken the previous one, so that every recorded frame gets processed
+  while(__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) > 0 && programRunning)
+    usleep(100);
+  if (!replayStartTime) replayStartTime = tick();
+  ReadNextTraceFrame(trace);
+#else
+  // Advance to the newest frame that has arrived by now on the recorded timeline
+  if (!replayStartTime) replayStartTime = tick();
+  const uint64_t now = tick() - replayStartTime;
+  while(trace.hasNextFrame && trace.nextFrame.timestamp <= now)
+    if (!ReadNextTraceFrame(trace))
+      break;
+#endif
+  lastFrameDelivered = !trace.hasNextFrame;
+
+  // The trace frame is already in framebuffer orientation, so only crop it
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  const uint16_t *src = trace.frame + excessPixelsTop * trace.header.width + excessPixelsLeft;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    memcpy(destination + y*stride, src + y*trace.header.width, gpuFrameWidth * 2);
+  return true;
+}
+
+void CloseFrameSource()
+{
+  CloseFrameTraceReader(trace);
+}
+
+#endif // ~USE_TRACE_FRAME_SOURCE
@@ -0,0 +1,336 @@
+#include "config.h"
+
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+
+#include <stdio.h> // printf, fopen
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog, LOG_ERR
+
+#include "virtual_panel.h"
+#include "display.h"
+#include "spi.h"
+#include "gpu.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#ifdef SPI_32BIT_COMMANDS
+// KeDei commands carry the command number in their highest byte, e.g. 0x2A001100
+#define PANEL_COMMAND(cmd) ((uint32_t)(cmd) >> 24)
+#else
+#define PANEL_COMMAND(cmd) (cmd)
+#endif
+
+extern volatile bool programRunning;
+
+#define PANEL_NOP 0x00
+#define PANEL_VERTICAL_SCROLLING_DEFINITION 0x33
+#define PANEL_MEMORY_ACCESS_CONTROL 0x36
+#define PANEL_VERTICAL_SCROLL_START_ADDRESS 0x37
+
+// MADCTL bits that change how the column and page addresses map to graphics RAM. (The BGR bit only swaps the subpixel order)
+#define MADCTL_ROW_ADDRESS_ORDER_SWAP (1<<7)
+#define MADCTL_COLUMN_ADDRESS_ORDER_SWAP (1<<6)
+#define MADCTL_ROW_COLUMN_EXCHANGE (1<<5)
+
+// Graphics RAM of the panel, DISPLAY_NATIVE_WIDTH x DISPLAY_NATIVE_HEIGHT pixels in R5G6B5 format, in native scan order
+static uint16_t *gram = 0;
+
+// Decoder state of the command currently being received
+static uint32_t command = PANEL_NOP;
+static uint32_t numParams = 0;
+static uint8_t params[12];
+static uint32_t pixel = 0;
+static int numPixelBytes = 0;
+
+// Address window and write cursor, in MADCTL-transformed column and page coordinates
+static int columnStart = 0, columnEnd = DISPLAY_NATIVE_WIDTH-1, pageStart = 0, pageEnd = DISPLAY_NATIVE_HEIGHT-1;
+static int cursorX = 0, cursorY = 0;
+static uint8_t madctl = 0;
+
+// Vertical scroll area, in native rows. scrollHeight == 0 if vertical scrolling has not been defined
+static int scrollTop = 0, scrollHeight = 0, scrollStart = 0;
+
+#if defined(SPI_3WIRE_PROTOCOL) && !defined(SPI_3WIRE_LOSSI_MODE)
+// Bits received on the bus that do not yet form a complete 9-bit or 32-bit word
+static uint32_t bitAccumulator = 0;
+static int numBitsAccumulated = 0;
+#elif defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
+static uint32_t wordAccumulator = 0;
+static int numBytesAccumulated = 0;
+static bool wordIsData = false;
+#endif
+
+// Bus traffic of the current frame, reset after each verification
+static uint64_t frameBytes = 0;
+static uint64_t frameCommands = 0;
+static uint64_t frameCursorCommands = 0;
+static uint64_t framePixelsWritten = 0;
+static uint64_t framePixelsClipped = 0;
+
+// Totals over the whole run
+static uint64_t numFramesVerified = 0;
+static uint64_t numFramesWithMismatches = 0;
+static uint64_t totalBytes = 0;
+static uint64_t totalCommands = 0;
+static uint64_t totalCursorCommands = 0;
+static uint64_t totalPixelsWritten = 0;
+static uint64_t totalPixelsClipped = 0;
+static uint64_t totalMismatchesToSent = 0;
+static uint64_t totalMismatchesToSource = 0;
+
+// Captured frames checked against the frame source, updated by the GPU polling thread
+static uint64_t numCapturedFramesChecked = 0;
+static uint64_t numCapturedFramesWithStalePixels = 0;
+static uint64_t totalCapturedStalePixels = 0;
+
+#ifdef VIRTUAL_PANEL_REPORT_FILE
+static FILE *reportFile = 0;
+#endif
+
+static inline void LogicalSize(int *width, int *height)
+{
+  bool exchange = (madctl & MADCTL_ROW_COLUMN_EXCHANGE);
+  *width = exchange ? DISPLAY_NATIVE_HEIGHT : DISPLAY_NATIVE_WIDTH;
+  *height = exchange ? DISPLAY_NATIVE_WIDTH : DISPLAY_NATIVE_HEIGHT;
+}
+
+// Maps a column and page address to the native graphics RAM coordinates, or returns false if the address is out of bounds
+static bool MapToGram(int x, int y, int *nativeX, int *nativeY)
+{
+  int width, height;
+  LogicalSize(&width, &height);
+  if (x < 0 || y < 0 || x >= width || y >= height) return false;
+  if ((madctl & MADCTL_COLUMN_ADDRESS_ORDER_SWAP)) x = width - 1 - x;
+  if ((madctl & MADCTL_ROW_ADDRESS_ORDER_SWAP)) y = height - 1 - y;
+  if ((madctl & MADCTL_ROW_COLUMN_EXCHANGE)) { *nativeX = y; *nativeY = x; }
+  else { *nativeX = x; *nativeY = y; }
+  return true;
+}
+
+static void WritePixel(uint16_t color)
+{
+  int nativeX, nativeY;
+  if (MapToGram(cursorX, cursorY, &nativeX, &nativeY))
+  {
+    gram[nativeY*DISPLAY_NATIVE_WIDTH + nativeX] = color;
+    ++framePixelsWritten;
+  }
+  else
+    ++framePixelsClipped;
+
+  // The write cursor advances in the address window from left to right, top to bottom, and wraps back to the top
+  if (++cursorX > columnEnd)
+  {
+    cursorX = columnStart;
+    if (++cursorY > pageEnd) cursorY = pageStart;
+  }
+}
+
+static void ReceiveCommand(uint32_t cmd)
+{
+  if (cmd == PANEL_NOP) return; // Also the zero padding at the end of 3-wire tasks
+  command = cmd;
+  numParams = 0;
+  numPixelBytes = 0;
+  ++frameCommands;
+  if (cmd == PANEL_COMMAND(DISPLAY_SET_CURSOR_X) || cmd == PANEL_COMMAND(DISPLAY_SET_CURSOR_Y)) ++frameCursorCommands;
+#ifdef DISPLAY_WRITE_PIXELS_CONTINUE
+  // Pixels that follow are written from where the cursor was left
+  if (cmd == PANEL_COMMAND(DISPLAY_WRITE_PIXELS_CONTINUE)) command = PANEL_COMMAND(DISPLAY_WRITE_PIXELS);
+#endif
+#ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+  if (cmd == PANEL_COMMAND(DISPLAY_WRITE_PIXELS))
+  {
+    cursorX = columnStart;
+    cursorY = pageStart;
+  }
+#endif
+}
+
+static void ReceiveParam(uint8_t byte)
+{
+  if (numParams >= sizeof(params)) return;
+  params[numParams++] = byte;
+
+  if (command == PANEL_COMMAND(DISPLAY_SET_CURSOR_X) || command == PANEL_COMMAND(DISPLAY_SET_CURSOR_Y))
+  {
+    // Each parameter takes effect as it is received, so partial commands that only update the start address work.
+    int *start = (command == PANEL_COMMAND(DISPLAY_SET_CURSOR_X)) ? &columnStart : &pageStart;
+    int *end = (command == PANEL_COMMAND(DISPLAY_SET_CURSOR_X)) ? &columnEnd : &pageEnd;
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+    if (numParams == 1) *start = params[0];
+    else if (numParams == 2) *end = params[1];
+#else
+    if (numParams == 2) *start = (params[0] << 8) | params[1];
+    else if (numParams == 4) *end = (params[2] << 8) | params[3];
+#endif
+#ifdef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    // On these controllers, setting the address window moves the write cursor directly.
+    if (command == PANEL_COMMAND(DISPLAY_SET_CURSOR_X)) cursorX = columnStart;
+    else cursorY = pageStart;
+#endif
+  }
+  else if (command == PANEL_MEMORY_ACCESS_CONTROL && numParams == 1)
+    madctl = params[0];
+  else if (command == PANEL_VERTICAL_SCROLLING_DEFINITION && numParams == 4)
+  {
+    scrollTop = (params[0] << 8) | params[1];
+    scrollHeight = (params[2] << 8) | params[3];
+  }
+  else if (command == PANEL_VERTICAL_SCROLL_START_ADDRESS && numParams == 2)
+    scrollStart = (params[0] << 8) | params[1];
+}
+
+static void ReceivePixelByte(uint8_t byte)
+{
+  pixel = (pixel << 8) | byte;
+  if (++numPixelBytes < SPI_BYTESPERPIXEL) return;
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  // Reverse the expansion that was done when the pixels were queued, to compare against the R5G6B5 framebuffer
+  WritePixel((uint16_t)(((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) | ((pixel >> 3) & 0x001F)));
+#else
+  WritePixel((uint16_t)pixel);
+#endif
+  pixel = 0;
+  numPixelBytes = 0;
+}
+
+// Decodes a command or data word that was received on the bus. On 16-bit wide buses, commands and parameters are carried
+// in the low byte of each word, and each pixel is one word.
+static void ReceiveWord(uint32_t word, bool isData, bool is16Bit)
+{
+  if (!isData) ReceiveCommand(is16Bit ? (word & 0xFF) : word);
+  else if (command == PANEL_COMMAND(DISPLAY_WRITE_PIXELS))
+  {
+    if (is16Bit) ReceivePixelByte((uint8_t)(word >> 8));
+    ReceivePixelByte((uint8_t)word);
+  }
+  else
+    ReceiveParam((uint8_t)word);
+}
+
+void VirtualPanelReceiveByte(uint8_t byte, bool isData)
+{
+  if (!gram) gram = (uint16_t*)Malloc(DISPLAY_NATIVE_WIDTH*DISPLAY_NATIVE_HEIGHT*sizeof(uint16_t), "virtual_panel.cpp graphics RAM");
+  ++frameBytes;
+
+#if defined(SPI_3WIRE_PROTOCOL) && SPI_3WIRE_DATA_COMMAND_FRAMING_BITS == 16
+  // KeDei: 32-bit words with a 16-bit prefix, 0x0011 for a command and 0x0015 for data, followed by the 16-bit command or data
+  bitAccumulator = (bitAccumulator << 8) | byte;
+  numBitsAccumulated += 8;
+  if (numBitsAccumulated < 32) return;
+  numBitsAccumulated = 0;
+  uint32_t prefix = bitAccumulator >> 16;
+  if (prefix == 0x0011 || prefix == 0x0015) ReceiveWord(bitAccumulator & 0xFFFF, prefix == 0x0015, true);
+#elif defined(SPI_3WIRE_PROTOCOL) && !defined(SPI_3WIRE_LOSSI_MODE)
+  // 9-bit words, where the first bit tells whether the following 8 bits are data (1) or a command (0), packed MSB first
+  bitAccumulator = (bitAccumulator << 8) | byte;
+  numBitsAccumulated += 8;
+  while(numBitsAccumulated >= 9)
+  {
+    numBitsAccumulated -= 9;
+    uint32_t word = (bitAccumulator >> numBitsAccumulated) & 0x1FF;
+    ReceiveWord(word & 0xFF, (word & 0x100) != 0, false);
+  }
+  bitAccumulator &= (1u << numBitsAccumulated) - 1;
+#elif defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
+  // Pairs of bytes form 16-bit words, the Data/Control line telling which ones are commands.
+  if (numBytesAccumulated > 0 && isData != wordIsData) numBytesAccumulated = 0; // D/C toggled mid-word, drop the half word
+  wordIsData = isData;
+  wordAccumulator = (wordAccumulator << 8) | byte;
+  if (++numBytesAccumulated < 2) return;
+  numBytesAccumulated = 0;
+  ReceiveWord(wordAccumulator & 0xFFFF, isData, true);
+#else
+  ReceiveWord(byte, isData, false);
+#endif
+}
+
+// Returns the pixel that the panel currently shows at the given display coordinates, after vertical scrolling
+static uint16_t DisplayedPixel(int x, int y)
+{
+  int nativeX, nativeY;
+  if (!MapToGram(x, y, &nativeX, &nativeY)) return 0;
+  if (scrollHeight > 0 && nativeY >= scrollTop && nativeY < scrollTop + scrollHeight)
+    nativeY = scrollTop + (((scrollStart - scrollTop) + (nativeY - scrollTop)) % scrollHeight + scrollHeight) % scrollHeight;
+  return gram[nativeY*DISPLAY_NATIVE_WIDTH + nativeX];
+}
+
+void VerifyVirtualPanel(const uint16_t *sourceFramebuffer, const uint16_t *sentFramebuffer)
+{
+  // The panel model is updated as the bytes are clocked out, so wait for the SPI thread to finish this frame
+  WaitForSPIQueueToReach(spiTaskMemory->queueTail);
+  __sync_synchronize();
+  if (!gram || !programRunning) return; // If quitting, the SPI thread stops before it has sent the whole frame
+
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  uint64_t mismatchesToSent = 0, mismatchesToSource = 0;
+  int firstMismatchX = -1, firstMismatchY = -1;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+    {
+      uint16_t displayed = DisplayedPixel(displayXOffset + x, displayYOffset + y);
+      if (displayed != sentFramebuffer[y*stride + x])
+      {
+        if (mismatchesToSent++ == 0) { firstMismatchX = x; firstMismatchY = y; }
+      }
+      if (displayed != sourceFramebuffer[y*stride + x]) ++mismatchesToSource;
+    }
+
+  if (mismatchesToSent > 0)
+  {
+    ++numFramesWithMismatches;
+    printf("Virtual panel: frame %llu shows %llu pixels that differ from what was sent, first at (%d,%d): displayed 0x%04X, sent 0x%04X\n",
+      (unsigned long long)numFramesVerified, (unsigned long long)mismatchesToSent, firstMismatchX, firstMismatchY,
+      DisplayedPixel(displayXOffset + firstMismatchX, displayYOffset + firstMismatchY), sentFramebuffer[firstMismatchY*stride + firstMismatchX]);
+  }
+
+#ifdef VIRTUAL_PANEL_REPORT_FILE
+  if (!reportFile)
+  {
+    reportFile = fopen(VIRTUAL_PANEL_REPORT_FILE, "w");
+    if (!reportFile) FATAL_ERROR("Failed to open VIRTUAL_PANEL_REPORT_FILE for writing!");
+    fprintf(reportFile, "frame,bytes,commands,cursorCommands,pixelsWritten,pixelsClipped,mismatchesToSent,mismatchesToSource\n");
+  }
+  fprintf(reportFile, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", (unsigned long long)numFramesVerified, (unsigned long long)frameBytes,
+    (unsigned long long)frameCommands, (unsigned long long)frameCursorCommands, (unsigned long long)framePixelsWritten,
+    (unsigned long long)framePixelsClipped, (unsigned long long)mismatchesToSent, (unsigned long long)mismatchesToSource);
+#endif
+
+  ++numFramesVerified;
+  totalBytes += frameBytes;
+  totalCommands += frameCommands;
+  totalCursorCommands += frameCursorCommands;
+  totalPixelsWritten += framePixelsWritten;
+  totalPixelsClipped += framePixelsClipped;
+  totalMismatchesToSent += mismatchesToSent;
+  totalMismatchesToSource += mismatchesToSource;
+  frameBytes = frameCommands = frameCursorCommands = framePixelsWritten = framePixelsClipped = 0;
+}
+
+void VirtualPanelCapturedFrame(int numStalePixels)
+{
+  __atomic_fetch_add(&numCapturedFramesChecked, 1, __ATOMIC_RELAXED);
+  if (numStalePixels == 0) return;
+  __atomic_fetch_add(&numCapturedFramesWithStalePixels, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&totalCapturedStalePixels, numStalePixels, __ATOMIC_RELAXED);
+}
+
+void PrintVirtualPanelReport()
+{
+#ifdef VIRTUAL_PANEL_REPORT_FILE
+  if (reportFile) fclose(reportFile);
+  reportFile = 0;
+#endif
+  if (numCapturedFramesChecked > 0)
+    printf("Virtual panel: %llu captured frames checked against the frame source, %llu had stale pixels (%llu pixels in total)\n",
+      (unsigned long long)numCapturedFramesChecked, (unsigned long long)numCapturedFramesWithStalePixels, (unsigned long long)totalCapturedStalePixels);
+  if (numFramesVerified == 0) return;
+  double frames = (double)numFramesVerified;
+  printf("Virtual panel: %llu frames verified, %llu frames showed pixels that differ from what was sent (%llu pixels in total)\n",
+    (unsigned long long)numFramesVerified, (unsigned long long)numFramesWithMismatches, (unsigned long long)totalMismatchesToSent);
+  printf("Virtual panel: per frame %.0f bytes, %.1f commands (%.1f set cursor), %.0f pixels written, %.0f pixels clipped, %.0f pixels stale against the frame source\n",
+    totalBytes / frames, totalCommands / frames, totalCursorCommands / frames, totalPixelsWritten / frames, totalPixelsClipped / frames, totalMismatchesToSource / frames);
+}
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "config.h"
+
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+
+#include <inttypes.h>
+
+// A software model of the display controller that sits at the end of the emulated SPI bus. It decodes the byte stream that
+// fbcp-ili9341 clocks out, in the framing of the display that is being built for (4-wire 8-bit, 16-bit wide command bus, 3-wire 9-bit,
+// or KeDei 32-bit), and interprets the set cursor, write pixels, memory access control (MADCTL) and vertical scroll commands to
+// reconstruct the contents of the display's graphics RAM. After each frame, the image that the panel would show is compared pixel
+// by pixel against the frame that was sent, to catch diffing, cursor and framing bugs without a physical display.
+
+// Called by the emulated SPI0 peripheral for each byte clocked out on the bus. isData is the state of the Data/Control GPIO pin.
+void VirtualPanelReceiveByte(uint8_t byte, bool isData);
+
+// Waits until the SPI thread has clocked out all queued tasks, and then compares the displayed image against the two framebuffers
+// of the main loop: sentFramebuffer is framebuffer[1], which tracks what should now be on the display, so any mismatch to it is
+// a bug. sourceFramebuffer is framebuffer[0], the newest frame from the frame source, and mismatches to it are pixels that the
+// frame was allowed to leave stale (interlacing, perceptual thresholds, ...).
+void VerifyVirtualPanel(const uint16_t *sourceFramebuffer, const uint16_t *sentFramebuffer);
+
+// Called by the frame sources that convert only the damaged areas of the source display, after comparing a whole captured frame
+// against the source. numStalePixels is the number of captured pixels that differ from the source, which should always be zero:
+// the panel verification above cannot catch these, since it compares against the captured frame.
+void VirtualPanelCapturedFrame(int numStalePixels);
+
+// Prints out the totals of what was verified over the run
+void PrintVirtualPanelReport(void);
+
+#endif
@@ -0,0 +1,172 @@
+#include "config.h"
+#include "frame_source.h"
+
+#ifdef USE_X11_FRAME_SOURCE
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h> // XDestroyImage
+#include <X11/extensions/XShm.h> // XShmQueryExtension, XShmCreateImage, XShmAttach, XShmGetImage, XShmDetach
+#include <X11/extensions/Xdamage.h> // XDamageQueryExtension, XDamageCreate, XDamageNotifyEvent, XDamageDestroy
+#include <poll.h> // poll
+#include <stdio.h> // printf
+#include <stdlib.h> // exit, getenv
+#include <sys/ipc.h> // IPC_PRIVATE, IPC_CREAT, IPC_RMID
+#include <sys/shm.h> // shmget, shmat, shmdt, shmctl
+#include <syslog.h> // syslog
+
+#include "gpu.h"
+#include "util.h"
+#include "virtual_panel.h"
+
+static Display *x11Display = 0;
+static Window x11Root;
+static XImage *x11Image = 0;
+static XShmSegmentInfo x11Shm;
+static Damage x11Damage = 0;
+static int x11DamageEventBase = 0;
+static int sourceWidth = 0, sourceHeight = 0;
+
+static DamageList captureDamage; // Areas of the X screen that the next capture needs to convert, only accessed by the GPU polling thread.
+
+void OpenFrameSource(int *width, int *height)
+{
+  const char *displayName = getenv("DISPLAY") ? getenv("DISPLAY") : X11_FRAME_SOURCE_DISPLAY;
+  x11Display = XOpenDisplay(displayName);
+  if (!x11Display)
+  {
+    printf("Failed to connect to X display %s\n", displayName);
+    FATAL_ERROR("XOpenDisplay failed!");
+  }
+  if (!XShmQueryExtension(x11Display)) FATAL_ERROR("The X server does not support the MIT-SHM extension!");
+  int damageErrorBase;
+  if (!XDamageQueryExtension(x11Display, &x11DamageEventBase, &damageErrorBase)) FATAL_ERROR("The X server does not support the XDamage extension!");
+
+  const int screen = DefaultScreen(x11Display);
+  x11Root = RootWindow(x11Display, screen);
+  sourceWidth = DisplayWidth(x11Display, screen);
+  sourceHeight = DisplayHeight(x11Display, screen);
+  printf("Capturing frames from X display %s: %dx%d pixels, depth %d\n", displayName, sourceWidth, sourceHeight, DefaultDepth(x11Display, screen));
+  *width = sourceWidth;
+  *height = sourceHeight;
+}
+
+void SetupFrameSourceCapture()
+{
+  const int screen = DefaultScreen(x11Display);
+  x11Image = XShmCreateImage(x11Display, DefaultVisual(x11Display, screen), DefaultDepth(x11Display, screen), ZPixmap, 0, &x11Shm, sourceWidth, sourceHeight);
+  if (!x11Image) FATAL_ERROR("XShmCreateImage failed!");
+  bool isR5G6B5 = x11Image->bits_per_pixel == 16 && x11Image->red_mask == 0xF800 && x11Image->green_mask == 0x07E0 && x11Image->blue_mask == 0x001F;
+  bool isX8R8G8B8 = x11Image->bits_per_pixel == 32 && x11Image->red_mask == 0xFF0000 && x11Image->green_mask == 0xFF00 && x11Image->blue_mask == 0xFF;
+  if (!isR5G6B5 && !isX8R8G8B8)
+  {
+    printf("The X screen is in %d bits per pixel mode with color masks %lx/%lx/%lx, but fbcp-ili9341 supports only R5G6B5 and X8R8G8B8.\n", x11Image->bits_per_pixel, x11Image->red_mask, x11Image->green_mask, x11Image->blue_mask);
+    FATAL_ERROR("Unsupported X screen pixel format!");
+  }
+
+  x11Shm.shmid = shmget(IPC_PRIVATE, x11Image->bytes_per_line * x11Image->height, IPC_CREAT | 0600);
+  if (x11Shm.shmid < 0) FATAL_ERROR("shmget failed!");
+  x11Shm.shmaddr = x11Image->data = (char*)shmat(x11Shm.shmid, 0, 0);
+  if (x11Shm.shmaddr == (char*)-1) FATAL_ERROR("shmat failed!");
+  x11Shm.readOnly = False;
+  if (!XShmAttach(x11Display, &x11Shm)) FATAL_ERROR("XShmAttach failed!");
+  XSync(x11Display, False);
+  shmctl(x11Shm.shmid, IPC_RMID, 0); // Now that the X server has attached to the segment, have it freed as soon as both sides detach
+
+  // Raw rectangles are reported as they are drawn, without needing to XDamageSubtract() them back out of the Damage object
+  x11Damage = XDamageCreate(x11Display, x11Root, XDamageReportRawRectangles);
+  XFlush(x11Display);
+
+  // The first frame is captured and diffed as a whole
+  AddToDamageList(captureDamage, 0, 0, sourceWidth, sourceHeight);
+}
+
+bool WaitForFrameSourceDamage()
+{
+  if (captureDamage.numRects == 0 && !XPending(x11Display))
+  {
+    pollfd fd = { ConnectionNumber(x11Display), POLLIN, 0 };
+    poll(&fd, 1, 100);
+  }
+
+  while(XPending(x11Display))
+  {
+    XEvent event;
+    XNextEvent(x11Display, &event);
+    if (event.type != x11DamageEventBase + XDamageNotify)
+      continue;
+
+    const XRectangle &area = ((XDamageNotifyEvent*)&event)->area;
+    AddToDamageList(captureDamage, area.x, area.y, area.x + area.width, area.y + area.height);
+  }
+  return captureDamage.numRects > 0;
+}
+
+static inline uint16_t SourcePixel(int x, int y)
+{
+  const uint8_t *scanline = (const uint8_t*)x11Image->data + y * x11Image->bytes_per_line;
+  if (x11Image->bits_per_pixel == 16)
+    return ((const uint16_t*)scanline)[x];
+  uint32_t pixel = ((const uint32_t*)scanline)[x];
+  return ((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) | ((pixel >> 3) & 0x001F);
+}
+
+bool CaptureFrameSource(uint16_t *destination)
+{
+  if (!XShmGetImage(x11Display, x11Root, x11Image, 0, 0, AllPlanes))
+  {
+    printf("XShmGetImage failed!\n");
+    return false;
+  }
+
+  // Convert only the areas that XDamage has reported since the previous capture into this framebuffer
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  const DamageList &convert = DamageSinceLastCaptureInto(destination, captureDamage);
+  for(int i = 0; i < convert.numRects; ++i)
+  {
+    int x, y, endX, endY;
+    if (!SourceRectToFramebufferRect(convert.rects[i], &x, &y, &endX, &endY))
+      continue;
+    for(; y < endY; ++y)
+      for(int X = x; X < endX; ++X)
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+        destination[y*stride + X] = SourcePixel(excessPixelsTop + y, excessPixelsLeft + X);
+#else
+        destination[y*stride + X] = SourcePixel(excessPixelsLeft + X, excessPixelsTop + y);
+#endif
+  }
+  for(int i = 0; i < captureDamage.numRects; ++i)
+    AddCapturedDamage(captureDamage.rects[i]);
+  captureDamage.numRects = 0;
+
+#ifdef VERIFY_WITH_VIRTUAL_PANEL
+  // Check that the framebuffer now holds the whole X screen, and not only the areas that were converted
+  int numStalePixels = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+      numStalePixels += destination[y*stride + x] != SourcePixel(excessPixelsTop + y, excessPixelsLeft + x);
+#else
+      numStalePixels += destination[y*stride + x] != SourcePixel(excessPixelsLeft + x, excessPixelsTop + y);
+#endif
+  VirtualPanelCapturedFrame(numStalePixels);
+#endif
+  return true;
+}
+
+void CloseFrameSource()
+{
+  if (!x11Display) return;
+  if (x11Damage) XDamageDestroy(x11Display, x11Damage);
+  if (x11Image)
+  {
+    XShmDetach(x11Display, &x11Shm);
+    x11Image->data = 0; // The pixels live in the shared memory segment, which XDestroyImage() must not free()
+    XDestroyImage(x11Image);
+    shmdt(x11Shm.shmaddr);
+    x11Image = 0;
+  }
+  XCloseDisplay(x11Display);
+  x11Display = 0;
+}
+
+#endif // ~USE_X11_FRAME_SOURCE